@@ -35,18 +35,34 @@
 // THE SOFTWARE.
 
 #define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64 // 64-bit off_t, fseeko and pread on 32-bit hosts too
 
 #include <stdio.h>
 #include <unistd.h>
 // #include <sys/wait.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
-#define MAX_NUM_ARGUMENTS 5
+#if defined( __SSE2__ )
+#include <emmintrin.h>
+#endif
+#if defined( __x86_64__ )
+#include <immintrin.h> // crc32 and SHA instructions, used only after checking the processor has them
+#endif
+
+#define MAX_NUM_ARGUMENTS 16
 
 #define WHITESPACE " \t\n" // We want to split our command line up into tokens
                            // so we need to define what delimits our tokens.
@@ -55,6 +71,60 @@
 
 #define MAX_COMMAND_SIZE 255 // The maximum command-line size
 
+#define LFN_ATTR 0x0f        // Attribute value that marks a VFAT long filename entry
+#define LFN_LAST_ENTRY 0x40  // Ordinal flag set on the final (first stored) long filename entry
+#define LFN_CHARS_PER_ENTRY 13
+#define LFN_MAX_UNITS 260 // 20 long filename entries * 13 UTF-16 characters
+
+#define SCAN_BLOCK 64 // Directory entries classified per pass, one bit per entry in a uint64_t
+
+#define INDEX_MAGIC "MFSINDEX"    // First 8 bytes of a sidecar index file
+#define INDEX_VERSION 4           // Bumped whenever the layout of the index changes
+#define INDEX_SUFFIX ".mfsidx"    // Sidecar index of image.img is image.img.mfsidx
+#define INDEX_NONE 0xffffffffu    // Dentry index meaning "no dentry"
+#define FAT_SAMPLES 64            // FAT sectors an index is checked against when it is loaded
+#define TOTALS_UNKNOWN UINT64_MAX // total_clusters of a directory whose subtree has not been summed
+
+#define OUTPUT_BUFFER_SIZE ( 1 << 20 ) // Bytes collected before one write() of command output
+#define MAX_WORKERS 16                 // Upper bound on worker threads of a parallel walk
+#define COPY_BUFFER_SIZE ( 4 << 20 )   // Bytes read from the image at a time when extracting
+#define SPLIT_CHUNK_SIZE ( 16 << 20 )  // Default share of a large file one worker of get copies
+#define SPLICE_PIPE_SIZE ( 1 << 20 )   // Pipe buffer asked for when splicing to standard output
+#define PREFETCH_EMPTY ( ( size_t )-1 ) // Length of a prefetch buffer that holds nothing
+#define TAR_BLOCK 512
+#define TAR_RECORD 10240               // 20 blocks, the size tar pads an archive to
+#define COPY_QUEUE_SIZE 256            // Files found by get -r waiting to be copied
+#define TREE_CHUNK 4096                // Directory tree nodes allocated at a time
+#define TREE_MAX_CHUNKS 65536          // Chunk table size, enough for 268 million directories
+
+#define FIND_ATTR 0    // Fields a compiled find test looks at, see compile_find()
+#define FIND_SIZE 1
+#define FIND_CLUSTER 2
+#define FIND_STAMP 3
+#define FIND_MAX_PATTERNS 4
+
+#define HASH_NONE 0 // Checksums an extraction can compute, see hasher_init()
+#define HASH_CRC32C 1
+#define HASH_XXH3 2
+#define HASH_SHA256 3
+#define HASH_HEX_SIZE 65 // Longest digest in hex, SHA-256, and its terminator
+#define XXH3_BUFFER 256  // Input a streaming XXH3 holds back, see xxh3_update()
+
+#define READ_HEX 0 // Output modes of read, see read_file()
+#define READ_RAW 1
+#define READ_HEXDUMP 2
+#define READ_BASE64 3
+
+#define STRINGS_MIN 4 // Shortest run of printable bytes strings prints unless -n says otherwise
+
+#define EXTENT_BY_ADDRESS 0 // Trees of the free extent index, see struct FreeExtent
+#define EXTENT_BY_SIZE 1
+#define ALLOC_GROUP_MIN 4096 // Fewest clusters in an allocation group
+#define ALLOC_GROUPS_MAX 64  // Most allocation groups, one bit each in a uint64_t
+
+#define GREP_PATTERN_MAX 128 // Longest pattern grep searches for
+#define GREP_CONTEXT_MAX 64  // Most bytes grep -C shows on either side of a match
+
 // Struct holding the information of each entry in the FAT32 directory
 struct __attribute__( ( __packed__ ) ) DirectoryEntry
 {
@@ -67,6 +137,68 @@ struct __attribute__( ( __packed__ ) ) DirectoryEntry
     uint32_t DIR_FileSize;
 };
 
+// Struct holding a VFAT long filename entry. It shares the 32-byte slot of a DirectoryEntry
+// and is stored in reverse order directly in front of the short entry it belongs to.
+struct __attribute__( ( __packed__ ) ) LongNameEntry
+{
+    uint8_t LDIR_Ord;
+    uint16_t LDIR_Name1[ 5 ];
+    uint8_t LDIR_Attr;
+    uint8_t LDIR_Type;
+    uint8_t LDIR_Chksum;
+    uint16_t LDIR_Name2[ 6 ];
+    uint16_t LDIR_FstClusLO;
+    uint16_t LDIR_Name3[ 2 ];
+};
+
+// Struct holding a long filename as it is assembled while a directory is iterated
+struct LongName
+{
+    uint16_t chars[ LFN_MAX_UNITS ]; // UTF-16 characters, not terminated
+    int length;                      // number of UTF-16 characters in the name
+    int next_ord;                    // ordinal of the next long filename entry expected
+    uint8_t checksum;                // checksum of the short entry the sequence belongs to
+    uint32_t hash;                   // case-folded hash, valid once the short entry is reached
+    int valid;
+};
+
+// Struct holding user input expanded to the layout of DIR_Name. Both names are padded
+// to 16 bytes so they can be compared against an entry with one vector compare.
+struct SearchKey
+{
+    uint8_t name[ 16 ];    // name as stored for a live entry
+    uint8_t deleted[ 16 ]; // same name with the first byte replaced by 0xe5
+    int valid;             // 0 if the input cannot be an 8.3 name
+};
+
+// Struct holding one bit per directory entry for a block of up to SCAN_BLOCK entries.
+// Bit i describes entry i of the block.
+struct EntryMasks
+{
+    uint64_t live;      // in use short entries, excluding long filename entries and volume labels
+    uint64_t deleted;   // entries whose first byte is 0xe5
+    uint64_t lfn;       // in use long filename entries
+    uint64_t directory; // in use sub-directories
+    uint64_t plain;     // read-only files, sub-directories and archives, deleted or not
+    uint64_t end;       // the 0x00 end of directory marker and every entry after it
+};
+
+// Struct holding the state of a walk over the short entries of a directory entry array.
+// Long filename entries are consumed by the walk and attached to the short entry they precede.
+struct DirectoryWalk
+{
+    struct DirectoryEntry *dir;
+    int count;
+    int base;           // first entry of the block currently classified
+    uint64_t bits;      // entries of the current block still to be visited
+    uint64_t select;    // 0 for every live entry, or 1 for live read-only files, sub-directories and archives only
+    int end;            // set once the end of directory marker was classified
+    int previous;       // last entry visited, to detect gaps inside a long filename sequence
+    int lfn_first;      // first long filename entry of the current sequence, -1 if none
+    struct LongName name;
+    int has_long_name;  // set if name holds the long name of the entry last returned
+};
+
 // Struct holding information about the FAT32 directory
 struct f32info
 {
@@ -77,6 +209,7 @@ struct f32info
     int8_t BPB_NumFATS;
     int16_t BPB_RootEntCnt;
     char BS_VolLab[ 11 ];
+    int32_t BPB_TotSec32;
     int32_t BPB_FATSz32;
     int32_t BPB_RootClus;
 
@@ -85,15 +218,519 @@ struct f32info
     int32_t FirstSectorofCluster;
 };
 
+// Struct holding the header of a volume index. The index is a single position independent block
+// (header, dentries, extents, FAT sector hashes, directory cluster hashes, free cluster bitmap, names)
+// that is identical in memory and on disk.
+struct IndexHeader
+{
+    char magic[ 8 ];
+    uint32_t version;
+    uint32_t cluster_count; // clusters covered by the free bitmap, including the 2 reserved ones
+    uint64_t boot_hash;     // hash of the boot sector of the image the index was built from
+    uint64_t fsinfo_hash;   // hash of its FSInfo sector, 0 if it has none
+    uint64_t fingerprint;   // hash of the FAT sector hashes of that image
+    uint64_t file_size;
+    uint32_t dentry_count;
+    uint32_t extent_count;
+    uint64_t names_size;
+    uint32_t fat_sector_count;
+    uint32_t reserved;
+    uint64_t dir_hash_count;
+    uint64_t dentry_offset; // offsets of the sections from the start of the header
+    uint64_t extent_offset;
+    uint64_t fat_hash_offset;
+    uint64_t dir_hash_offset;
+    uint64_t bitmap_offset;
+    uint64_t names_offset;
+};
+
+// Struct holding one file or directory of the volume index. Dentry 0 is the root directory and
+// the children of a directory are stored contiguously from first_child.
+struct IndexDentry
+{
+    uint32_t parent;
+    uint32_t first_child;   // INDEX_NONE for files and empty directories
+    uint32_t child_count;
+    uint32_t name_offset;   // UTF-8 long name, or the 8.3 name as "NAME.EXT"
+    uint32_t first_cluster;
+    uint32_t size;          // DIR_FileSize
+    uint32_t extent_first;  // extents of the cluster chain
+    uint32_t extent_count;
+    uint32_t entry_cluster; // cluster holding the short directory entry, 0 for the root
+    uint32_t entry_index;   // index of the short entry within its directory
+    uint32_t hash_first;    // hashes of the clusters of a directory, in chain order
+    uint32_t hash_count;
+    uint16_t write_time;
+    uint16_t write_date;
+    uint8_t attr;
+    uint8_t has_long_name; // 1 if the name is a long name, 0 if it is the 8.3 name
+    char short_name[ 11 ];
+    uint8_t dot_attr[ 2 ]; // attributes of the "." and ".." entries of a directory, 0 if it has none
+    uint8_t unused[ 5 ];
+    uint64_t total_size;     // DIR_FileSize summed over the subtree, see compute_totals()
+    uint64_t total_clusters; // clusters allocated to the subtree, or TOTALS_UNKNOWN
+};
+
+// Struct holding a run of consecutive clusters of a chain
+struct IndexExtent
+{
+    uint32_t cluster;
+    uint32_t length;
+};
+
+// Struct holding a volume index and where its sections are
+struct VolumeIndex
+{
+    void *base;
+    uint64_t size;
+    int mapped; // 1 if base is a mapping of the sidecar file, 0 if it was allocated
+    struct IndexHeader *header;
+    struct IndexDentry *dentries;
+    struct IndexExtent *extents;
+    char *names;
+    uint64_t *free_map; // one bit per cluster, set if the cluster is free
+    uint64_t *fat_hashes;
+    uint64_t *dir_hashes;
+    uint32_t *directory_slots; // hash table from first cluster to directory dentry, see index_directory()
+    uint32_t directory_mask;
+    pthread_mutex_t lock; // guards building directory_slots, directories are listed by parallel walks
+};
+
+// Struct holding the growing sections of an index while it is built
+struct IndexBuilder
+{
+    struct IndexDentry *dentries;
+    uint64_t dentry_count, dentry_capacity;
+    struct IndexExtent *extents;
+    uint64_t extent_count, extent_capacity;
+    char *names;
+    uint64_t names_size, names_capacity;
+    uint64_t *dir_hashes;
+    uint64_t dir_hash_count, dir_hash_capacity;
+
+    struct VolumeIndex *previous; // index of an earlier state of the image, or NULL
+    uint32_t *origins;            // dentry of the previous index each new dentry corresponds to
+    uint64_t origin_capacity;
+    uint8_t *changed_sectors;     // 1 for every FAT sector whose hash differs from the previous index
+    uint32_t fat_sector_count, changed_sector_count;
+    uint32_t entries_per_sector;  // FAT entries in one sector
+    uint64_t directory_count, directories_parsed, chains_walked, chains_reused;
+};
+
 // Struct for holding deleted filenames
 struct deletedFile
 {
     char name[ 11 ];
+    uint32_t directory; // first cluster of the directory holding the entry
+    uint32_t entry;     // index of the entry in that directory
     struct deletedFile *next;
 };
 
+// Buffered output written straight to a file descriptor
+struct OutputBuffer
+{
+    int fd;
+    char *data;
+    size_t used, capacity;
+    int failed; // set once a write fails, later output is dropped
+};
+
+// Text assembled by a worker
+struct Text
+{
+    char *data;
+    uint64_t length, capacity;
+};
+
+// Deque of work items owned by one worker
+struct WorkDeque
+{
+    pthread_mutex_t lock;
+    uint32_t *items;
+    uint64_t head, tail, capacity; // items[ head ] is the oldest, items[ tail - 1 ] the newest
+};
+
+struct WorkPool;
+
+struct WorkerArgument
+{
+    struct WorkPool *pool;
+    int worker;
+};
+
+// Work stealing pool, see pool_take()
+struct WorkPool
+{
+    int workers;     // threads running
+    int deque_count; // deques allocated
+    struct WorkDeque *deques;
+    pthread_t *threads;
+    struct WorkerArgument *arguments;
+    uint64_t outstanding; // items queued or running
+    uint64_t pushes;      // items pushed so far, tells an idle worker whether to look again
+    int waiting;          // idle workers blocked on more_work
+    pthread_mutex_t idle_lock;
+    pthread_cond_t more_work; // signalled when an item is pushed or the last one finishes
+    void ( *run )( struct WorkPool *pool, int worker, uint32_t item );
+    void *context;
+};
+
+// Loop whose items are handed out to workers in order, see parallel_for()
+struct ParallelFor
+{
+    uint32_t next, count;
+    void ( *run )( void *context, int worker, uint32_t item );
+    void *context;
+};
+
+struct ParallelWorker
+{
+    struct ParallelFor *loop;
+    int worker;
+};
+
+// One directory of a parallel walk, see walk_tree()
+struct TreeNode
+{
+    uint32_t cluster;  // first cluster of the directory
+    char *path;        // path printed for the directory
+    struct Text text;  // output of the directory
+    uint32_t *children; // sub-directory nodes in directory entry order
+    uint64_t child_count, child_capacity;
+    int depth;         // 0 for the directory the walk started in
+    int done;          // text and children are complete
+};
+
+struct DirectoryTree
+{
+    struct TreeNode **chunks;
+    uint32_t count;
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // signalled whenever a node is done
+    uint64_t *visited;      // one bit per cluster, guards against directory loops
+    uint32_t clusters;      // clusters of the volume, see volume_clusters()
+    struct f32info *f32;
+    FILE *fp;
+};
+
+// One compiled find test. Range tests pass if low <= field <= high. The attribute test passes if
+// every bit of low is set and every bit of high is clear.
+struct FindTest
+{
+    int field;
+    uint64_t low, high;
+};
+
+struct FindFilter
+{
+    struct FindTest test[ 4 ]; // at most one per field, cheapest first
+    int test_count;
+    const char *pattern[ FIND_MAX_PATTERNS ]; // name globs, all must match
+    int pattern_count;
+    int min_depth, max_depth;
+    int empty; // set if the tests contradict each other and nothing can match
+};
+
+struct FindSearch
+{
+    struct DirectoryTree tree;
+    struct FindFilter filter;
+};
+
+struct Xxh3State
+{
+    uint64_t lanes[ 8 ] __attribute__( ( aligned( 16 ) ) );
+    uint8_t buffer[ XXH3_BUFFER ];
+    uint8_t last[ 64 ]; // last stripe consumed, the final stripe may overlap it
+    size_t buffered, stripe;
+    uint64_t length;
+};
+
+struct Sha256State
+{
+    uint32_t state[ 8 ];
+    uint8_t buffer[ 64 ];
+    size_t buffered;
+    uint64_t length;
+    void ( *blocks )( uint32_t *state, const uint8_t *data, size_t blocks );
+};
+
+// Checksum computed while a file is copied
+struct Hasher
+{
+    int kind;
+    uint32_t crc;
+    uint32_t ( *crc_update )( uint32_t crc, const uint8_t *data, size_t length );
+    struct Xxh3State xxh;
+    struct Sha256State sha;
+};
+
+// Options of get, mget and hashsum: --hash <algorithm>, --manifest <file>, --verify <file>,
+// --workers <count> and --chunk <size>
+struct CopyOptions
+{
+    int kind;
+    char *manifest, *verify;
+    int workers;    // 0 for one per processor
+    uint64_t chunk; // bytes of a large file each worker of get copies at a time
+};
+
+// Part of a file that get copies on its own worker, see extract_split()
+struct SplitPiece
+{
+    uint64_t offset; // in the file
+    uint32_t cluster;
+    uint64_t size;
+};
+
+struct SplitCopy
+{
+    struct f32info *f32;
+    FILE *fp;
+    int fd;
+    struct SplitPiece *pieces;
+    uint8_t *buffers[ MAX_WORKERS ];
+    uint64_t copied;
+    uint64_t complete; // the file is whole up to here, the lowest offset a piece stopped short at
+    int error;         // errno of the first failure
+};
+
+struct ManifestLine
+{
+    char digest[ HASH_HEX_SIZE ];
+    char *name;
+};
+
+// Checksums of --verify, sorted by name
+struct Manifest
+{
+    struct ManifestLine *lines;
+    uint32_t count;
+    int kind;
+};
+
+// One file to copy out of the image
+struct ExtractJob
+{
+    uint32_t cluster; // first cluster
+    uint64_t size;
+    char *host_path;
+    const char *name;              // name in a manifest, the end of host_path
+    char digest[ HASH_HEX_SIZE ]; // filled in when a checksum was asked for
+};
+
+struct Extraction
+{
+    struct f32info *f32;
+    FILE *fp;
+    struct ExtractJob *jobs;
+    uint32_t count;
+    int hash_kind;
+    uint8_t *buffers[ MAX_WORKERS ]; // copy buffer of each worker
+    uint32_t files;                  // files extracted
+    uint64_t bytes;                  // bytes extracted
+};
+
+// Bounded queue of files between the walk and the copy workers of get -r
+struct CopyQueue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+    pthread_cond_t finished; // signalled when the last copy worker is done
+    struct ExtractJob jobs[ COPY_QUEUE_SIZE ];
+    uint32_t head, count;
+    int closed; // set once the walk is over
+};
+
+struct PendingDirectory
+{
+    uint32_t cluster;
+    char *host_path;
+};
+
+struct TreeExtraction
+{
+    struct Extraction extraction;
+    struct CopyQueue queue;
+    struct PendingDirectory *pending; // directories found but not walked yet
+    uint64_t depth, pending_capacity;
+    uint64_t *visited; // one bit per cluster, guards against directory loops
+    uint32_t directories, errors;
+    int running; // copy workers that have not finished, guarded by the queue lock
+};
+
+// Formatter state of read, carried from one block of the file to the next
+struct ReadOutput
+{
+    int mode;
+    struct OutputBuffer out;
+    uint64_t offset;        // file offset of the next hexdump line
+    uint8_t carry[ 16 ];    // bytes of an incomplete hexdump line or base64 group
+    int carried;
+    uint8_t previous[ 16 ]; // last hexdump line written, to squeeze repeats
+    int have_previous, squeezing;
+    size_t column; // characters on the current base64 line
+};
+
+// Files of a hashsum, hashed by the workers of a parallel_for()
+struct HashSum
+{
+    struct DirectoryTree tree;
+    struct Extraction extraction;
+    uint64_t capacity; // jobs allocated
+    struct OutputBuffer out;
+    pthread_mutex_t lock;    // guards the jobs during the walk and the output while hashing
+    struct timespec flushed; // last time the output was flushed
+    uint32_t errors;
+};
+
+// Block of data a strings worker scans, one pread of a file chain or of a run of free clusters
+struct StringsPiece
+{
+    uint64_t offset; // image offset of the first byte
+    uint32_t size;
+    int continued;   // 1 if the data carries on from the end of the piece before it
+    int all_printable;
+    struct Text lines; // strings that start and end inside the piece, ready to print
+    struct Text head;  // printable bytes the piece starts with, the rest of a string of the piece before
+    struct Text tail;  // printable bytes the piece ends with, the start of a string of the next piece
+};
+
+// Pieces of a strings scan, scanned a batch at a time by the workers of a parallel_for()
+struct StringsScan
+{
+    struct f32info *f32;
+    FILE *fp;
+    struct StringsPiece *pieces;
+    uint32_t first; // piece item 0 of the current batch stands for
+    uint64_t minimum;
+    uint8_t *buffers[ MAX_WORKERS ];
+    int error;
+};
+
+// Files of a grep, collected by hashsum_visit() and searched by the workers of a parallel_for()
+struct GrepSearch
+{
+    struct HashSum sum;
+    uint8_t pattern[ GREP_PATTERN_MAX ];
+    uint32_t length;
+    uint32_t context; // bytes shown on either side of a match, 0 for none
+    int names_only;   // 1 to print only the names of files that match
+    uint32_t files;   // files with a match
+    uint64_t matches;
+};
+
+// Run of free clusters in the free extent index. Each extent is a node of two treaps over the same
+// nodes, one ordered by first cluster to merge neighbours and one by length for best fit allocation.
+struct FreeExtent
+{
+    uint32_t first;
+    uint32_t count;
+    uint32_t priority;                         // random, higher priorities sit nearer the root
+    struct FreeExtent *left[ 2 ], *right[ 2 ]; // children in each tree, see EXTENT_BY_ADDRESS
+};
+
+struct FreeExtents
+{
+    struct FreeExtent *root[ 2 ];
+    uint32_t count;    // extents
+    uint64_t clusters; // free clusters in them
+    uint32_t seed;     // state of the priority generator
+};
+
+// Slice of the clusters with its own free extents. A worker that allocates from a group owns it
+// until it is done, see claim_group(), so concurrent writers never share a tree and need no lock.
+struct AllocationGroup
+{
+    struct FreeExtents extents;
+    uint32_t start, end; // first cluster of the group and one past its last
+    int owner;           // 0 if unowned, otherwise the owning worker + 1
+};
+
+struct Allocator
+{
+    struct AllocationGroup *groups; // NULL until build_free_extents()
+    uint32_t group_count;
+    uint32_t group_size; // clusters per group, the last one may have fewer
+};
+
+// Run of consecutive clusters of a file being written
+struct ClusterRun
+{
+    uint32_t first;
+    uint32_t count;
+};
+
+// Directory a put or mput adds entries to
+struct PutTarget
+{
+    uint32_t cluster;               // first cluster of the directory
+    struct DirectoryEntry *entries; // as read by read_directory()
+    int count;
+    uint32_t *chain; // clusters of the directory in chain order
+    uint32_t chain_length;
+    uint64_t chain_capacity;
+    uint32_t grown; // clusters the directory grew by
+};
+
+// One host file of a put or mput
+struct PutJob
+{
+    char *host_path;
+    const char *name; // as given, for messages
+    char short_name[ 11 ];
+    struct stat host;
+    struct ClusterRun *runs; // clusters reserved for the file, see group_allocate()
+    uint64_t capacity;
+    uint32_t run_count;
+    int ok; // 1 once the data is written and the chain linked
+};
+
+// Files of a put or mput, written by the workers of a parallel_for()
+struct PutBatch
+{
+    struct f32info *f32;
+    FILE *fp;
+    struct PutJob *jobs;
+    uint32_t home; // allocation group of the directory
+    int workers;
+};
+
+// Reader thread that fills two buffers in turn, see prefetch_worker()
+struct Prefetcher
+{
+    struct f32info *f32;
+    FILE *fp;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    uint8_t *data[ 2 ];
+    size_t length[ 2 ]; // bytes in each buffer, or PREFETCH_EMPTY
+    int slot;           // buffer the consumer takes next
+    uint32_t cluster;   // file requested
+    uint64_t size;
+    int requested, quit;
+};
+
+struct TarStream
+{
+    struct OutputBuffer out;
+    struct Prefetcher prefetcher;
+    uint64_t written; // bytes of archive so far
+    uint32_t files, errors;
+};
+
 struct deletedFile *head = NULL;
 
+uint32_t *fat_table = NULL;             // first FAT of the open image, loaded by load_fat()
+uint32_t fat_entries = 0;               // number of clusters described by fat_table
+struct VolumeIndex *volume_index = NULL; // index of the open image, see get_index()
+struct VolumeIndex *stale_index = NULL;  // index from before the last modification, see invalidate_index()
+char *index_path = NULL;                // path of the sidecar index of the open image
+uint8_t *fat_dirty = NULL;              // one byte per FAT sector changed by fat_store() and not yet written
+struct Allocator allocator;             // free clusters of the open image by group, see build_free_extents()
+uint32_t cwd_cluster = 0;               // first cluster of the current working directory held in dir
+
 // Creates and initializes deleted file
 struct deletedFile *create_deletedFile()
 {
@@ -104,28 +741,32 @@ struct deletedFile *create_deletedFile()
 
 /*
  * Function    : LBAToOffset
- * Parameters  : The current sector number that points to a block of data and struct of the fat32 directory information
+ * Parameters  : The current cluster number that points to a block of data and struct of the fat32 directory information
  * Returns     : The value of the address for that block of data
- * Description : Finds the starting address of a block of data given the sector number
- *               corresponding to that data block.
+ * Description : Finds the starting address of a block of data given the cluster number
+ *               corresponding to that data block. The sum is done in 64 bits, since data past
+ *               2 GiB is common and a FAT32 volume reaches 2 TiB.
  */
 
-int LBAToOffset( int32_t sector, struct f32info *f32 )
+off_t LBAToOffset( uint32_t sector, struct f32info *f32 )
 {
-    return ( ( sector - 2 ) * f32->BPB_BytsPerSec ) + ( f32->BPB_BytsPerSec * f32->BPB_RsvdSecCnt ) + ( f32->BPB_NumFATS * f32->BPB_FATSz32 * f32->BPB_BytsPerSec );
+    uint64_t fat_sectors = ( uint64_t )( uint8_t )f32->BPB_NumFATS * ( uint32_t )f32->BPB_FATSz32;
+    uint64_t first_sector = ( uint64_t )( sector - 2 ) * ( uint8_t )f32->BPB_SecPerClus + ( uint16_t )f32->BPB_RsvdSecCnt + fat_sectors;
+    return ( off_t )( first_sector * ( uint16_t )f32->BPB_BytsPerSec );
 }
 
 /*
  * Function    : NextLB
  * Parameters  : Logical block address and struct of the fat32 directory information
+ * Returns     : The FAT entry of the cluster, without its 4 reserved high bits
  */
-int16_t NextLB( uint32_t sector, struct f32info *f32, FILE *fp )
+uint32_t NextLB( uint32_t sector, struct f32info *f32, FILE *fp )
 {
-    uint32_t FATAddress = ( f32->BPB_BytsPerSec * f32->BPB_RsvdSecCnt ) + ( sector * 4 );
-    int16_t val;
-    fseek( fp, FATAddress, SEEK_SET );
-    fread( &val, 2, 1, fp );
-    return val;
+    off_t FATAddress = ( off_t )( uint16_t )f32->BPB_BytsPerSec * ( uint16_t )f32->BPB_RsvdSecCnt + ( off_t )sector * 4;
+    uint32_t val = 0;
+    fseeko( fp, FATAddress, SEEK_SET );
+    fread( &val, 4, 1, fp );
+    return val & 0x0fffffff;
 }
 
 /*
@@ -167,6 +808,9 @@ FILE *openFat32File( char *filename, struct f32info *f32, struct DirectoryEntry
     fseek( fp, 71, SEEK_SET );
     fread( &f32->BS_VolLab, 11, 1, fp );
 
+    fseek( fp, 32, SEEK_SET );
+    fread( &f32->BPB_TotSec32, 4, 1, fp );
+
     fseek( fp, 36, SEEK_SET );
     fread( &f32->BPB_FATSz32, 4, 1, fp );
 
@@ -177,10 +821,11 @@ FILE *openFat32File( char *filename, struct f32info *f32, struct DirectoryEntry
     f32->FirstDataSector = 0;
     f32->FirstSectorofCluster = 0;
 
-    int rootOffset = LBAToOffset( f32->BPB_RootClus, f32 );
+    off_t rootOffset = LBAToOffset( f32->BPB_RootClus, f32 );
 
-    fseek( fp, rootOffset, SEEK_SET );
+    fseeko( fp, rootOffset, SEEK_SET );
     fread( &dir[ 0 ], 32, 16, fp ); // root directory contains 16 32-byte records
+    cwd_cluster = f32->BPB_RootClus;
 
     return fp;
 }
@@ -196,496 +841,8227 @@ void printFat32Info( struct f32info *f32 )
     printf( "--BPB_SecPerClus:      hex: %-#10x  base10: %d\n", f32->BPB_SecPerClus, f32->BPB_SecPerClus );
     printf( "--BPB_RsvdSecCnt:      hex: %-#10x  base10: %d\n", f32->BPB_RsvdSecCnt, f32->BPB_RsvdSecCnt );
     printf( "--BPB_NumFATS:         hex: %-#10x  base10: %d\n", f32->BPB_NumFATS, f32->BPB_NumFATS );
-    printf( "--BPB_FATSz32:         hex: %-#10x  base10: %d\n", f32->BPB_FATSz32, f32->BPB_FATSz32 );
+    printf( "--BPB_FATSz32:         hex: %-#10x  base10: %u\n", f32->BPB_FATSz32, f32->BPB_FATSz32 );
 }
 
 /*
- * Function    : compare_filename
- * Parameters  : User filename input and directory entry filename
- * Returns     : Returns 1 if matches (success), 0 if doesn't match (failure)
- * Description : Checks if the user filename matches the directory entry filename
+ * Function    : make_search_key
+ * Parameters  : User filename input and the search key to fill in
+ * Returns     : Returns 1 if the input can be an 8.3 name, 0 otherwise
+ * Description : Expands the user filename once into the padded, upper case 11 byte layout of
+ *               DIR_Name, along with the 0xe5 prefixed form a deleted entry of that name has.
  */
-int compare_filename( char *input, char *IMG_Name )
+int make_search_key( char *input, struct SearchKey *key )
 {
-    char input_name[ 12 ];
-    memset( input_name, '\0', 12 );
-    strncpy( input_name, input, strlen( input ) );
+    memset( key, ' ', sizeof( struct SearchKey ) );
+    key->valid = 0;
 
-    if ( strncmp( input_name, "..", 2 ) == 0 ) // User input ".."
+    int length = strlen( input );
+    if ( length == 0 || length > 12 ) return 0; // 8 characters, a dot, and 3 characters
+
+    if ( strncmp( input, "..", 2 ) == 0 || strcmp( input, "." ) == 0 ) // User input ".." or "."
+    {
+        memcpy( key->name, input, length > 2 ? 2 : length );
+    }
+    else
     {
-        if ( strncmp( input_name, IMG_Name, 2 ) == 0 ) // Match found
+        const char *dot = strchr( input, '.' );
+        int base_length = dot ? dot - input : length;
+        const char *extension = dot ? dot + 1 : "";
+        int extension_length = strcspn( extension, "." );
+        int i;
+
+        if ( base_length > 11 ) base_length = 11;
+        if ( extension_length > 3 ) extension_length = 3;
+
+        for ( i = 0; i < base_length; i++ )
         {
-            return 1;
+            key->name[ i ] = toupper( ( unsigned char )input[ i ] );
         }
-        else
+        for ( i = 0; i < extension_length; i++ )
         {
-            return 0; // No match found
+            key->name[ 8 + i ] = toupper( ( unsigned char )extension[ i ] );
         }
     }
 
-    char expanded_name[ 12 ];
-    memset( expanded_name, ' ', 12 );
-
-    char *token = strtok( input_name, "." ); // input copied to input_name, so that input isn't overwritten by strtok()
-
-    strncpy( expanded_name, token, strlen( token ) ); // File name (token) copied over, limited to 11 characters
+    memcpy( key->deleted, key->name, sizeof( key->name ) );
+    key->deleted[ 0 ] = 0xe5; // Makes file name deleted
+    key->valid = 1;
+    return 1;
+}
 
-    token = strtok( NULL, "." );
+/*
+ * Function    : name_equals
+ * Parameters  : 11 byte name padded to 16 bytes and a DIR_Name
+ * Returns     : Returns 1 if the first 11 bytes match, 0 otherwise
+ * Description : Compares both names with a single 16 byte vector compare, masking off the 5 bytes
+ *               that follow DIR_Name. DIR_Name always sits at the start of a larger struct, so
+ *               reading 16 bytes from it stays within the entry.
+ */
+static inline int name_equals( const uint8_t *key, const char *IMG_Name )
+{
+#if defined( __SSE2__ )
+    __m128i a = _mm_loadu_si128( ( const __m128i * )key );
+    __m128i b = _mm_loadu_si128( ( const __m128i * )IMG_Name );
+    return ( _mm_movemask_epi8( _mm_cmpeq_epi8( a, b ) ) & 0x7ff ) == 0x7ff;
+#else
+    return memcmp( key, IMG_Name, 11 ) == 0;
+#endif
+}
 
-    if ( token )
-    {
-        strncpy( ( char * )( expanded_name + 8 ), token, 3 ); // File extension, 3 characters, 3 bytes
-    }
+/*
+ * Function    : compare_filename
+ * Parameters  : Search key made from the user filename input and directory entry filename
+ * Returns     : Returns 1 if matches (success), 0 if doesn't match (failure)
+ * Description : Checks if the user filename matches the directory entry filename
+ */
+int compare_filename( struct SearchKey *key, char *IMG_Name )
+{
+    return key->valid && name_equals( key->name, IMG_Name );
+}
 
-    expanded_name[ 11 ] = '\0';
+/*
+ * Function    : compare_deleted_filename
+ * Parameters  : Search key made from the user filename input and directory entry filename
+ * Returns     : Returns 1 if matches (success), 0 if doesn't match (failure)
+ * Description : Checks if the user filename matches the deleted entry filename
+ */
+int compare_deleted_filename( struct SearchKey *key, char *IMG_Name )
+{
+    return key->valid && name_equals( key->deleted, IMG_Name );
+}
 
+/*
+ * Function    : lfn_checksum
+ * Parameters  : 11 byte short name of a directory entry
+ * Returns     : The checksum stored in every long filename entry belonging to that short entry
+ * Description : Computes the VFAT short name checksum as specified by the fatspec pdf
+ */
+uint8_t lfn_checksum( const char *short_name )
+{
+    uint8_t sum = 0;
     int i;
     for ( i = 0; i < 11; i++ )
     {
-        expanded_name[ i ] = toupper( expanded_name[ i ] );
-    }
-
-    int result = strncmp( expanded_name, IMG_Name, 11 );
-    if ( result == 0 ) // Match found
-    {
-        return 1;
-    }
-    else // No match found
-    {
-        return 0;
+        sum = ( ( sum & 1 ) ? 0x80 : 0 ) + ( sum >> 1 ) + ( uint8_t )short_name[ i ];
     }
+    return sum;
 }
 
 /*
- * Function    : compare_deleted_filename
- * Parameters  : User filename input and directory entry filename
- * Returns     : Returns 1 if matches (success), 0 if doesn't match (failure)
- * Description : Checks if the user filename matches the deleted entry filename
+ * Function    : fold_char
+ * Parameters  : UTF-16 character
+ * Returns     : The upper case form of the character
+ * Description : Case folds ASCII, Latin-1, Latin Extended-A, Greek and Cyrillic characters
+ *               so long filenames can be matched case insensitively like 8.3 names are.
  */
-int compare_deleted_filename( char *input, char *IMG_Name )
+uint16_t fold_char( uint16_t c )
 {
-    char input_name[ 12 ];
-    memset( input_name, '\0', 12 );
-    strncpy( input_name, input, strlen( input ) );
+    if ( c < 0x80 ) return ( c >= 'a' && c <= 'z' ) ? c - 0x20 : c;
+    if ( c >= 0xe0 && c <= 0xfe && c != 0xf7 ) return c - 0x20;
+    if ( c == 0xff ) return 0x178;
+    if ( ( c >= 0x100 && c <= 0x137 ) || ( c >= 0x14a && c <= 0x177 ) ) return c & ~1;
+    if ( ( c >= 0x139 && c <= 0x148 ) || ( c >= 0x179 && c <= 0x17e ) ) return ( c & 1 ) ? c : c - 1;
+    if ( c == 0x3c2 ) return 0x3a3;
+    if ( c >= 0x3b1 && c <= 0x3cb ) return c - 0x20;
+    if ( c >= 0x430 && c <= 0x44f ) return c - 0x20;
+    if ( c >= 0x450 && c <= 0x45f ) return c - 0x50;
+    return c;
+}
 
-    if ( strncmp( input_name, "..", 2 ) == 0 ) // User input ".."
+/*
+ * Function    : fold_hash
+ * Parameters  : UTF-16 characters and the number of characters
+ * Returns     : FNV-1a hash of the case-folded characters
+ */
+uint32_t fold_hash( const uint16_t *chars, int length )
+{
+    uint32_t hash = 2166136261u;
+    int i;
+    for ( i = 0; i < length; i++ )
     {
-        if ( strncmp( input_name, IMG_Name, 2 ) == 0 ) // Match found
-        {
-            return 1;
-        }
-        else
-        {
-            return 0; // No match found
-        }
+        uint16_t c = fold_char( chars[ i ] );
+        hash = ( hash ^ ( c & 0xff ) ) * 16777619u;
+        hash = ( hash ^ ( c >> 8 ) ) * 16777619u;
     }
+    return hash;
+}
 
-    char expanded_name[ 12 ];
-    memset( expanded_name, ' ', 12 );
-
-    char *token = strtok( input_name, "." ); // input copied to input_name, so that input isn't overwritten by strtok()
-
-    strncpy( expanded_name, token, strlen( token ) ); // File name (token) copied over, limited to 11 characters
-
-    token = strtok( NULL, "." );
+/*
+ * Function    : lfn_add_entry
+ * Parameters  : Long name being assembled and the long filename directory entry
+ * Description : Copies the 13 characters of a long filename entry into their slot of the name.
+ *               Entries that are out of sequence or out of range invalidate the name, so the
+ *               short name is used instead.
+ */
+void lfn_add_entry( struct LongName *name, struct DirectoryEntry *entry )
+{
+    struct LongNameEntry *lfn = ( struct LongNameEntry * )entry;
+    int ord = lfn->LDIR_Ord & 0x1f;
+    int i;
 
-    if ( token )
+    if ( lfn->LDIR_Ord & LFN_LAST_ENTRY ) // Physically first entry holds the end of the name
     {
-        strncpy( ( char * )( expanded_name + 8 ), token, 3 ); // File extension, 3 characters, 3 bytes
+        name->valid = 1;
+        name->next_ord = ord;
+        name->checksum = lfn->LDIR_Chksum;
+        name->length = ord * LFN_CHARS_PER_ENTRY;
     }
 
-    expanded_name[ 11 ] = '\0';
-
-    int i;
-    for ( i = 0; i < 11; i++ )
+    // An order past the 20 entries a name can span would write beyond the buffer
+    if ( !name->valid || ord == 0 || ord > LFN_MAX_UNITS / LFN_CHARS_PER_ENTRY || ord != name->next_ord ||
+         lfn->LDIR_Chksum != name->checksum )
     {
-        expanded_name[ i ] = toupper( expanded_name[ i ] );
+        name->valid = 0;
+        return;
     }
 
-    expanded_name[ 0 ] = 0xe5; // Makes file name deleted *
+    uint16_t *slot = &name->chars[ ( ord - 1 ) * LFN_CHARS_PER_ENTRY ];
+    for ( i = 0; i < 5; i++ ) slot[ i ] = lfn->LDIR_Name1[ i ];
+    for ( i = 0; i < 6; i++ ) slot[ 5 + i ] = lfn->LDIR_Name2[ i ];
+    for ( i = 0; i < 2; i++ ) slot[ 11 + i ] = lfn->LDIR_Name3[ i ];
 
-    int result = strncmp( expanded_name, IMG_Name, 11 );
-    if ( result == 0 ) // Match found
-    {
-        return 1;
-    }
-    else // No match found
+    if ( lfn->LDIR_Ord & LFN_LAST_ENTRY ) // Name is terminated by 0x0000 unless it fills the entry
     {
-        return 0;
+        for ( i = 0; i < LFN_CHARS_PER_ENTRY; i++ )
+        {
+            if ( slot[ i ] == 0x0000 )
+            {
+                name->length = ( ord - 1 ) * LFN_CHARS_PER_ENTRY + i;
+                break;
+            }
+        }
     }
+
+    name->next_ord--;
 }
 
 /*
- * Function    : find_file
- * Parameters  : User filename input and directory entry array
- * Returns     : Returns index of file if found (success), -1 if not found (failure)
- * Description : Looks for file from a given directory (directory entry array)
+ * Function    : lfn_finish
+ * Parameters  : Long name being assembled and the short directory entry following it
+ * Returns     : 1 if a complete long name with a matching checksum precedes the entry, 0 otherwise
+ * Description : Validates the assembled long name against the short entry and hashes it for lookups.
+ *               The name is reset so the next short entry starts without one.
  */
-int find_file( char *filename, struct DirectoryEntry *dir )
+int lfn_finish( struct LongName *name, struct DirectoryEntry *entry )
 {
-    int i;
-
-    // Search directory for entry
-    for ( i = 0; i < 16; i++ )
-    {
-        if ( compare_filename( filename, dir[ i ].DIR_Name ) ) // 1 = true, name matches. 0 = false, no match
-        {
-            return i;
-        }
-    }
+    int complete = name->valid && name->next_ord == 0 && name->length > 0 &&
+                   name->checksum == lfn_checksum( entry->DIR_Name );
+    name->valid = 0;
+    name->next_ord = 0;
 
-    // File was not found
-    return -1;
+    if ( complete ) name->hash = fold_hash( name->chars, name->length );
+    return complete;
 }
 
 /*
- * Function    : stat
- * Parameters  : User filename input and directory entry array
- * Description : Prints attributes of selected file / directory
+ * Function    : utf16_to_utf8
+ * Parameters  : UTF-16 characters, number of characters, output buffer and its size
+ * Returns     : Number of bytes written, excluding the null character
+ * Description : Converts a whole long name to a null terminated UTF-8 string in a single pass
  */
-void stat( char *filename, struct DirectoryEntry *dir )
+int utf16_to_utf8( const uint16_t *chars, int length, char *out, int out_size )
 {
-    int entry;
-    char name_buffer[ 12 ];
+    int i, n = 0;
+    for ( i = 0; i < length; i++ )
+    {
+        uint32_t c = chars[ i ];
+        if ( c >= 0xd800 && c <= 0xdbff && i + 1 < length && chars[ i + 1 ] >= 0xdc00 && chars[ i + 1 ] <= 0xdfff )
+        {
+            c = 0x10000 + ( ( c - 0xd800 ) << 10 ) + ( chars[ i + 1 ] - 0xdc00 );
+            i++;
+        }
+        else if ( c >= 0xd800 && c <= 0xdfff ) // Unpaired surrogate
+        {
+            c = 0xfffd;
+        }
 
-    entry = find_file( filename, dir );
+        if ( n + 4 >= out_size ) break;
+
+        if ( c < 0x80 )
+        {
+            out[ n++ ] = c;
+        }
+        else if ( c < 0x800 )
+        {
+            out[ n++ ] = 0xc0 | ( c >> 6 );
+            out[ n++ ] = 0x80 | ( c & 0x3f );
+        }
+        else if ( c < 0x10000 )
+        {
+            out[ n++ ] = 0xe0 | ( c >> 12 );
+            out[ n++ ] = 0x80 | ( ( c >> 6 ) & 0x3f );
+            out[ n++ ] = 0x80 | ( c & 0x3f );
+        }
+        else
+        {
+            out[ n++ ] = 0xf0 | ( c >> 18 );
+            out[ n++ ] = 0x80 | ( ( c >> 12 ) & 0x3f );
+            out[ n++ ] = 0x80 | ( ( c >> 6 ) & 0x3f );
+            out[ n++ ] = 0x80 | ( c & 0x3f );
+        }
+    }
+    out[ n ] = '\0';
+    return n;
+}
+
+/*
+ * Function    : utf8_to_utf16
+ * Parameters  : Null terminated UTF-8 string, output buffer and its size in characters
+ * Returns     : Number of UTF-16 characters written, or -1 if the name is too long
+ * Description : Converts user input to UTF-16 so it can be compared against long names
+ */
+int utf8_to_utf16( const char *input, uint16_t *chars, int max_length )
+{
+    const uint8_t *s = ( const uint8_t * )input;
+    int n = 0;
+
+    while ( *s )
+    {
+        uint32_t c;
+        int extra;
+
+        if ( s[ 0 ] < 0x80 ) c = s[ 0 ], extra = 0;
+        else if ( ( s[ 0 ] & 0xe0 ) == 0xc0 ) c = s[ 0 ] & 0x1f, extra = 1;
+        else if ( ( s[ 0 ] & 0xf0 ) == 0xe0 ) c = s[ 0 ] & 0x0f, extra = 2;
+        else if ( ( s[ 0 ] & 0xf8 ) == 0xf0 ) c = s[ 0 ] & 0x07, extra = 3;
+        else c = 0xfffd, extra = 0;
+        s++;
+
+        for ( ; extra > 0; extra-- )
+        {
+            if ( ( *s & 0xc0 ) != 0x80 )
+            {
+                c = 0xfffd;
+                break;
+            }
+            c = ( c << 6 ) | ( *s++ & 0x3f );
+        }
+
+        if ( n + 2 > max_length ) return -1;
+
+        if ( c >= 0x10000 )
+        {
+            c -= 0x10000;
+            chars[ n++ ] = 0xd800 + ( c >> 10 );
+            chars[ n++ ] = 0xdc00 + ( c & 0x3ff );
+        }
+        else
+        {
+            chars[ n++ ] = c;
+        }
+    }
+    return n;
+}
+
+/*
+ * Function    : classify_entries
+ * Parameters  : Directory entry array, number of entries (at most SCAN_BLOCK), and the masks to fill in
+ * Description : Classifies a block of directory entries at once. The first name byte and the attribute
+ *               of every entry are gathered into 16 byte lanes and tested with vector compares, which
+ *               yield 16 entries per movemask. Callers then only visit the entries whose bit is set.
+ */
+void classify_entries( const struct DirectoryEntry *dir, int count, struct EntryMasks *masks )
+{
+    uint8_t first[ SCAN_BLOCK ] __attribute__( ( aligned( 16 ) ) );
+    uint8_t attr[ SCAN_BLOCK ] __attribute__( ( aligned( 16 ) ) );
+    uint64_t zero = 0, deleted = 0, lfn = 0, volume = 0, directory = 0, plain = 0;
+    uint64_t in_block = count >= SCAN_BLOCK ? ~0ULL : ( 1ULL << count ) - 1;
+    int i;
+
+    memset( first, 0, sizeof( first ) );
+    memset( attr, 0, sizeof( attr ) );
+    for ( i = 0; i < count; i++ )
+    {
+        first[ i ] = dir[ i ].DIR_Name[ 0 ];
+        attr[ i ] = dir[ i ].DIR_Attr;
+    }
+
+#if defined( __SSE2__ )
+    const __m128i v_zero = _mm_setzero_si128();
+    const __m128i v_deleted = _mm_set1_epi8( ( char )0xe5 );
+    const __m128i v_lfn = _mm_set1_epi8( LFN_ATTR );
+    const __m128i v_volume = _mm_set1_epi8( 0x08 );
+    const __m128i v_directory = _mm_set1_epi8( 0x10 );
+    const __m128i v_read_only = _mm_set1_epi8( 0x01 );
+    const __m128i v_archive = _mm_set1_epi8( 0x20 );
+
+    for ( i = 0; i < count; i += 16 )
+    {
+        __m128i f = _mm_load_si128( ( const __m128i * )&first[ i ] );
+        __m128i a = _mm_load_si128( ( const __m128i * )&attr[ i ] );
+
+        __m128i is_plain = _mm_or_si128( _mm_or_si128( _mm_cmpeq_epi8( a, v_read_only ), _mm_cmpeq_epi8( a, v_directory ) ),
+                                         _mm_cmpeq_epi8( a, v_archive ) );
+
+        zero |= ( uint64_t )( uint16_t )_mm_movemask_epi8( _mm_cmpeq_epi8( f, v_zero ) ) << i;
+        deleted |= ( uint64_t )( uint16_t )_mm_movemask_epi8( _mm_cmpeq_epi8( f, v_deleted ) ) << i;
+        lfn |= ( uint64_t )( uint16_t )_mm_movemask_epi8( _mm_cmpeq_epi8( a, v_lfn ) ) << i;
+        volume |= ( uint64_t )( uint16_t )_mm_movemask_epi8( _mm_cmpeq_epi8( _mm_and_si128( a, v_volume ), v_volume ) ) << i;
+        directory |= ( uint64_t )( uint16_t )_mm_movemask_epi8( _mm_cmpeq_epi8( _mm_and_si128( a, v_directory ), v_directory ) ) << i;
+        plain |= ( uint64_t )( uint16_t )_mm_movemask_epi8( is_plain ) << i;
+    }
+#else
+    for ( i = 0; i < count; i++ )
+    {
+        uint64_t bit = 1ULL << i;
+        if ( first[ i ] == 0x00 ) zero |= bit;
+        if ( first[ i ] == 0xe5 ) deleted |= bit;
+        if ( attr[ i ] == LFN_ATTR ) lfn |= bit;
+        if ( attr[ i ] & 0x08 ) volume |= bit;
+        if ( attr[ i ] & 0x10 ) directory |= bit;
+        if ( attr[ i ] == 0x01 || attr[ i ] == 0x10 || attr[ i ] == 0x20 ) plain |= bit;
+    }
+#endif
+
+    zero &= in_block;
+    masks->end = zero ? ~( ( zero & -zero ) - 1 ) & in_block : 0;
+
+    uint64_t used = in_block & ~masks->end;
+    masks->deleted = deleted & used;
+    masks->lfn = lfn & used & ~deleted;
+    masks->live = used & ~deleted & ~lfn & ~volume;
+    masks->directory = directory & masks->live;
+    masks->plain = plain & used;
+}
+
+/*
+ * Function    : walk_begin
+ * Parameters  : Walk state, directory entry array, number of entries, and 1 to visit listed entries only
+ * Description : Prepares a walk over the short entries of a directory. Listed entries are the
+ *               read-only files, sub-directories and archives that ls shows.
+ */
+void walk_begin( struct DirectoryWalk *walk, struct DirectoryEntry *dir, int count, int listed_only )
+{
+    walk->dir = dir;
+    walk->count = count;
+    walk->base = -SCAN_BLOCK;
+    walk->bits = 0;
+    walk->select = listed_only;
+    walk->end = 0;
+    walk->previous = -2;
+    walk->lfn_first = -1;
+    walk->name.valid = 0;
+    walk->name.next_ord = 0;
+    walk->has_long_name = 0;
+}
+
+/*
+ * Function    : walk_next
+ * Parameters  : Walk state
+ * Returns     : Index of the next short entry, or -1 at the end of the directory
+ * Description : Classifies the directory a block at a time and visits only the set bits. The long name
+ *               of the returned entry, if it has a valid one, is left in walk->name.
+ */
+int walk_next( struct DirectoryWalk *walk )
+{
+    struct DirectoryEntry *dir = walk->dir;
+
+    while ( 1 )
+    {
+        while ( !walk->bits )
+        {
+            walk->base += SCAN_BLOCK;
+            if ( walk->end || walk->base >= walk->count ) return -1;
+
+            int block = walk->count - walk->base < SCAN_BLOCK ? walk->count - walk->base : SCAN_BLOCK;
+            struct EntryMasks masks;
+            classify_entries( &dir[ walk->base ], block, &masks );
+
+            walk->bits = masks.lfn | ( walk->select ? masks.live & masks.plain : masks.live );
+            walk->end = masks.end != 0;
+        }
+
+        int i = walk->base + __builtin_ctzll( walk->bits );
+        walk->bits &= walk->bits - 1;
+
+        if ( i != walk->previous + 1 ) walk->name.valid = 0; // Long names must directly precede their short entry
+        walk->previous = i;
+
+        if ( dir[ i ].DIR_Attr == LFN_ATTR )
+        {
+            if ( dir[ i ].DIR_Name[ 0 ] & LFN_LAST_ENTRY ) walk->lfn_first = i;
+            lfn_add_entry( &walk->name, &dir[ i ] );
+            continue;
+        }
+
+        walk->has_long_name = lfn_finish( &walk->name, &dir[ i ] );
+        if ( !walk->has_long_name ) walk->lfn_first = -1;
+        return i;
+    }
+}
+
+/*
+ * Function    : find_entry
+ * Parameters  : User filename input, directory entry array, number of entries, and an optional long name
+ * Returns     : Returns index of the short entry if found (success), -1 if not found (failure)
+ * Description : Looks for a file by its long name or its 8.3 name. The input is converted and hashed
+ *               once, so each long name costs a hash compare and only hash hits are compared in full.
+ *               If a long name is given, it receives the long name of the entry that was found.
+ */
+int find_entry( char *filename, struct DirectoryEntry *dir, int count, struct LongName *found )
+{
+    struct DirectoryWalk walk;
+    uint16_t input[ LFN_MAX_UNITS ];
+    int input_length = utf8_to_utf16( filename, input, LFN_MAX_UNITS );
+    uint32_t input_hash = input_length > 0 ? fold_hash( input, input_length ) : 0;
+    struct SearchKey key;
+    make_search_key( filename, &key );
+    int i, j;
+
+    // Search directory for entry, one block of entries at a time
+    walk_begin( &walk, dir, count, 0 );
+    while ( ( i = walk_next( &walk ) ) != -1 )
+    {
+        struct LongName *name = &walk.name;
+        int match = 0;
+
+        if ( walk.has_long_name && name->hash == input_hash && name->length == input_length )
+        {
+            for ( j = 0; j < input_length; j++ )
+            {
+                if ( fold_char( name->chars[ j ] ) != fold_char( input[ j ] ) ) break;
+            }
+            match = ( j == input_length );
+        }
+
+        if ( !match )
+        {
+            match = compare_filename( &key, dir[ i ].DIR_Name ); // 1 = true, name matches. 0 = false, no match
+        }
+
+        if ( match )
+        {
+            if ( found )
+            {
+                *found = *name;
+                found->valid = walk.has_long_name;
+            }
+            return i;
+        }
+    }
+
+    // File was not found
+    return -1;
+}
+
+/*
+ * Function    : find_file
+ * Parameters  : User filename input and directory entry array
+ * Returns     : Returns index of file if found (success), -1 if not found (failure)
+ * Description : Looks for file by long or 8.3 name from a given directory (directory entry array)
+ */
+int find_file( char *filename, struct DirectoryEntry *dir )
+{
+    return find_entry( filename, dir, 16, NULL );
+}
+
+/*
+ * XXH3 64-bit hash (seed 0, default secret), used to detect which parts of an image changed
+ * between sessions. Follows the reference implementation at https://github.com/Cyan4973/xxHash
+ */
+static const uint8_t XXH3_SECRET[ 192 ] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+#define XXH_PRIME32_1 0x9e3779b1u
+#define XXH_PRIME32_2 0x85ebca77u
+#define XXH_PRIME32_3 0xc2b2ae3du
+#define XXH_PRIME64_1 0x9e3779b185ebca87ULL
+#define XXH_PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define XXH_PRIME64_3 0x165667b19e3779f9ULL
+#define XXH_PRIME64_4 0x85ebca77c2b2ae63ULL
+#define XXH_PRIME64_5 0x27d4eb2f165667c5ULL
+#define XXH_PRIME_MX1 0x165667919e3779f9ULL
+#define XXH_PRIME_MX2 0x9fb21c651e98df25ULL
+
+static inline uint64_t xxh_read64( const uint8_t *p )
+{
+    uint64_t v;
+    memcpy( &v, p, 8 );
+    return v;
+}
+
+static inline uint32_t xxh_read32( const uint8_t *p )
+{
+    uint32_t v;
+    memcpy( &v, p, 4 );
+    return v;
+}
+
+static inline uint64_t xxh_rotl64( uint64_t x, int r ) { return ( x << r ) | ( x >> ( 64 - r ) ); }
+
+static inline uint64_t xxh_mul128_fold64( uint64_t a, uint64_t b )
+{
+    unsigned __int128 product = ( unsigned __int128 )a * b;
+    return ( uint64_t )product ^ ( uint64_t )( product >> 64 );
+}
+
+static inline uint64_t xxh64_avalanche( uint64_t h )
+{
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    return h ^ ( h >> 32 );
+}
+
+static inline uint64_t xxh3_avalanche( uint64_t h )
+{
+    h ^= h >> 37;
+    h *= XXH_PRIME_MX1;
+    return h ^ ( h >> 32 );
+}
+
+static inline uint64_t xxh3_mix16( const uint8_t *input, const uint8_t *secret )
+{
+    return xxh_mul128_fold64( xxh_read64( input ) ^ xxh_read64( secret ), xxh_read64( input + 8 ) ^ xxh_read64( secret + 8 ) );
+}
+
+/*
+ * Function    : xxh3_accumulate
+ * Parameters  : 8 accumulators, input, secret, and number of 64 byte stripes
+ * Description : Inner loop of XXH3 for long inputs, two 64-bit lanes per SSE2 register
+ */
+static void xxh3_accumulate( uint64_t *acc, const uint8_t *input, const uint8_t *secret, size_t stripes )
+{
+    size_t s;
+    int i;
+
+    for ( s = 0; s < stripes; s++, input += 64, secret += 8 )
+    {
+#if defined( __SSE2__ )
+        __m128i *xacc = ( __m128i * )acc;
+        for ( i = 0; i < 4; i++ )
+        {
+            __m128i data = _mm_loadu_si128( ( const __m128i * )( input + 16 * i ) );
+            __m128i key = _mm_xor_si128( data, _mm_loadu_si128( ( const __m128i * )( secret + 16 * i ) ) );
+            __m128i product = _mm_mul_epu32( key, _mm_shuffle_epi32( key, _MM_SHUFFLE( 0, 3, 0, 1 ) ) );
+            __m128i swapped = _mm_shuffle_epi32( data, _MM_SHUFFLE( 1, 0, 3, 2 ) );
+            xacc[ i ] = _mm_add_epi64( product, _mm_add_epi64( xacc[ i ], swapped ) );
+        }
+#else
+        for ( i = 0; i < 8; i++ )
+        {
+            uint64_t data = xxh_read64( input + 8 * i );
+            uint64_t key = data ^ xxh_read64( secret + 8 * i );
+            acc[ i ^ 1 ] += data;
+            acc[ i ] += ( uint32_t )key * ( key >> 32 );
+        }
+#endif
+    }
+}
+
+static void xxh3_scramble( uint64_t *acc, const uint8_t *secret )
+{
+    int i;
+#if defined( __SSE2__ )
+    __m128i *xacc = ( __m128i * )acc;
+    const __m128i prime = _mm_set1_epi32( ( int )XXH_PRIME32_1 );
+    for ( i = 0; i < 4; i++ )
+    {
+        __m128i value = _mm_xor_si128( xacc[ i ], _mm_srli_epi64( xacc[ i ], 47 ) );
+        __m128i key = _mm_xor_si128( value, _mm_loadu_si128( ( const __m128i * )( secret + 16 * i ) ) );
+        __m128i low = _mm_mul_epu32( key, prime );
+        __m128i high = _mm_mul_epu32( _mm_shuffle_epi32( key, _MM_SHUFFLE( 0, 3, 0, 1 ) ), prime );
+        xacc[ i ] = _mm_add_epi64( low, _mm_slli_epi64( high, 32 ) );
+    }
+#else
+    for ( i = 0; i < 8; i++ )
+    {
+        uint64_t value = acc[ i ] ^ ( acc[ i ] >> 47 );
+        acc[ i ] = ( value ^ xxh_read64( secret + 8 * i ) ) * XXH_PRIME32_1;
+    }
+#endif
+}
+
+/*
+ * Function    : xxh3_64
+ * Parameters  : Data and number of bytes
+ * Returns     : XXH3 64-bit hash of the data
+ */
+uint64_t xxh3_64( const void *data, size_t length )
+{
+    const uint8_t *input = ( const uint8_t * )data;
+    const uint8_t *secret = XXH3_SECRET;
+    uint64_t acc;
+    size_t i;
+
+    if ( length == 0 )
+    {
+        return xxh64_avalanche( xxh_read64( secret + 56 ) ^ xxh_read64( secret + 64 ) );
+    }
+    if ( length <= 3 )
+    {
+        uint32_t combined = ( ( uint32_t )input[ 0 ] << 16 ) | ( ( uint32_t )input[ length >> 1 ] << 24 ) | input[ length - 1 ] | ( ( uint32_t )length << 8 );
+        return xxh64_avalanche( combined ^ ( uint64_t )( xxh_read32( secret ) ^ xxh_read32( secret + 4 ) ) );
+    }
+    if ( length <= 8 )
+    {
+        uint64_t keyed = ( xxh_read32( input + length - 4 ) + ( ( uint64_t )xxh_read32( input ) << 32 ) ) ^ ( xxh_read64( secret + 8 ) ^ xxh_read64( secret + 16 ) );
+        keyed ^= xxh_rotl64( keyed, 49 ) ^ xxh_rotl64( keyed, 24 );
+        keyed *= XXH_PRIME_MX2;
+        keyed ^= ( keyed >> 35 ) + length;
+        keyed *= XXH_PRIME_MX2;
+        return keyed ^ ( keyed >> 28 );
+    }
+    if ( length <= 16 )
+    {
+        uint64_t low = xxh_read64( input ) ^ ( xxh_read64( secret + 24 ) ^ xxh_read64( secret + 32 ) );
+        uint64_t high = xxh_read64( input + length - 8 ) ^ ( xxh_read64( secret + 40 ) ^ xxh_read64( secret + 48 ) );
+        return xxh3_avalanche( length + __builtin_bswap64( low ) + high + xxh_mul128_fold64( low, high ) );
+    }
+    if ( length <= 128 )
+    {
+        acc = length * XXH_PRIME64_1;
+        if ( length > 32 )
+        {
+            if ( length > 64 )
+            {
+                if ( length > 96 )
+                {
+                    acc += xxh3_mix16( input + 48, secret + 96 );
+                    acc += xxh3_mix16( input + length - 64, secret + 112 );
+                }
+                acc += xxh3_mix16( input + 32, secret + 64 );
+                acc += xxh3_mix16( input + length - 48, secret + 80 );
+            }
+            acc += xxh3_mix16( input + 16, secret + 32 );
+            acc += xxh3_mix16( input + length - 32, secret + 48 );
+        }
+        acc += xxh3_mix16( input, secret );
+        acc += xxh3_mix16( input + length - 16, secret + 16 );
+        return xxh3_avalanche( acc );
+    }
+    if ( length <= 240 )
+    {
+        acc = length * XXH_PRIME64_1;
+        for ( i = 0; i < 8; i++ ) acc += xxh3_mix16( input + 16 * i, secret + 16 * i );
+        uint64_t acc_end = xxh3_mix16( input + length - 16, secret + 136 - 17 );
+        acc = xxh3_avalanche( acc );
+        for ( i = 8; i < length / 16; i++ ) acc_end += xxh3_mix16( input + 16 * i, secret + 16 * ( i - 8 ) + 3 );
+        return xxh3_avalanche( acc + acc_end );
+    }
+
+    uint64_t lanes[ 8 ] __attribute__( ( aligned( 16 ) ) ) = {
+        XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3, XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1
+    };
+    const size_t stripes_per_block = ( sizeof( XXH3_SECRET ) - 64 ) / 8;
+    const size_t block_length = 64 * stripes_per_block;
+    const size_t blocks = ( length - 1 ) / block_length;
+
+    for ( i = 0; i < blocks; i++ )
+    {
+        xxh3_accumulate( lanes, input + i * block_length, secret, stripes_per_block );
+        xxh3_scramble( lanes, secret + sizeof( XXH3_SECRET ) - 64 );
+    }
+    xxh3_accumulate( lanes, input + blocks * block_length, secret, ( ( length - 1 ) - block_length * blocks ) / 64 );
+    xxh3_accumulate( lanes, input + length - 64, secret + sizeof( XXH3_SECRET ) - 64 - 7, 1 );
+
+    acc = length * XXH_PRIME64_1;
+    for ( i = 0; i < 4; i++ )
+    {
+        acc += xxh_mul128_fold64( lanes[ 2 * i ] ^ xxh_read64( secret + 11 + 16 * i ), lanes[ 2 * i + 1 ] ^ xxh_read64( secret + 11 + 16 * i + 8 ) );
+    }
+    return xxh3_avalanche( acc );
+}
+
+/*
+ * Function    : xxh3_consume
+ * Parameters  : Streaming XXH3 state, input, and number of 64 byte stripes
+ * Description : Accumulates stripes that are known not to be the last of the input, scrambling after
+ *               every full block, exactly as xxh3_64() does for the stripes of a long input
+ */
+static void xxh3_consume( struct Xxh3State *state, const uint8_t *input, size_t stripes )
+{
+    const size_t stripes_per_block = ( sizeof( XXH3_SECRET ) - 64 ) / 8;
+
+    if ( stripes == 0 ) return;
+    while ( stripes > 0 )
+    {
+        size_t count = stripes_per_block - state->stripe < stripes ? stripes_per_block - state->stripe : stripes;
+        xxh3_accumulate( state->lanes, input, XXH3_SECRET + 8 * state->stripe, count );
+        state->stripe += count;
+        if ( state->stripe == stripes_per_block )
+        {
+            xxh3_scramble( state->lanes, XXH3_SECRET + sizeof( XXH3_SECRET ) - 64 );
+            state->stripe = 0;
+        }
+        input += 64 * count;
+        stripes -= count;
+    }
+    memcpy( state->last, input - 64, 64 );
+}
+
+/*
+ * Function    : xxh3_update
+ * Parameters  : Streaming XXH3 state, data, and number of bytes
+ * Description : Adds data to a hash computed piece by piece. The last XXH3_BUFFER bytes are always held
+ *               back, since the final stripe and short inputs are hashed differently.
+ */
+static void xxh3_update( struct Xxh3State *state, const uint8_t *input, size_t length )
+{
+    state->length += length;
+    if ( state->buffered + length <= XXH3_BUFFER )
+    {
+        memcpy( state->buffer + state->buffered, input, length );
+        state->buffered += length;
+        return;
+    }
+
+    if ( state->buffered > 0 ) // Top up the buffer and consume it, more input follows it
+    {
+        size_t fill = XXH3_BUFFER - state->buffered;
+        memcpy( state->buffer + state->buffered, input, fill );
+        xxh3_consume( state, state->buffer, XXH3_BUFFER / 64 );
+        input += fill;
+        length -= fill;
+        state->buffered = 0;
+    }
+    if ( length > XXH3_BUFFER )
+    {
+        size_t stripes = ( length - 1 ) / XXH3_BUFFER * ( XXH3_BUFFER / 64 );
+        xxh3_consume( state, input, stripes );
+        input += 64 * stripes;
+        length -= 64 * stripes;
+    }
+    memcpy( state->buffer, input, length );
+    state->buffered = length;
+}
+
+/*
+ * Function    : xxh3_digest
+ * Parameters  : Streaming XXH3 state
+ * Returns     : XXH3 64-bit hash of everything added, the same as xxh3_64() of it in one piece
+ */
+static uint64_t xxh3_digest( const struct Xxh3State *state )
+{
+    uint64_t lanes[ 8 ] __attribute__( ( aligned( 16 ) ) );
+    uint8_t last[ 64 ];
+    uint64_t acc;
+    int i;
+
+    if ( state->length <= 240 ) return xxh3_64( state->buffer, state->length );
+
+    struct Xxh3State copy = *state;
+    if ( state->buffered > 0 ) xxh3_consume( &copy, copy.buffer, ( copy.buffered - 1 ) / 64 );
+    memcpy( lanes, copy.lanes, sizeof( lanes ) );
+
+    if ( state->buffered >= 64 ) memcpy( last, state->buffer + state->buffered - 64, 64 );
+    else
+    {
+        memcpy( last, state->last + state->buffered, 64 - state->buffered );
+        memcpy( last + 64 - state->buffered, state->buffer, state->buffered );
+    }
+    xxh3_accumulate( lanes, last, XXH3_SECRET + sizeof( XXH3_SECRET ) - 64 - 7, 1 );
+
+    acc = state->length * XXH_PRIME64_1;
+    for ( i = 0; i < 4; i++ )
+    {
+        acc += xxh_mul128_fold64( lanes[ 2 * i ] ^ xxh_read64( XXH3_SECRET + 11 + 16 * i ), lanes[ 2 * i + 1 ] ^ xxh_read64( XXH3_SECRET + 11 + 16 * i + 8 ) );
+    }
+    return xxh3_avalanche( acc );
+}
+
+static uint32_t crc32c_table[ 8 ][ 256 ];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Function    : crc32c_init_table
+ * Parameters  : None
+ * Description : Builds the slicing-by-8 tables of the Castagnoli polynomial
+ */
+static void crc32c_init_table()
+{
+    uint32_t i, j;
+    for ( i = 0; i < 256; i++ )
+    {
+        uint32_t crc = i;
+        for ( j = 0; j < 8; j++ ) crc = ( crc >> 1 ) ^ ( ( crc & 1 ) ? 0x82f63b78u : 0 );
+        crc32c_table[ 0 ][ i ] = crc;
+    }
+    for ( i = 0; i < 256; i++ )
+    {
+        for ( j = 1; j < 8; j++ ) crc32c_table[ j ][ i ] = ( crc32c_table[ j - 1 ][ i ] >> 8 ) ^ crc32c_table[ 0 ][ crc32c_table[ j - 1 ][ i ] & 0xff ];
+    }
+}
+
+/*
+ * Function    : crc32c_software
+ * Parameters  : Running CRC (inverted), data, and number of bytes
+ * Returns     : Updated running CRC
+ */
+static uint32_t crc32c_software( uint32_t crc, const uint8_t *data, size_t length )
+{
+    while ( length >= 8 )
+    {
+        uint64_t word = xxh_read64( data ) ^ crc;
+        crc = crc32c_table[ 7 ][ word & 0xff ] ^ crc32c_table[ 6 ][ ( word >> 8 ) & 0xff ] ^
+              crc32c_table[ 5 ][ ( word >> 16 ) & 0xff ] ^ crc32c_table[ 4 ][ ( word >> 24 ) & 0xff ] ^
+              crc32c_table[ 3 ][ ( word >> 32 ) & 0xff ] ^ crc32c_table[ 2 ][ ( word >> 40 ) & 0xff ] ^
+              crc32c_table[ 1 ][ ( word >> 48 ) & 0xff ] ^ crc32c_table[ 0 ][ word >> 56 ];
+        data += 8;
+        length -= 8;
+    }
+    while ( length-- > 0 ) crc = ( crc >> 8 ) ^ crc32c_table[ 0 ][ ( crc ^ *data++ ) & 0xff ];
+    return crc;
+}
+
+#if defined( __x86_64__ )
+/*
+ * Function    : crc32c_hardware
+ * Parameters  : Running CRC (inverted), data, and number of bytes
+ * Returns     : Updated running CRC, using the SSE4.2 crc32 instruction
+ */
+__attribute__( ( target( "sse4.2" ) ) ) static uint32_t crc32c_hardware( uint32_t crc, const uint8_t *data, size_t length )
+{
+    uint64_t wide = crc;
+    while ( length >= 8 )
+    {
+        wide = _mm_crc32_u64( wide, xxh_read64( data ) );
+        data += 8;
+        length -= 8;
+    }
+    crc = ( uint32_t )wide;
+    while ( length-- > 0 ) crc = _mm_crc32_u8( crc, *data++ );
+    return crc;
+}
+#endif
+
+static const uint32_t SHA256_K[ 64 ] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t sha_rotr( uint32_t x, int r ) { return ( x >> r ) | ( x << ( 32 - r ) ); }
+
+/*
+ * Function    : sha256_software
+ * Parameters  : SHA-256 state, data, and number of 64 byte blocks
+ */
+static void sha256_software( uint32_t *state, const uint8_t *data, size_t blocks )
+{
+    uint32_t w[ 64 ];
+    int i;
+
+    for ( ; blocks > 0; blocks--, data += 64 )
+    {
+        for ( i = 0; i < 16; i++ ) w[ i ] = __builtin_bswap32( xxh_read32( data + 4 * i ) );
+        for ( i = 16; i < 64; i++ )
+        {
+            uint32_t s0 = sha_rotr( w[ i - 15 ], 7 ) ^ sha_rotr( w[ i - 15 ], 18 ) ^ ( w[ i - 15 ] >> 3 );
+            uint32_t s1 = sha_rotr( w[ i - 2 ], 17 ) ^ sha_rotr( w[ i - 2 ], 19 ) ^ ( w[ i - 2 ] >> 10 );
+            w[ i ] = w[ i - 16 ] + s0 + w[ i - 7 ] + s1;
+        }
+
+        uint32_t a = state[ 0 ], b = state[ 1 ], c = state[ 2 ], d = state[ 3 ];
+        uint32_t e = state[ 4 ], f = state[ 5 ], g = state[ 6 ], h = state[ 7 ];
+        for ( i = 0; i < 64; i++ )
+        {
+            uint32_t t1 = h + ( sha_rotr( e, 6 ) ^ sha_rotr( e, 11 ) ^ sha_rotr( e, 25 ) ) + ( ( e & f ) ^ ( ~e & g ) ) + SHA256_K[ i ] + w[ i ];
+            uint32_t t2 = ( sha_rotr( a, 2 ) ^ sha_rotr( a, 13 ) ^ sha_rotr( a, 22 ) ) + ( ( a & b ) ^ ( a & c ) ^ ( b & c ) );
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[ 0 ] += a;
+        state[ 1 ] += b;
+        state[ 2 ] += c;
+        state[ 3 ] += d;
+        state[ 4 ] += e;
+        state[ 5 ] += f;
+        state[ 6 ] += g;
+        state[ 7 ] += h;
+    }
+}
+
+#if defined( __x86_64__ )
+/*
+ * Function    : sha256_hardware
+ * Parameters  : SHA-256 state, data, and number of 64 byte blocks
+ * Description : SHA-256 with the SHA extensions, four rounds per pair of sha256rnds2 instructions
+ */
+__attribute__( ( target( "sha,sse4.1" ) ) ) static void sha256_hardware( uint32_t *state, const uint8_t *data, size_t blocks )
+{
+    const __m128i byte_swap = _mm_set_epi64x( 0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL );
+    __m128i message[ 4 ];
+    int i;
+
+    // The instructions keep the state as ABEF and CDGH
+    __m128i cdab = _mm_shuffle_epi32( _mm_loadu_si128( ( const __m128i * )&state[ 0 ] ), 0xb1 );
+    __m128i efgh = _mm_shuffle_epi32( _mm_loadu_si128( ( const __m128i * )&state[ 4 ] ), 0x1b );
+    __m128i abef = _mm_alignr_epi8( cdab, efgh, 8 );
+    __m128i cdgh = _mm_blend_epi16( efgh, cdab, 0xf0 );
+
+    for ( ; blocks > 0; blocks--, data += 64 )
+    {
+        __m128i abef_start = abef, cdgh_start = cdgh;
+
+        for ( i = 0; i < 16; i++ )
+        {
+            __m128i *w = &message[ i & 3 ];
+            if ( i < 4 ) *w = _mm_shuffle_epi8( _mm_loadu_si128( ( const __m128i * )( data + 16 * i ) ), byte_swap );
+            else
+            {
+                __m128i previous = message[ ( i - 1 ) & 3 ];
+                *w = _mm_sha256msg1_epu32( *w, message[ ( i - 3 ) & 3 ] );
+                *w = _mm_add_epi32( *w, _mm_alignr_epi8( previous, message[ ( i - 2 ) & 3 ], 4 ) );
+                *w = _mm_sha256msg2_epu32( *w, previous );
+            }
+
+            __m128i keyed = _mm_add_epi32( *w, _mm_loadu_si128( ( const __m128i * )&SHA256_K[ 4 * i ] ) );
+            cdgh = _mm_sha256rnds2_epu32( cdgh, abef, keyed );
+            abef = _mm_sha256rnds2_epu32( abef, cdgh, _mm_shuffle_epi32( keyed, 0x0e ) );
+        }
+        abef = _mm_add_epi32( abef, abef_start );
+        cdgh = _mm_add_epi32( cdgh, cdgh_start );
+    }
+
+    __m128i feba = _mm_shuffle_epi32( abef, 0x1b );
+    __m128i dchg = _mm_shuffle_epi32( cdgh, 0xb1 );
+    _mm_storeu_si128( ( __m128i * )&state[ 0 ], _mm_blend_epi16( feba, dchg, 0xf0 ) );
+    _mm_storeu_si128( ( __m128i * )&state[ 4 ], _mm_alignr_epi8( dchg, feba, 8 ) );
+}
+#endif
+
+/*
+ * Function    : sha256_update
+ * Parameters  : SHA-256 state, data, and number of bytes
+ */
+static void sha256_update( struct Sha256State *sha, const uint8_t *data, size_t length )
+{
+    sha->length += length;
+    if ( sha->buffered > 0 )
+    {
+        size_t fill = 64 - sha->buffered < length ? 64 - sha->buffered : length;
+        memcpy( sha->buffer + sha->buffered, data, fill );
+        sha->buffered += fill;
+        data += fill;
+        length -= fill;
+        if ( sha->buffered < 64 ) return;
+        sha->blocks( sha->state, sha->buffer, 1 );
+        sha->buffered = 0;
+    }
+    sha->blocks( sha->state, data, length / 64 );
+    memcpy( sha->buffer, data + length / 64 * 64, length % 64 );
+    sha->buffered = length % 64;
+}
+
+/*
+ * Function    : sha256_final
+ * Parameters  : SHA-256 state and the 32 byte digest to fill in
+ */
+static void sha256_final( struct Sha256State *sha, uint8_t *digest )
+{
+    uint64_t bits = sha->length * 8;
+    uint8_t padding[ 72 ];
+    int i;
+
+    memset( padding, 0, sizeof( padding ) );
+    padding[ 0 ] = 0x80;
+    size_t pad = ( sha->buffered < 56 ? 56 : 120 ) - sha->buffered;
+    for ( i = 0; i < 8; i++ ) padding[ pad + i ] = ( uint8_t )( bits >> ( 56 - 8 * i ) );
+    sha256_update( sha, padding, pad + 8 );
+    for ( i = 0; i < 8; i++ )
+    {
+        uint32_t word = __builtin_bswap32( sha->state[ i ] );
+        memcpy( digest + 4 * i, &word, 4 );
+    }
+}
+
+/*
+ * Function    : hash_kind
+ * Parameters  : Algorithm name: crc32c, xxh3 or sha256
+ * Returns     : HASH_CRC32C, HASH_XXH3 or HASH_SHA256, or HASH_NONE if the name is unknown
+ */
+int hash_kind( const char *name )
+{
+    if ( !strcmp( name, "crc32c" ) ) return HASH_CRC32C;
+    if ( !strcmp( name, "xxh3" ) ) return HASH_XXH3;
+    if ( !strcmp( name, "sha256" ) ) return HASH_SHA256;
+    return HASH_NONE;
+}
+
+/*
+ * Function    : hasher_init
+ * Parameters  : Hasher and algorithm
+ * Description : Starts a hash, picking the hardware implementation when the processor has one
+ */
+void hasher_init( struct Hasher *hasher, int kind )
+{
+    memset( hasher, 0, sizeof( struct Hasher ) );
+    hasher->kind = kind;
+
+    if ( kind == HASH_CRC32C )
+    {
+        hasher->crc = 0xffffffffu;
+        hasher->crc_update = crc32c_software;
+#if defined( __x86_64__ )
+        if ( __builtin_cpu_supports( "sse4.2" ) ) hasher->crc_update = crc32c_hardware;
+#endif
+        if ( hasher->crc_update == crc32c_software ) pthread_once( &crc32c_once, crc32c_init_table );
+    }
+    else if ( kind == HASH_XXH3 )
+    {
+        static const uint64_t lanes[ 8 ] = { XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+                                             XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1 };
+        memcpy( hasher->xxh.lanes, lanes, sizeof( lanes ) );
+    }
+    else if ( kind == HASH_SHA256 )
+    {
+        static const uint32_t initial[ 8 ] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                               0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+        memcpy( hasher->sha.state, initial, sizeof( initial ) );
+        hasher->sha.blocks = sha256_software;
+#if defined( __x86_64__ )
+        if ( __builtin_cpu_supports( "sha" ) && __builtin_cpu_supports( "sse4.1" ) ) hasher->sha.blocks = sha256_hardware;
+#endif
+    }
+}
+
+/*
+ * Function    : hasher_update
+ * Parameters  : Hasher, data, and number of bytes
+ */
+void hasher_update( struct Hasher *hasher, const void *data, size_t length )
+{
+    switch ( hasher->kind )
+    {
+        case HASH_CRC32C: hasher->crc = hasher->crc_update( hasher->crc, ( const uint8_t * )data, length ); break;
+        case HASH_XXH3: xxh3_update( &hasher->xxh, ( const uint8_t * )data, length ); break;
+        case HASH_SHA256: sha256_update( &hasher->sha, ( const uint8_t * )data, length ); break;
+    }
+}
+
+/*
+ * Function    : hasher_final
+ * Parameters  : Hasher and a buffer of HASH_HEX_SIZE characters
+ * Description : Writes the digest as lowercase hex, in the byte order the usual tools print it
+ *               (crc32c and xxh3 as big endian numbers)
+ */
+void hasher_final( struct Hasher *hasher, char *hex )
+{
+    uint8_t digest[ 32 ];
+    int i;
+
+    switch ( hasher->kind )
+    {
+        case HASH_CRC32C: sprintf( hex, "%08x", ~hasher->crc ); return;
+        case HASH_XXH3: sprintf( hex, "%016llx", ( unsigned long long )xxh3_digest( &hasher->xxh ) ); return;
+        case HASH_SHA256:
+            sha256_final( &hasher->sha, digest );
+            for ( i = 0; i < 32; i++ ) sprintf( hex + 2 * i, "%02x", digest[ i ] );
+            return;
+    }
+    hex[ 0 ] = '\0';
+}
+
+/*
+ * Function    : read_at
+ * Parameters  : Fat32 image file, buffer, number of bytes, and the image offset to read from
+ * Returns     : Number of bytes read, which is less than size only at the end of the image or on error
+ * Description : Positional read that does not move the stdio file position, so it is safe to
+ *               call from several threads at once.
+ */
+ssize_t read_at( FILE *fp, void *buffer, size_t size, off_t offset )
+{
+    int fd = fileno( fp );
+    size_t done = 0;
+
+    while ( done < size )
+    {
+        ssize_t n = pread( fd, ( uint8_t * )buffer + done, size - done, offset + done );
+        if ( n < 0 && errno == EINTR ) continue;
+        if ( n <= 0 ) break;
+        done += n;
+    }
+    return done;
+}
+
+/*
+ * Function    : cluster_size
+ * Parameters  : Fat32 info structure
+ * Returns     : Number of bytes in a cluster
+ */
+uint32_t cluster_size( struct f32info *f32 )
+{
+    return ( uint32_t )( uint16_t )f32->BPB_BytsPerSec * ( uint8_t )f32->BPB_SecPerClus;
+}
+
+/*
+ * Function    : volume_clusters
+ * Parameters  : Fat32 info structure
+ * Returns     : Number of clusters the FAT describes, including the 2 reserved ones
+ * Description : Computed from the boot sector alone, so it is known without loading the FAT
+ */
+uint32_t volume_clusters( struct f32info *f32 )
+{
+    uint64_t fat_bytes = ( uint64_t )( uint32_t )f32->BPB_FATSz32 * ( uint16_t )f32->BPB_BytsPerSec;
+    uint64_t data_sectors = ( uint32_t )f32->BPB_TotSec32 - ( ( uint16_t )f32->BPB_RsvdSecCnt + ( uint64_t )f32->BPB_NumFATS * ( uint32_t )f32->BPB_FATSz32 );
+    uint64_t entries = data_sectors / ( uint8_t )f32->BPB_SecPerClus + 2;
+    if ( entries > fat_bytes / 4 ) entries = fat_bytes / 4;
+    return ( uint32_t )entries;
+}
+
+/*
+ * Function    : load_fat
+ * Parameters  : Fat32 info structure and the fat32 image
+ * Returns     : The first FAT of the image, or NULL if it could not be read
+ * Description : Reads the first FAT into memory the first time it is needed, so cluster
+ *               chains can be followed without a seek and read per cluster.
+ */
+uint32_t *load_fat( struct f32info *f32, FILE *fp )
+{
+    if ( fat_table ) return fat_table;
+
+    uint64_t fat_bytes = ( uint64_t )( uint32_t )f32->BPB_FATSz32 * ( uint16_t )f32->BPB_BytsPerSec;
+    uint32_t *table = ( uint32_t * )malloc( fat_bytes );
+    uint8_t *dirty = ( uint8_t * )calloc( ( uint32_t )f32->BPB_FATSz32, 1 );
+    off_t fat_offset = ( off_t )( uint16_t )f32->BPB_BytsPerSec * ( uint16_t )f32->BPB_RsvdSecCnt;
+    if ( !table || !dirty || read_at( fp, table, fat_bytes, fat_offset ) != ( ssize_t )fat_bytes )
+    {
+        free( table );
+        free( dirty );
+        return NULL;
+    }
+
+    fat_table = table;
+    fat_dirty = dirty;
+    fat_entries = volume_clusters( f32 );
+    return fat_table;
+}
+
+/*
+ * Function    : next_cluster
+ * Parameters  : Cluster number
+ * Returns     : The cluster following it in its chain, or 0 at the end of the chain
+ * Description : Follows a chain through the FAT loaded by load_fat()
+ */
+uint32_t next_cluster( uint32_t cluster )
+{
+    if ( cluster < 2 || cluster >= fat_entries ) return 0;
+    uint32_t next = fat_table[ cluster ] & 0x0fffffff;
+    if ( next < 2 || next >= fat_entries ) return 0; // End of chain, bad cluster or free
+    return next;
+}
+
+/*
+ * Function    : first_cluster
+ * Parameters  : Directory entry
+ * Returns     : The first cluster of the entry, combining DIR_FirstClusterHigh and DIR_FirstClusterLow
+ */
+uint32_t first_cluster( struct DirectoryEntry *entry )
+{
+    return ( ( uint32_t )entry->DIR_FirstClusterHigh << 16 ) | entry->DIR_FirstClusterLow;
+}
+
+/*
+ * Function    : read_directory
+ * Parameters  : First cluster of the directory, fat32 info structure, fat32 image, and the entry count to fill in
+ * Returns     : Every directory entry in the cluster chain of the directory, or NULL on failure.
+ *               The caller frees the array.
+ * Description : Reads a whole directory, unlike the 16 entries of its first cluster held in dir
+ */
+struct DirectoryEntry *read_directory( uint32_t cluster, struct f32info *f32, FILE *fp, int *count )
+{
+    uint32_t bytes = cluster_size( f32 );
+    uint32_t per_cluster = bytes / sizeof( struct DirectoryEntry );
+    uint32_t clusters = 0, capacity = 4;
+    struct DirectoryEntry *entries = ( struct DirectoryEntry * )malloc( ( size_t )capacity * bytes );
+
+    *count = 0;
+    if ( !entries || !load_fat( f32, fp ) ) return NULL;
+
+    while ( cluster >= 2 && clusters < fat_entries )
+    {
+        if ( clusters == capacity )
+        {
+            capacity *= 2;
+            struct DirectoryEntry *grown = ( struct DirectoryEntry * )realloc( entries, ( size_t )capacity * bytes );
+            if ( !grown ) break;
+            entries = grown;
+        }
+
+        if ( read_at( fp, &entries[ clusters * per_cluster ], bytes, LBAToOffset( cluster, f32 ) ) != bytes ) break;
+        clusters++;
+
+        // Stop once the end of directory marker has been read
+        struct EntryMasks masks = { 0 };
+        int i;
+        for ( i = 0; i < ( int )per_cluster; i += SCAN_BLOCK )
+        {
+            int block = per_cluster - i < SCAN_BLOCK ? per_cluster - i : SCAN_BLOCK;
+            classify_entries( &entries[ ( clusters - 1 ) * per_cluster + i ], block, &masks );
+            if ( masks.end ) break;
+        }
+        if ( masks.end ) break;
+
+        cluster = next_cluster( cluster );
+    }
+
+    *count = clusters * per_cluster;
+    return entries;
+}
+
+/*
+ * Function    : format_short_name
+ * Parameters  : 11 byte DIR_Name and a buffer of at least 13 characters
+ * Description : Formats an 8.3 name the way users type it, e.g. "FOO     TXT" becomes "FOO.TXT"
+ */
+void format_short_name( const char *IMG_Name, char *out )
+{
+    int i, n = 0;
+    for ( i = 0; i < 8 && IMG_Name[ i ] != ' '; i++ ) out[ n++ ] = IMG_Name[ i ];
+    if ( IMG_Name[ 8 ] != ' ' )
+    {
+        out[ n++ ] = '.';
+        for ( i = 8; i < 11 && IMG_Name[ i ] != ' '; i++ ) out[ n++ ] = IMG_Name[ i ];
+    }
+    out[ n ] = '\0';
+}
+
+/*
+ * Function    : host_name
+ * Parameters  : Name of an entry, changed in place
+ * Description : Makes a name from the image safe to use as one component of a host path. A crafted
+ *               long name may hold "/" or be "." or "..", which would write outside the destination,
+ *               so those characters become "_".
+ */
+void host_name( char *name )
+{
+    char *c;
+    for ( c = name; *c; c++ )
+    {
+        if ( *c == '/' ) *c = '_';
+    }
+    if ( !strcmp( name, "." ) || !strcmp( name, ".." ) )
+    {
+        for ( c = name; *c; c++ ) *c = '_';
+    }
+}
+
+/*
+ * Function    : hash_boot_sector
+ * Parameters  : Fat32 image
+ * Returns     : XXH3 hash of the boot sector, 0 if it could not be read
+ */
+uint64_t hash_boot_sector( FILE *fp )
+{
+    uint8_t boot[ 512 ];
+    if ( read_at( fp, boot, sizeof( boot ), 0 ) != sizeof( boot ) ) return 0;
+    return xxh3_64( boot, sizeof( boot ) );
+}
+
+/*
+ * Function    : hash_fsinfo_sector
+ * Parameters  : Fat32 info structure and the fat32 image
+ * Returns     : XXH3 hash of the FSInfo sector, 0 if the image has none or it could not be read
+ * Description : The free cluster count and next free hint of the FSInfo sector change with every
+ *               allocation, so a changed hash is a cheap sign that clusters were allocated or freed.
+ */
+uint64_t hash_fsinfo_sector( struct f32info *f32, FILE *fp )
+{
+    uint32_t sector_size = ( uint16_t )f32->BPB_BytsPerSec;
+    uint16_t sector = 0;
+
+    if ( read_at( fp, &sector, 2, 48 ) != 2 || sector == 0 || sector == 0xffff || sector_size == 0 ) return 0;
+
+    uint8_t *buffer = ( uint8_t * )malloc( sector_size );
+    uint64_t hash = 0;
+    if ( buffer && read_at( fp, buffer, sector_size, ( off_t )sector * sector_size ) == sector_size ) hash = xxh3_64( buffer, sector_size );
+    free( buffer );
+    return hash;
+}
+
+/*
+ * Function    : hash_fat_sectors
+ * Parameters  : Fat32 info structure, fat32 image, and the sector count to fill in
+ * Returns     : The XXH3 hash of every sector of the first FAT, or NULL on failure. The caller frees it.
+ * Description : Comparing these against the hashes stored in an index tells exactly which
+ *               sectors of the FAT, and so which cluster chains, changed since it was built.
+ */
+uint64_t *hash_fat_sectors( struct f32info *f32, FILE *fp, uint32_t *count )
+{
+    uint32_t sector_size = ( uint16_t )f32->BPB_BytsPerSec;
+    uint32_t sectors = ( uint32_t )f32->BPB_FATSz32;
+    uint32_t i;
+
+    if ( !load_fat( f32, fp ) ) return NULL;
+
+    uint64_t *hashes = ( uint64_t * )malloc( ( uint64_t )sectors * sizeof( uint64_t ) );
+    if ( !hashes ) return NULL;
+
+    for ( i = 0; i < sectors; i++ )
+    {
+        hashes[ i ] = xxh3_64( ( uint8_t * )fat_table + ( uint64_t )i * sector_size, sector_size );
+    }
+    *count = sectors;
+    return hashes;
+}
+
+/*
+ * Function    : grow_array
+ * Parameters  : Array, its capacity in elements, the number of elements needed, and the element size
+ * Returns     : 1 on success, 0 if memory ran out
+ */
+int grow_array( void **array, uint64_t *capacity, uint64_t needed, size_t element_size )
+{
+    if ( needed <= *capacity ) return 1;
+
+    uint64_t grown = *capacity ? *capacity : 64;
+    while ( grown < needed ) grown *= 2;
+
+    void *resized = realloc( *array, grown * element_size );
+    if ( !resized ) return 0;
+
+    *array = resized;
+    *capacity = grown;
+    return 1;
+}
+
+/*
+ * Function    : add_extents
+ * Parameters  : Index builder and the first cluster of a chain
+ * Returns     : Number of extents the chain was split into
+ * Description : Follows a cluster chain and records it as runs of consecutive clusters
+ */
+uint32_t add_extents( struct IndexBuilder *builder, uint32_t cluster )
+{
+    uint32_t count = 0, steps = 0;
+
+    while ( cluster >= 2 && cluster < fat_entries && steps < fat_entries )
+    {
+        uint32_t start = cluster, length = 1;
+        uint32_t next = next_cluster( cluster );
+        steps++;
+
+        while ( next == cluster + 1 && steps < fat_entries )
+        {
+            cluster = next;
+            next = next_cluster( cluster );
+            length++;
+            steps++;
+        }
+
+        if ( !grow_array( ( void ** )&builder->extents, &builder->extent_capacity, builder->extent_count + 1, sizeof( struct IndexExtent ) ) ) break;
+        builder->extents[ builder->extent_count ].cluster = start;
+        builder->extents[ builder->extent_count ].length = length;
+        builder->extent_count++;
+        count++;
+
+        cluster = next;
+    }
+    return count;
+}
+
+/*
+ * Function    : add_name
+ * Parameters  : Index builder and a null terminated name
+ * Returns     : Offset of the name in the name table
+ */
+uint32_t add_name( struct IndexBuilder *builder, const char *name )
+{
+    uint64_t length = strlen( name ) + 1;
+    uint32_t offset = builder->names_size;
+
+    if ( !grow_array( ( void ** )&builder->names, &builder->names_capacity, builder->names_size + length, 1 ) ) return 0;
+    memcpy( builder->names + builder->names_size, name, length );
+    builder->names_size += length;
+    return offset;
+}
+
+/*
+ * Function    : chain_unchanged
+ * Parameters  : Index builder and a dentry of the previous index
+ * Returns     : 1 if none of the FAT sectors describing the chain of the dentry changed, 0 otherwise
+ */
+int chain_unchanged( struct IndexBuilder *builder, uint32_t origin )
+{
+    struct IndexDentry *old = &builder->previous->dentries[ origin ];
+    uint32_t i;
+
+    for ( i = 0; i < old->extent_count; i++ )
+    {
+        struct IndexExtent *extent = &builder->previous->extents[ old->extent_first + i ];
+        uint32_t sector = extent->cluster / builder->entries_per_sector;
+        uint32_t last = ( extent->cluster + extent->length - 1 ) / builder->entries_per_sector;
+
+        for ( ; sector <= last; sector++ )
+        {
+            if ( sector >= builder->fat_sector_count || builder->changed_sectors[ sector ] ) return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Function    : set_extents
+ * Parameters  : Index builder and a new dentry
+ * Description : Records the extent map of a dentry. If the dentry was in the previous index and its
+ *               chain is described by FAT sectors that did not change, the old extents are copied
+ *               instead of following the chain again.
+ */
+void set_extents( struct IndexBuilder *builder, uint32_t index )
+{
+    struct IndexDentry *dentry = &builder->dentries[ index ];
+    uint32_t origin = builder->origins[ index ];
+
+    dentry->extent_first = builder->extent_count;
+
+    if ( origin != INDEX_NONE && builder->previous->dentries[ origin ].first_cluster == dentry->first_cluster &&
+         chain_unchanged( builder, origin ) )
+    {
+        struct IndexDentry *old = &builder->previous->dentries[ origin ];
+        if ( !grow_array( ( void ** )&builder->extents, &builder->extent_capacity, builder->extent_count + old->extent_count, sizeof( struct IndexExtent ) ) ) return;
+
+        memcpy( &builder->extents[ builder->extent_count ], &builder->previous->extents[ old->extent_first ], ( uint64_t )old->extent_count * sizeof( struct IndexExtent ) );
+        builder->extent_count += old->extent_count;
+        dentry->extent_count = old->extent_count;
+        builder->chains_reused++;
+        return;
+    }
+
+    dentry->extent_count = add_extents( builder, dentry->first_cluster );
+    builder->chains_walked++;
+}
+
+/*
+ * Function    : extent_clusters
+ * Parameters  : Extents of an index and a dentry
+ * Returns     : Number of clusters in the chain of the dentry
+ */
+uint64_t extent_clusters( const struct IndexExtent *extents, const struct IndexDentry *dentry )
+{
+    uint64_t clusters = 0;
+    uint32_t i;
+    for ( i = 0; i < dentry->extent_count; i++ ) clusters += extents[ dentry->extent_first + i ].length;
+    return clusters;
+}
+
+/*
+ * Function    : new_dentry
+ * Parameters  : Index builder, parent dentry, and the matching dentry of the previous index or INDEX_NONE
+ * Returns     : Index of the new, zeroed dentry, or INDEX_NONE if memory ran out
+ */
+uint32_t new_dentry( struct IndexBuilder *builder, uint32_t parent, uint32_t origin )
+{
+    if ( !grow_array( ( void ** )&builder->dentries, &builder->dentry_capacity, builder->dentry_count + 1, sizeof( struct IndexDentry ) ) ) return INDEX_NONE;
+    if ( !grow_array( ( void ** )&builder->origins, &builder->origin_capacity, builder->dentry_count + 1, sizeof( uint32_t ) ) ) return INDEX_NONE;
+
+    uint32_t index = builder->dentry_count++;
+    memset( &builder->dentries[ index ], 0, sizeof( struct IndexDentry ) );
+    builder->dentries[ index ].parent = parent;
+    builder->dentries[ index ].first_child = INDEX_NONE;
+    builder->origins[ index ] = builder->previous ? origin : INDEX_NONE;
+    return index;
+}
+
+/*
+ * Function    : add_dentry
+ * Parameters  : Index builder, parent dentry, the short directory entry, its long name if any, its location,
+ *               and the matching dentry of the previous index or INDEX_NONE
+ * Returns     : Index of the new dentry, or INDEX_NONE if memory ran out
+ */
+uint32_t add_dentry( struct IndexBuilder *builder, uint32_t parent, struct DirectoryEntry *entry, struct LongName *long_name,
+                     uint32_t entry_cluster, uint32_t entry_index, uint32_t origin )
+{
+    char name[ LFN_MAX_UNITS * 3 + 1 ];
+
+    uint32_t index = new_dentry( builder, parent, origin );
+    if ( index == INDEX_NONE ) return INDEX_NONE;
+
+    if ( long_name ) utf16_to_utf8( long_name->chars, long_name->length, name, sizeof( name ) );
+    else format_short_name( entry->DIR_Name, name );
+
+    struct IndexDentry *dentry = &builder->dentries[ index ];
+    dentry->name_offset = add_name( builder, name );
+    dentry->first_cluster = ( ( uint32_t )entry->DIR_FirstClusterHigh << 16 ) | entry->DIR_FirstClusterLow;
+    dentry->size = entry->DIR_FileSize;
+    dentry->entry_cluster = entry_cluster;
+    dentry->entry_index = entry_index;
+    dentry->write_time = entry->Unused2[ 0 ] | ( entry->Unused2[ 1 ] << 8 );
+    dentry->write_date = entry->Unused2[ 2 ] | ( entry->Unused2[ 3 ] << 8 );
+    dentry->attr = entry->DIR_Attr;
+    dentry->has_long_name = long_name != NULL;
+    memcpy( dentry->short_name, entry->DIR_Name, 11 );
+
+    set_extents( builder, index );
+
+    // Files are their own total. A directory keeps the totals of its previous dentry, which every
+    // modification of the image since has kept up to date, see adjust_totals().
+    struct IndexDentry *old = builder->origins[ index ] != INDEX_NONE ? &builder->previous->dentries[ origin ] : NULL;
+    dentry->total_size = 0;
+    dentry->total_clusters = TOTALS_UNKNOWN;
+    if ( !( dentry->attr & 0x10 ) )
+    {
+        dentry->total_size = dentry->size;
+        dentry->total_clusters = extent_clusters( builder->extents, dentry );
+    }
+    else if ( old && ( old->attr & 0x10 ) && old->first_cluster == dentry->first_cluster )
+    {
+        dentry->total_size = old->total_size;
+        dentry->total_clusters = old->total_clusters;
+    }
+    return index;
+}
+
+/*
+ * Function    : copy_dentry
+ * Parameters  : Index builder, parent dentry, and a dentry of the previous index
+ * Returns     : Index of the new dentry, or INDEX_NONE if memory ran out
+ * Description : Carries a dentry over from the previous index when its directory did not change
+ */
+uint32_t copy_dentry( struct IndexBuilder *builder, uint32_t parent, uint32_t origin )
+{
+    struct IndexDentry *old = &builder->previous->dentries[ origin ];
+
+    uint32_t index = new_dentry( builder, parent, origin );
+    if ( index == INDEX_NONE ) return INDEX_NONE;
+
+    struct IndexDentry *dentry = &builder->dentries[ index ];
+    uint32_t name_offset = add_name( builder, builder->previous->names + old->name_offset );
+    *dentry = *old;
+    dentry->parent = parent;
+    dentry->first_child = INDEX_NONE;
+    dentry->child_count = 0;
+    dentry->hash_count = 0;
+    dentry->name_offset = name_offset;
+
+    set_extents( builder, index );
+    if ( !( dentry->attr & 0x10 ) ) dentry->total_clusters = extent_clusters( builder->extents, dentry );
+    return index;
+}
+
+/*
+ * Function    : free_index
+ * Parameters  : Volume index
+ * Description : Releases an index, whether it was built in memory or mapped from a sidecar file
+ */
+void free_index( struct VolumeIndex *index )
+{
+    if ( !index ) return;
+    if ( index->mapped ) munmap( index->base, index->size );
+    else free( index->base );
+    free( index->directory_slots );
+    pthread_mutex_destroy( &index->lock );
+    free( index );
+}
+
+/*
+ * Function    : section_fits
+ * Parameters  : Offset of a section, its size in bytes, and the size of the index image
+ * Returns     : 1 if the section lies inside the image and is 8 byte aligned, 0 otherwise
+ */
+int section_fits( uint64_t offset, uint64_t bytes, uint64_t size )
+{
+    return offset % 8 == 0 && offset <= size && bytes <= size - offset;
+}
+
+/*
+ * Function    : dentries_consistent
+ * Parameters  : Header and dentries of an index image, and its names
+ * Returns     : 1 if every dentry refers only to dentries, extents, names and hashes inside the
+ *               index, 0 otherwise
+ * Description : Dentries are stored breadth first, so a parent always comes before its children.
+ *               Requiring that also rules out loops between dentries of a corrupted sidecar.
+ */
+int dentries_consistent( const struct IndexHeader *header, const struct IndexDentry *dentries, const char *names )
+{
+    uint32_t i;
+
+    if ( header->names_size == 0 || names[ header->names_size - 1 ] != '\0' ) return 0; // Every name ends inside the section
+
+    for ( i = 0; i < header->dentry_count; i++ )
+    {
+        const struct IndexDentry *dentry = &dentries[ i ];
+        if ( ( i > 0 && dentry->parent >= i ) || dentry->name_offset >= header->names_size ||
+             ( uint64_t )dentry->extent_first + dentry->extent_count > header->extent_count ||
+             ( uint64_t )dentry->hash_first + dentry->hash_count > header->dir_hash_count )
+        {
+            return 0;
+        }
+        if ( dentry->first_child == INDEX_NONE ? dentry->child_count != 0
+                                               : dentry->first_child <= i || ( uint64_t )dentry->first_child + dentry->child_count > header->dentry_count )
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Function    : attach_index
+ * Parameters  : Contiguous index image, its size, and whether it is mapped from a file
+ * Returns     : The index, or NULL if the image is not a well formed index of this version
+ * Description : Resolves the sections of an index from the offsets stored in its header. The sections
+ *               hold indices and offsets rather than pointers, so the same bytes work at any address.
+ */
+struct VolumeIndex *attach_index( void *base, uint64_t size, int mapped )
+{
+    struct IndexHeader *header = ( struct IndexHeader * )base;
+
+    if ( size < sizeof( struct IndexHeader ) || memcmp( header->magic, INDEX_MAGIC, 8 ) != 0 ||
+         header->version != INDEX_VERSION || header->file_size != size ||
+         !section_fits( header->dentry_offset, ( uint64_t )header->dentry_count * sizeof( struct IndexDentry ), size ) ||
+         !section_fits( header->extent_offset, ( uint64_t )header->extent_count * sizeof( struct IndexExtent ), size ) ||
+         header->names_offset > size || header->names_size > size - header->names_offset ||
+         !section_fits( header->bitmap_offset, ( ( uint64_t )header->cluster_count + 63 ) / 64 * 8, size ) ||
+         !section_fits( header->fat_hash_offset, ( uint64_t )header->fat_sector_count * sizeof( uint64_t ), size ) ||
+         header->dir_hash_count > size / sizeof( uint64_t ) ||
+         !section_fits( header->dir_hash_offset, header->dir_hash_count * sizeof( uint64_t ), size ) ||
+         header->dentry_count == 0 ||
+         !dentries_consistent( header, ( struct IndexDentry * )( ( uint8_t * )base + header->dentry_offset ), ( char * )base + header->names_offset ) )
+    {
+        return NULL;
+    }
+
+    struct VolumeIndex *index = ( struct VolumeIndex * )calloc( 1, sizeof( struct VolumeIndex ) );
+    if ( !index ) return NULL;
+
+    index->base = base;
+    index->size = size;
+    index->mapped = mapped;
+    index->header = header;
+    index->dentries = ( struct IndexDentry * )( ( uint8_t * )base + header->dentry_offset );
+    index->extents = ( struct IndexExtent * )( ( uint8_t * )base + header->extent_offset );
+    index->names = ( char * )base + header->names_offset;
+    index->free_map = ( uint64_t * )( ( uint8_t * )base + header->bitmap_offset );
+    index->fat_hashes = ( uint64_t * )( ( uint8_t * )base + header->fat_hash_offset );
+    index->dir_hashes = ( uint64_t * )( ( uint8_t * )base + header->dir_hash_offset );
+    pthread_mutex_init( &index->lock, NULL );
+    return index;
+}
+
+/*
+ * Function    : index_directory
+ * Parameters  : Volume index and the first cluster of a directory
+ * Returns     : The dentry of the directory, or INDEX_NONE if the index has none
+ * Description : Looks the directory up in a hash table of every directory dentry. The table is
+ *               built the first time it is needed and lives as long as the index.
+ */
+uint32_t index_directory( struct VolumeIndex *index, uint32_t cluster )
+{
+    uint32_t i, slot;
+
+    pthread_mutex_lock( &index->lock ); // Workers of a walk may be the first to ask
+    if ( !index->directory_slots )
+    {
+        uint64_t size = 16;
+        while ( size < ( uint64_t )index->header->dentry_count * 2 ) size <<= 1; // At most half full
+
+        uint32_t *slots = ( uint32_t * )malloc( size * sizeof( uint32_t ) );
+        if ( slots )
+        {
+            memset( slots, 0xff, size * sizeof( uint32_t ) );
+            index->directory_mask = ( uint32_t )( size - 1 );
+
+            for ( i = 0; i < index->header->dentry_count; i++ )
+            {
+                if ( !( index->dentries[ i ].attr & 0x10 ) ) continue;
+                slot = ( index->dentries[ i ].first_cluster * XXH_PRIME32_1 ) & index->directory_mask;
+                while ( slots[ slot ] != INDEX_NONE ) slot = ( slot + 1 ) & index->directory_mask;
+                slots[ slot ] = i;
+            }
+            index->directory_slots = slots;
+        }
+    }
+    pthread_mutex_unlock( &index->lock );
+    if ( !index->directory_slots ) return INDEX_NONE;
+
+    for ( slot = ( cluster * XXH_PRIME32_1 ) & index->directory_mask; index->directory_slots[ slot ] != INDEX_NONE;
+          slot = ( slot + 1 ) & index->directory_mask )
+    {
+        if ( index->dentries[ index->directory_slots[ slot ] ].first_cluster == cluster ) return index->directory_slots[ slot ];
+    }
+    return INDEX_NONE;
+}
+
+/*
+ * Function    : index_entry
+ * Parameters  : Directory entry to fill in, its 8.3 name, attribute, first cluster, size, and write time and date
+ */
+void index_entry( struct DirectoryEntry *entry, const char *short_name, uint8_t attr, uint32_t cluster, uint32_t size,
+                  uint16_t write_time, uint16_t write_date )
+{
+    memset( entry, 0, sizeof( struct DirectoryEntry ) );
+    memcpy( entry->DIR_Name, short_name, 11 );
+    entry->DIR_Attr = attr;
+    entry->DIR_FirstClusterHigh = cluster >> 16;
+    entry->DIR_FirstClusterLow = cluster & 0xffff;
+    entry->Unused2[ 0 ] = write_time & 0xff;
+    entry->Unused2[ 1 ] = write_time >> 8;
+    entry->Unused2[ 2 ] = write_date & 0xff;
+    entry->Unused2[ 3 ] = write_date >> 8;
+    entry->DIR_FileSize = size;
+}
+
+/*
+ * Function    : list_directory
+ * Parameters  : First cluster of the directory, fat32 info structure, fat32 image, and the entry count to fill in
+ * Returns     : The entries of the directory, or NULL on failure. The caller frees the array.
+ * Description : Lists a directory for the commands that only walk it. If the loaded index holds the
+ *               directory, its entries are rebuilt from the dentries, with "." and ".." and the long
+ *               filename entries of every long name, so walk_next() sees them as it would on disk and
+ *               neither the directory nor the FAT is read. Deleted entries are not in the index and
+ *               are left out. Otherwise the directory is read with read_directory().
+ */
+struct DirectoryEntry *list_directory( uint32_t cluster, struct f32info *f32, FILE *fp, int *count )
+{
+    struct VolumeIndex *index = volume_index;
+    uint32_t dentry = index ? index_directory( index, cluster ) : INDEX_NONE;
+    if ( dentry == INDEX_NONE ) return read_directory( cluster, f32, fp, count );
+
+    struct IndexDentry *directory = &index->dentries[ dentry ];
+    struct DirectoryEntry *entries = NULL;
+    uint64_t capacity = 0, used = 0;
+    uint16_t chars[ LFN_MAX_UNITS ];
+    uint32_t i;
+    int k;
+
+    *count = 0;
+    if ( !grow_array( ( void ** )&entries, &capacity, 2, sizeof( struct DirectoryEntry ) ) ) return NULL;
+
+    // "." and "..", which the root directory does not have
+    struct IndexDentry *parent = &index->dentries[ directory->parent ];
+    if ( directory->dot_attr[ 0 ] )
+    {
+        index_entry( &entries[ used++ ], ".          ", directory->dot_attr[ 0 ], directory->first_cluster, 0, directory->write_time, directory->write_date );
+    }
+    if ( directory->dot_attr[ 1 ] )
+    {
+        index_entry( &entries[ used++ ], "..         ", directory->dot_attr[ 1 ], directory->parent == 0 ? 0 : parent->first_cluster, 0,
+                     parent->write_time, parent->write_date );
+    }
+
+    for ( i = 0; i < directory->child_count; i++ )
+    {
+        struct IndexDentry *child = &index->dentries[ directory->first_child + i ];
+        int length = child->has_long_name ? utf8_to_utf16( index->names + child->name_offset, chars, LFN_MAX_UNITS ) : 0;
+        int long_entries = length > 0 ? ( length + LFN_CHARS_PER_ENTRY - 1 ) / LFN_CHARS_PER_ENTRY : 0;
+
+        if ( !grow_array( ( void ** )&entries, &capacity, used + long_entries + 1, sizeof( struct DirectoryEntry ) ) )
+        {
+            free( entries );
+            return NULL;
+        }
+
+        // The name ends in 0x0000 unless it fills its last entry, and the rest is padded with 0xffff
+        for ( k = length; k < long_entries * LFN_CHARS_PER_ENTRY; k++ ) chars[ k ] = k == length ? 0x0000 : 0xffff;
+
+        for ( k = long_entries; k >= 1; k-- ) // Stored last part first
+        {
+            struct LongNameEntry *lfn = ( struct LongNameEntry * )&entries[ used++ ];
+            uint16_t *slot = &chars[ ( k - 1 ) * LFN_CHARS_PER_ENTRY ];
+            int j;
+
+            memset( lfn, 0, sizeof( struct LongNameEntry ) );
+            lfn->LDIR_Ord = k | ( k == long_entries ? LFN_LAST_ENTRY : 0 );
+            lfn->LDIR_Attr = LFN_ATTR;
+            lfn->LDIR_Chksum = lfn_checksum( child->short_name );
+            for ( j = 0; j < 5; j++ ) lfn->LDIR_Name1[ j ] = slot[ j ];
+            for ( j = 0; j < 6; j++ ) lfn->LDIR_Name2[ j ] = slot[ 5 + j ];
+            for ( j = 0; j < 2; j++ ) lfn->LDIR_Name3[ j ] = slot[ 11 + j ];
+        }
+        index_entry( &entries[ used++ ], child->short_name, child->attr, child->first_cluster, child->size,
+                     child->write_time, child->write_date );
+    }
+
+    *count = ( int )used;
+    return entries;
+}
+
+/*
+ * Function    : build_index
+ * Parameters  : Fat32 info structure, the fat32 image, and an optional index of an earlier state of the image
+ * Returns     : Index of the whole volume, or NULL on failure
+ * Description : Walks every directory from the root breadth first, recording each entry with its
+ *               extent map, then derives the free cluster bitmap from the FAT. Children of a directory
+ *               are stored next to each other, so a directory is its first child and child count.
+ *
+ *               Every FAT sector and every directory cluster is hashed. Given a previous index, a
+ *               directory whose clusters hash the same is carried over without being parsed, and a
+ *               chain whose FAT sectors hash the same keeps its extents without being followed.
+ */
+struct VolumeIndex *build_index( struct f32info *f32, FILE *fp, struct VolumeIndex *previous )
+{
+    struct IndexBuilder builder;
+    struct DirectoryEntry root;
+    uint32_t i, j;
+
+    if ( !load_fat( f32, fp ) ) return NULL;
+    memset( &builder, 0, sizeof( builder ) );
+
+    uint64_t boot_hash = hash_boot_sector( fp );
+    uint64_t *fat_hashes = hash_fat_sectors( f32, fp, &builder.fat_sector_count );
+    uint64_t *visited = ( uint64_t * )calloc( ( fat_entries + 63 ) / 64, 8 );
+    builder.changed_sectors = ( uint8_t * )calloc( builder.fat_sector_count + 1, 1 );
+    if ( !fat_hashes || !visited || !builder.changed_sectors )
+    {
+        free( fat_hashes );
+        free( visited );
+        free( builder.changed_sectors );
+        return NULL;
+    }
+
+    // An index of another volume, or of differently sized FATs, is of no help
+    if ( previous && ( previous->header->boot_hash != boot_hash || previous->header->fat_sector_count != builder.fat_sector_count ) )
+    {
+        previous = NULL;
+    }
+    builder.previous = previous;
+    builder.entries_per_sector = ( uint16_t )f32->BPB_BytsPerSec / 4;
+    for ( i = 0; i < builder.fat_sector_count; i++ )
+    {
+        builder.changed_sectors[ i ] = !previous || previous->fat_hashes[ i ] != fat_hashes[ i ];
+        builder.changed_sector_count += builder.changed_sectors[ i ];
+    }
+
+    memset( &root, 0, sizeof( root ) );
+    root.DIR_Attr = 0x10;
+    root.DIR_FirstClusterHigh = ( uint32_t )f32->BPB_RootClus >> 16;
+    root.DIR_FirstClusterLow = ( uint32_t )f32->BPB_RootClus & 0xffff;
+    add_dentry( &builder, 0, &root, NULL, 0, 0, 0 );
+    builder.dentries[ 0 ].name_offset = add_name( &builder, "/" );
+
+    for ( i = 0; i < builder.dentry_count; i++ )
+    {
+        uint32_t cluster = builder.dentries[ i ].first_cluster;
+        if ( !( builder.dentries[ i ].attr & 0x10 ) || cluster < 2 || cluster >= fat_entries ) continue;
+        if ( visited[ cluster / 64 ] & ( 1ULL << ( cluster % 64 ) ) ) continue; // Loop in a corrupted image
+        visited[ cluster / 64 ] |= 1ULL << ( cluster % 64 );
+
+        int count, entry;
+        struct DirectoryEntry *entries = read_directory( cluster, f32, fp, &count );
+        if ( !entries ) continue;
+
+        // Hash the directory a cluster at a time
+        uint32_t per_cluster = cluster_size( f32 ) / sizeof( struct DirectoryEntry );
+        uint32_t clusters = count / per_cluster;
+        if ( !grow_array( ( void ** )&builder.dir_hashes, &builder.dir_hash_capacity, builder.dir_hash_count + clusters, sizeof( uint64_t ) ) )
+        {
+            free( entries );
+            break;
+        }
+        builder.dentries[ i ].hash_first = builder.dir_hash_count;
+        builder.dentries[ i ].hash_count = clusters;
+        for ( j = 0; j < clusters; j++ )
+        {
+            builder.dir_hashes[ builder.dir_hash_count++ ] = xxh3_64( &entries[ j * per_cluster ], cluster_size( f32 ) );
+        }
+        builder.directory_count++;
+
+        // The "." and ".." entries are not indexed, only whether they are there and how they are marked
+        memset( builder.dentries[ i ].dot_attr, 0, 2 );
+        for ( j = 0; j < 2 && j < ( uint32_t )count; j++ )
+        {
+            if ( !memcmp( entries[ j ].DIR_Name, ".          ", 11 ) ) builder.dentries[ i ].dot_attr[ 0 ] = entries[ j ].DIR_Attr;
+            if ( !memcmp( entries[ j ].DIR_Name, "..         ", 11 ) ) builder.dentries[ i ].dot_attr[ 1 ] = entries[ j ].DIR_Attr;
+        }
+
+        uint32_t origin = builder.origins[ i ];
+        struct IndexDentry *old = origin != INDEX_NONE ? &previous->dentries[ origin ] : NULL;
+        int unchanged = old && ( old->attr & 0x10 ) && old->first_cluster == cluster && old->hash_count == clusters;
+        for ( j = 0; unchanged && j < clusters; j++ )
+        {
+            unchanged = previous->dir_hashes[ old->hash_first + j ] == builder.dir_hashes[ builder.dentries[ i ].hash_first + j ];
+        }
+
+        builder.dentries[ i ].first_child = builder.dentry_count;
+
+        if ( unchanged )
+        {
+            // Same entries as before, take them from the previous index
+            for ( j = 0; j < old->child_count; j++ )
+            {
+                if ( copy_dentry( &builder, i, old->first_child + j ) == INDEX_NONE ) break;
+                builder.dentries[ i ].child_count++;
+            }
+        }
+        else
+        {
+            struct DirectoryWalk walk;
+            uint32_t entry_cluster = cluster;
+            int entry_cluster_start = 0;
+            uint32_t old_child = 0;
+
+            builder.directories_parsed++;
+            walk_begin( &walk, entries, count, 0 );
+            while ( ( entry = walk_next( &walk ) ) != -1 )
+            {
+                if ( entries[ entry ].DIR_Name[ 0 ] == '.' ) continue; // "." and ".." entries
+
+                while ( entry >= entry_cluster_start + ( int )per_cluster ) // Cluster of the chain the entry lives in
+                {
+                    entry_cluster = next_cluster( entry_cluster );
+                    entry_cluster_start += per_cluster;
+                }
+
+                // Entries keep their relative order when others are added, deleted or compacted away,
+                // so the entry's dentry in the previous index is found by advancing through the old
+                // children alongside the walk, looking a bounded distance ahead
+                uint32_t match = INDEX_NONE;
+                uint32_t ahead;
+                for ( ahead = old_child; old && ahead < old->child_count && ahead < old_child + SCAN_BLOCK; ahead++ )
+                {
+                    struct IndexDentry *candidate = &previous->dentries[ old->first_child + ahead ];
+                    if ( memcmp( candidate->short_name, entries[ entry ].DIR_Name, 11 ) == 0 &&
+                         candidate->first_cluster == first_cluster( &entries[ entry ] ) )
+                    {
+                        match = old->first_child + ahead;
+                        old_child = ahead + 1;
+                        break;
+                    }
+                }
+
+                if ( add_dentry( &builder, i, &entries[ entry ], walk.has_long_name ? &walk.name : NULL, entry_cluster, entry, match ) == INDEX_NONE ) break;
+                builder.dentries[ i ].child_count++;
+            }
+        }
+        if ( builder.dentries[ i ].child_count == 0 ) builder.dentries[ i ].first_child = INDEX_NONE;
+        free( entries );
+    }
+    free( visited );
+
+    // Lay the sections out back to back in one allocation, the same way they are stored on disk
+    struct IndexHeader header;
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.magic, INDEX_MAGIC, 8 );
+    header.version = INDEX_VERSION;
+    header.boot_hash = boot_hash;
+    header.fsinfo_hash = hash_fsinfo_sector( f32, fp );
+    header.fingerprint = xxh3_64( fat_hashes, ( uint64_t )builder.fat_sector_count * sizeof( uint64_t ) );
+    header.cluster_count = fat_entries;
+    header.dentry_count = builder.dentry_count;
+    header.extent_count = builder.extent_count;
+    header.names_size = builder.names_size;
+    header.fat_sector_count = builder.fat_sector_count;
+    header.dir_hash_count = builder.dir_hash_count;
+    header.dentry_offset = sizeof( struct IndexHeader );
+    header.extent_offset = header.dentry_offset + ( uint64_t )builder.dentry_count * sizeof( struct IndexDentry );
+    header.fat_hash_offset = header.extent_offset + ( uint64_t )builder.extent_count * sizeof( struct IndexExtent );
+    header.dir_hash_offset = header.fat_hash_offset + ( uint64_t )builder.fat_sector_count * sizeof( uint64_t );
+    header.bitmap_offset = header.dir_hash_offset + builder.dir_hash_count * sizeof( uint64_t );
+    header.names_offset = header.bitmap_offset + ( ( uint64_t )fat_entries + 63 ) / 64 * 8;
+    header.file_size = header.names_offset + builder.names_size;
+
+    uint8_t *base = ( uint8_t * )calloc( 1, header.file_size );
+    struct VolumeIndex *index = NULL;
+    if ( base )
+    {
+        memcpy( base, &header, sizeof( header ) );
+        memcpy( base + header.dentry_offset, builder.dentries, ( uint64_t )builder.dentry_count * sizeof( struct IndexDentry ) );
+        memcpy( base + header.extent_offset, builder.extents, ( uint64_t )builder.extent_count * sizeof( struct IndexExtent ) );
+        memcpy( base + header.fat_hash_offset, fat_hashes, ( uint64_t )builder.fat_sector_count * sizeof( uint64_t ) );
+        memcpy( base + header.dir_hash_offset, builder.dir_hashes, builder.dir_hash_count * sizeof( uint64_t ) );
+        memcpy( base + header.names_offset, builder.names, builder.names_size );
+
+        uint64_t *free_map = ( uint64_t * )( base + header.bitmap_offset );
+        for ( i = 2; i < fat_entries; i++ )
+        {
+            if ( ( fat_table[ i ] & 0x0fffffff ) == 0 ) free_map[ i / 64 ] |= 1ULL << ( i % 64 );
+        }
+
+        index = attach_index( base, header.file_size, 0 );
+        if ( !index ) free( base );
+    }
+
+    if ( index && previous )
+    {
+        printf( "Index refreshed: %u of %u FAT sectors changed, parsed %llu of %llu directories, followed %llu of %llu chains.\n",
+                builder.changed_sector_count, builder.fat_sector_count,
+                ( unsigned long long )builder.directories_parsed, ( unsigned long long )builder.directory_count,
+                ( unsigned long long )builder.chains_walked, ( unsigned long long )( builder.chains_walked + builder.chains_reused ) );
+    }
+
+    free( fat_hashes );
+    free( builder.changed_sectors );
+    free( builder.origins );
+    free( builder.dir_hashes );
+    free( builder.dentries );
+    free( builder.extents );
+    free( builder.names );
+    return index;
+}
+
+/*
+ * Function    : save_index
+ * Parameters  : Volume index and the path of the sidecar file
+ * Returns     : 1 on success, 0 on failure
+ * Description : Writes the index next to the image. It is written to a temporary file first and
+ *               renamed over the old one, so a reader never maps a half written index.
+ */
+int save_index( struct VolumeIndex *index, const char *path )
+{
+    char temporary[ PATH_MAX ];
+    snprintf( temporary, sizeof( temporary ), "%s.tmp", path );
+
+    int fd = open( temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if ( fd < 0 ) return 0;
+
+    uint64_t done = 0;
+    while ( done < index->size )
+    {
+        ssize_t n = write( fd, ( uint8_t * )index->base + done, index->size - done );
+        if ( n < 0 && errno == EINTR ) continue;
+        if ( n <= 0 ) break;
+        done += n;
+    }
+
+    if ( close( fd ) != 0 || done != index->size || rename( temporary, path ) != 0 )
+    {
+        unlink( temporary );
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Function    : directories_unchanged
+ * Parameters  : Volume index, fat32 info structure, and the fat32 image
+ * Returns     : 1 if every directory cluster the index hashed still hashes the same, 0 otherwise
+ * Description : Reads the clusters of each directory through the extents the index recorded for it,
+ *               so the FAT is not needed. An entry renamed, resized or stamped by another tool
+ *               changes the hash of its cluster even when the FAT stays the same.
+ */
+int directories_unchanged( struct VolumeIndex *index, struct f32info *f32, FILE *fp )
+{
+    uint32_t bytes = cluster_size( f32 );
+    uint32_t i, j, k;
+
+    uint8_t *buffer = ( uint8_t * )malloc( bytes );
+    if ( !buffer ) return 0;
+
+    for ( i = 0; i < index->header->dentry_count; i++ )
+    {
+        struct IndexDentry *dentry = &index->dentries[ i ];
+        uint32_t hashed = 0;
+
+        for ( j = 0; j < dentry->extent_count && hashed < dentry->hash_count; j++ )
+        {
+            struct IndexExtent *extent = &index->extents[ dentry->extent_first + j ];
+            for ( k = 0; k < extent->length && hashed < dentry->hash_count; k++, hashed++ )
+            {
+                if ( read_at( fp, buffer, bytes, LBAToOffset( extent->cluster + k, f32 ) ) != bytes ||
+                     xxh3_64( buffer, bytes ) != index->dir_hashes[ dentry->hash_first + hashed ] )
+                {
+                    free( buffer );
+                    return 0;
+                }
+            }
+        }
+        if ( hashed < dentry->hash_count ) break; // Fewer clusters than hashes, a corrupted sidecar
+    }
+    free( buffer );
+    return i == index->header->dentry_count;
+}
+
+/*
+ * Function    : fat_unchanged
+ * Parameters  : Volume index, fat32 info structure, the fat32 image, and 1 to check only a sample of the FAT
+ * Returns     : 1 if the FAT hashes the same as when the index was built, 0 otherwise
+ * Description : The full check hashes every sector of the FAT, which loads all of it. The sampled
+ *               check reads FAT_SAMPLES sectors spread evenly over the FAT straight from the image,
+ *               so it costs the same on any size of volume, but it can miss a change elsewhere.
+ */
+int fat_unchanged( struct VolumeIndex *index, struct f32info *f32, FILE *fp, int sampled )
+{
+    uint32_t sector_size = ( uint16_t )f32->BPB_BytsPerSec;
+    uint32_t sectors = ( uint32_t )f32->BPB_FATSz32;
+    uint32_t i;
+
+    if ( index->header->fat_sector_count != sectors ) return 0;
+
+    if ( !sampled )
+    {
+        uint32_t count = 0;
+        uint64_t *hashes = hash_fat_sectors( f32, fp, &count );
+        int same = hashes && index->header->fingerprint == xxh3_64( hashes, ( uint64_t )count * sizeof( uint64_t ) );
+        free( hashes );
+        return same;
+    }
+
+    uint8_t *buffer = ( uint8_t * )malloc( sector_size );
+    off_t fat_offset = ( off_t )sector_size * ( uint16_t )f32->BPB_RsvdSecCnt;
+    uint32_t samples = sectors < FAT_SAMPLES ? sectors : FAT_SAMPLES;
+    int same = buffer != NULL;
+
+    for ( i = 0; same && i < samples; i++ )
+    {
+        uint32_t sector = ( uint64_t )i * sectors / samples;
+        same = read_at( fp, buffer, sector_size, fat_offset + ( off_t )sector * sector_size ) == sector_size &&
+               xxh3_64( buffer, sector_size ) == index->fat_hashes[ sector ];
+    }
+    free( buffer );
+    return same;
+}
+
+/*
+ * Function    : forget_directory_totals
+ * Parameters  : Volume index
+ * Description : Marks the totals of every directory unknown, for an index of an image that was changed
+ *               by something that did not keep them up to date
+ */
+void forget_directory_totals( struct VolumeIndex *index )
+{
+    uint32_t i;
+    for ( i = 0; i < index->header->dentry_count; i++ )
+    {
+        if ( index->dentries[ i ].attr & 0x10 ) index->dentries[ i ].total_clusters = TOTALS_UNKNOWN;
+    }
+}
+
+/*
+ * Function    : load_index
+ * Parameters  : Path of the sidecar index, fat32 info structure, and the fat32 image
+ * Returns     : The mapped index, or NULL if there is none or it does not belong to the image as it is now
+ * Description : Maps a sidecar index written by save_index(). The index is used in place, nothing is
+ *               parsed and the FAT is not loaded. It is checked against the FSInfo sector, a sample
+ *               of the FAT sectors and the hashes of the directory clusters, and if any changed,
+ *               whether by mfs or another tool, only the changed regions are rescanned and the
+ *               sidecar is written back. The index command checks the whole FAT.
+ */
+struct VolumeIndex *load_index( const char *path, struct f32info *f32, FILE *fp )
+{
+    int fd = open( path, O_RDONLY );
+    if ( fd < 0 ) return NULL;
+
+    off_t size = lseek( fd, 0, SEEK_END );
+    if ( size < ( off_t )sizeof( struct IndexHeader ) )
+    {
+        close( fd );
+        return NULL;
+    }
+
+    void *base = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if ( base == MAP_FAILED ) return NULL;
+
+    struct VolumeIndex *index = attach_index( base, size, 1 );
+    if ( !index )
+    {
+        munmap( base, size );
+        printf( "Warning: Ignoring index %s, it is not a valid index.\n", path );
+        return NULL;
+    }
+
+    if ( index->header->boot_hash != hash_boot_sector( fp ) )
+    {
+        free_index( index );
+        printf( "Warning: Ignoring index %s, it belongs to a different file system.\n", path );
+        return NULL;
+    }
+
+    if ( index->header->fsinfo_hash != hash_fsinfo_sector( f32, fp ) || !fat_unchanged( index, f32, fp, 1 ) ||
+         !directories_unchanged( index, f32, fp ) )
+    {
+        // Rescan only the regions that changed since the index was written, and keep the result.
+        // The directory totals may not have been kept up to date by whatever changed the image.
+        forget_directory_totals( index );
+        struct VolumeIndex *refreshed = build_index( f32, fp, index );
+        free_index( index );
+        if ( refreshed && !save_index( refreshed, path ) )
+        {
+            printf( "Warning: Could not update index %s: %s\n", path, strerror( errno ) );
+        }
+        return refreshed;
+    }
+    return index;
+}
+
+/*
+ * Function    : get_index
+ * Parameters  : Fat32 info structure and the fat32 image
+ * Returns     : The index of the open image, building it in memory if no sidecar was loaded
+ * Description : An index rebuilt after a modification replaces the sidecar, if the image has one.
+ */
+struct VolumeIndex *get_index( struct f32info *f32, FILE *fp )
+{
+    if ( !volume_index )
+    {
+        int refresh = stale_index && index_path && access( index_path, F_OK ) == 0;
+        volume_index = build_index( f32, fp, stale_index );
+        free_index( stale_index );
+        stale_index = NULL;
+        if ( volume_index && refresh && !save_index( volume_index, index_path ) )
+        {
+            printf( "Warning: Could not update index %s: %s\n", index_path, strerror( errno ) );
+        }
+    }
+    return volume_index;
+}
+
+/*
+ * Function    : invalidate_index
+ * Parameters  : None
+ * Description : Retires the index after the image was modified. The index is rebuilt from the retired
+ *               one the next time it is needed, which only rescans what the modification touched. The
+ *               sidecar is left in place: if the session ends first, the next open finds the changed
+ *               regions from its hashes and refreshes it the same way.
+ */
+void invalidate_index()
+{
+    if ( volume_index )
+    {
+        free_index( stale_index );
+        stale_index = volume_index;
+        volume_index = NULL;
+    }
+}
+
+/*
+ * Function    : index_command
+ * Parameters  : Fat32 info structure and the fat32 image
+ * Description : Builds the index of the open image if needed and writes it to the sidecar file. A loaded
+ *               index is first checked against the whole FAT and every directory, and refreshed if
+ *               anything changed that the sampled check on open did not catch.
+ */
+void index_command( struct f32info *f32, FILE *fp )
+{
+    if ( volume_index && ( !fat_unchanged( volume_index, f32, fp, 0 ) || !directories_unchanged( volume_index, f32, fp ) ) )
+    {
+        forget_directory_totals( volume_index );
+        invalidate_index();
+    }
+
+    struct VolumeIndex *index = get_index( f32, fp );
+    if ( !index )
+    {
+        printf( "Error: Could not index the file system image.\n" );
+        return;
+    }
+
+    uint64_t free_clusters = 0, i;
+    for ( i = 0; i < ( index->header->cluster_count + 63 ) / 64; i++ )
+    {
+        free_clusters += __builtin_popcountll( index->free_map[ i ] );
+    }
+
+    if ( !save_index( index, index_path ) )
+    {
+        printf( "Error: Could not write index %s: %s\n", index_path, strerror( errno ) );
+        return;
+    }
+
+    printf( "Indexed %u entries in %u extents, %llu free clusters. Wrote %s\n", index->header->dentry_count - 1,
+            index->header->extent_count, ( unsigned long long )free_clusters, index_path );
+}
+
+/*
+ * Function    : extent_less
+ * Parameters  : Two free extents and the tree to order them for
+ * Returns     : 1 if the first comes before the second, by first cluster in the address tree and by
+ *               length, then first cluster, in the size tree
+ */
+static inline int extent_less( const struct FreeExtent *a, const struct FreeExtent *b, int order )
+{
+    if ( order == EXTENT_BY_SIZE && a->count != b->count ) return a->count < b->count;
+    return a->first < b->first;
+}
+
+/*
+ * Function    : extent_merge
+ * Parameters  : Two trees, every extent of the first ordered before every extent of the second, and the tree
+ * Returns     : Root of the joined tree
+ */
+struct FreeExtent *extent_merge( struct FreeExtent *low, struct FreeExtent *high, int order )
+{
+    if ( !low ) return high;
+    if ( !high ) return low;
+    if ( low->priority > high->priority )
+    {
+        low->right[ order ] = extent_merge( low->right[ order ], high, order );
+        return low;
+    }
+    high->left[ order ] = extent_merge( low, high->left[ order ], order );
+    return high;
+}
+
+/*
+ * Function    : extent_insert
+ * Parameters  : Root of a tree, the extent to add, and the tree
+ * Returns     : New root of the tree
+ * Description : Treap insert. The extent goes down by its key and is rotated up above every node
+ *               of lower priority, which keeps the tree O(log n) deep in expectation.
+ */
+struct FreeExtent *extent_insert( struct FreeExtent *root, struct FreeExtent *extent, int order )
+{
+    if ( !root )
+    {
+        extent->left[ order ] = extent->right[ order ] = NULL;
+        return extent;
+    }
+    if ( extent_less( extent, root, order ) )
+    {
+        root->left[ order ] = extent_insert( root->left[ order ], extent, order );
+        if ( root->left[ order ]->priority > root->priority )
+        {
+            struct FreeExtent *child = root->left[ order ];
+            root->left[ order ] = child->right[ order ];
+            child->right[ order ] = root;
+            return child;
+        }
+    }
+    else
+    {
+        root->right[ order ] = extent_insert( root->right[ order ], extent, order );
+        if ( root->right[ order ]->priority > root->priority )
+        {
+            struct FreeExtent *child = root->right[ order ];
+            root->right[ order ] = child->left[ order ];
+            child->left[ order ] = root;
+            return child;
+        }
+    }
+    return root;
+}
+
+/*
+ * Function    : extent_remove
+ * Parameters  : Root of a tree, an extent in it, and the tree
+ * Returns     : New root of the tree
+ */
+struct FreeExtent *extent_remove( struct FreeExtent *root, struct FreeExtent *extent, int order )
+{
+    if ( root == extent ) return extent_merge( root->left[ order ], root->right[ order ], order );
+    if ( extent_less( extent, root, order ) ) root->left[ order ] = extent_remove( root->left[ order ], extent, order );
+    else root->right[ order ] = extent_remove( root->right[ order ], extent, order );
+    return root;
+}
+
+/*
+ * Function    : extent_floor
+ * Parameters  : Free extents and a cluster number
+ * Returns     : The free extent with the highest first cluster at or below it, or NULL
+ */
+struct FreeExtent *extent_floor( struct FreeExtents *tree, uint32_t cluster )
+{
+    struct FreeExtent *node = tree->root[ EXTENT_BY_ADDRESS ], *found = NULL;
+
+    while ( node )
+    {
+        if ( node->first <= cluster )
+        {
+            found = node;
+            node = node->right[ EXTENT_BY_ADDRESS ];
+        }
+        else node = node->left[ EXTENT_BY_ADDRESS ];
+    }
+    return found;
+}
+
+/*
+ * Function    : extent_best_fit
+ * Parameters  : Free extents and the number of clusters wanted
+ * Returns     : The shortest free extent with at least that many clusters, the lowest one of equal
+ *               length, or NULL if no extent is that long
+ */
+struct FreeExtent *extent_best_fit( struct FreeExtents *tree, uint32_t needed )
+{
+    struct FreeExtent *node = tree->root[ EXTENT_BY_SIZE ], *found = NULL;
+
+    while ( node )
+    {
+        if ( node->count >= needed )
+        {
+            found = node;
+            node = node->left[ EXTENT_BY_SIZE ];
+        }
+        else node = node->right[ EXTENT_BY_SIZE ];
+    }
+    return found;
+}
+
+/*
+ * Function    : extent_longest
+ * Parameters  : Free extents
+ * Returns     : The longest free extent, the rightmost one of the size tree, or NULL if there is none
+ */
+struct FreeExtent *extent_longest( struct FreeExtents *tree )
+{
+    struct FreeExtent *node = tree->root[ EXTENT_BY_SIZE ];
+    while ( node && node->right[ EXTENT_BY_SIZE ] ) node = node->right[ EXTENT_BY_SIZE ];
+    return node;
+}
+
+/*
+ * Function    : extent_add
+ * Parameters  : Free extents, and the first cluster and length of a run of clusters that just became free
+ * Description : Adds the run to the free extents, merged with the extents right before and after it
+ */
+void extent_add( struct FreeExtents *tree, uint32_t first, uint32_t count )
+{
+    struct FreeExtent *before = first > 2 ? extent_floor( tree, first - 1 ) : NULL;
+    struct FreeExtent *after = extent_floor( tree, first + count );
+
+    if ( before && before->first + before->count != first ) before = NULL;
+    if ( after && after->first != first + count ) after = NULL;
+
+    tree->clusters += count;
+    if ( before )
+    {
+        tree->root[ EXTENT_BY_SIZE ] = extent_remove( tree->root[ EXTENT_BY_SIZE ], before, EXTENT_BY_SIZE );
+        before->count += count;
+        if ( after )
+        {
+            tree->root[ EXTENT_BY_SIZE ] = extent_remove( tree->root[ EXTENT_BY_SIZE ], after, EXTENT_BY_SIZE );
+            tree->root[ EXTENT_BY_ADDRESS ] = extent_remove( tree->root[ EXTENT_BY_ADDRESS ], after, EXTENT_BY_ADDRESS );
+            before->count += after->count;
+            free( after );
+            tree->count--;
+        }
+        tree->root[ EXTENT_BY_SIZE ] = extent_insert( tree->root[ EXTENT_BY_SIZE ], before, EXTENT_BY_SIZE );
+    }
+    else if ( after )
+    {
+        // Moving the start down to the new run keeps its place in the address tree
+        tree->root[ EXTENT_BY_SIZE ] = extent_remove( tree->root[ EXTENT_BY_SIZE ], after, EXTENT_BY_SIZE );
+        after->first = first;
+        after->count += count;
+        tree->root[ EXTENT_BY_SIZE ] = extent_insert( tree->root[ EXTENT_BY_SIZE ], after, EXTENT_BY_SIZE );
+    }
+    else
+    {
+        struct FreeExtent *extent = ( struct FreeExtent * )malloc( sizeof( struct FreeExtent ) );
+        if ( !extent )
+        {
+            tree->clusters -= count; // Lost to allocation until the image is opened again
+            return;
+        }
+        tree->seed ^= tree->seed << 13; // xorshift32
+        tree->seed ^= tree->seed >> 17;
+        tree->seed ^= tree->seed << 5;
+        extent->first = first;
+        extent->count = count;
+        extent->priority = tree->seed;
+        tree->root[ EXTENT_BY_ADDRESS ] = extent_insert( tree->root[ EXTENT_BY_ADDRESS ], extent, EXTENT_BY_ADDRESS );
+        tree->root[ EXTENT_BY_SIZE ] = extent_insert( tree->root[ EXTENT_BY_SIZE ], extent, EXTENT_BY_SIZE );
+        tree->count++;
+    }
+}
+
+/*
+ * Function    : extent_take
+ * Parameters  : Free extents, one of them, and the first cluster and length of a run inside it
+ * Description : Removes the run from the free extents. A run from the middle of the extent
+ *               splits it in two.
+ */
+void extent_take( struct FreeExtents *tree, struct FreeExtent *extent, uint32_t first, uint32_t count )
+{
+    uint32_t start = extent->first, end = extent->first + extent->count;
+
+    tree->clusters -= count;
+    tree->root[ EXTENT_BY_SIZE ] = extent_remove( tree->root[ EXTENT_BY_SIZE ], extent, EXTENT_BY_SIZE );
+
+    if ( first == start && count == extent->count )
+    {
+        tree->root[ EXTENT_BY_ADDRESS ] = extent_remove( tree->root[ EXTENT_BY_ADDRESS ], extent, EXTENT_BY_ADDRESS );
+        free( extent );
+        tree->count--;
+        return;
+    }
+
+    // Moving the start up past the run keeps its place in the address tree
+    if ( first == start ) extent->first += count;
+    extent->count = first == start ? extent->count - count : first - start;
+    tree->root[ EXTENT_BY_SIZE ] = extent_insert( tree->root[ EXTENT_BY_SIZE ], extent, EXTENT_BY_SIZE );
+
+    // The part after a run taken from the middle becomes an extent of its own
+    if ( first > start && first + count < end )
+    {
+        tree->clusters -= end - first - count; // extent_add() counts it again
+        extent_add( tree, first + count, end - first - count );
+    }
+}
+
+/*
+ * Function    : group_of
+ * Parameters  : Cluster number
+ * Returns     : The allocation group the cluster belongs to
+ */
+struct AllocationGroup *group_of( uint32_t cluster )
+{
+    return &allocator.groups[ ( cluster - 2 ) / allocator.group_size ];
+}
+
+/*
+ * Function    : add_free_clusters
+ * Parameters  : First cluster and length of a run of clusters that became free, or that were
+ *               reserved and are not needed after all
+ * Description : Adds the run to the free extents of the groups it falls in. An extent never
+ *               crosses the end of a group, so each group can be handed to a worker on its own.
+ */
+void add_free_clusters( uint32_t first, uint32_t count )
+{
+    while ( count > 0 )
+    {
+        struct AllocationGroup *group = group_of( first );
+        uint32_t part = group->end - first < count ? group->end - first : count;
+        extent_add( &group->extents, first, part );
+        first += part;
+        count -= part;
+    }
+}
+
+/*
+ * Function    : build_free_extents
+ * Parameters  : Fat32 info structure and the fat32 image
+ * Returns     : 1 if the free extent index is ready, 0 if the FAT could not be read
+ * Description : Splits the clusters into allocation groups of at least ALLOC_GROUP_MIN clusters and
+ *               collects the runs of free clusters of the FAT into the groups the first time an
+ *               allocation needs them. From then on fat_set() keeps them up to date.
+ */
+int build_free_extents( struct f32info *f32, FILE *fp )
+{
+    uint32_t cluster, start = 0, i;
+
+    if ( allocator.groups ) return 1;
+    if ( !load_fat( f32, fp ) || fat_entries <= 2 ) return 0;
+
+    uint32_t clusters = fat_entries - 2;
+    uint32_t count = clusters / ALLOC_GROUP_MIN;
+    if ( count < 1 ) count = 1;
+    if ( count > ALLOC_GROUPS_MAX ) count = ALLOC_GROUPS_MAX;
+
+    allocator.groups = ( struct AllocationGroup * )calloc( count, sizeof( struct AllocationGroup ) );
+    if ( !allocator.groups ) return 0;
+    allocator.group_count = count;
+    allocator.group_size = ( clusters + count - 1 ) / count;
+    for ( i = 0; i < count; i++ )
+    {
+        allocator.groups[ i ].start = 2 + i * allocator.group_size;
+        allocator.groups[ i ].end = i + 1 < count ? 2 + ( i + 1 ) * allocator.group_size : fat_entries;
+        allocator.groups[ i ].extents.seed = 2463534242u + i * XXH_PRIME32_1; // Any value but 0
+        if ( !allocator.groups[ i ].extents.seed ) allocator.groups[ i ].extents.seed = 1;
+    }
+
+    for ( cluster = 2; cluster <= fat_entries; cluster++ )
+    {
+        int is_free = cluster < fat_entries && !( fat_table[ cluster ] & 0x0fffffff );
+        if ( is_free && !start ) start = cluster;
+        else if ( !is_free && start )
+        {
+            add_free_clusters( start, cluster - start );
+            start = 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Function    : free_extent_tree
+ * Parameters  : Root of a tree by address
+ * Description : Releases every extent of the tree
+ */
+void free_extent_tree( struct FreeExtent *node )
+{
+    while ( node )
+    {
+        struct FreeExtent *right = node->right[ EXTENT_BY_ADDRESS ];
+        free_extent_tree( node->left[ EXTENT_BY_ADDRESS ] );
+        free( node );
+        node = right;
+    }
+}
+
+/*
+ * Function    : drop_free_extents
+ * Parameters  : None
+ * Description : Forgets the allocation groups of the image that is being closed
+ */
+void drop_free_extents()
+{
+    uint32_t i;
+    for ( i = 0; i < allocator.group_count; i++ ) free_extent_tree( allocator.groups[ i ].extents.root[ EXTENT_BY_ADDRESS ] );
+    free( allocator.groups );
+    memset( &allocator, 0, sizeof( allocator ) );
+}
+
+/*
+ * Function    : close_volume
+ * Parameters  : None
+ * Description : Releases the FAT and index kept for the image that is being closed
+ */
+void close_volume()
+{
+    free( fat_table );
+    fat_table = NULL;
+    fat_entries = 0;
+    free( fat_dirty );
+    fat_dirty = NULL;
+    drop_free_extents();
+    free_index( volume_index );
+    volume_index = NULL;
+    free_index( stale_index );
+    stale_index = NULL;
+    free( index_path );
+    index_path = NULL;
+}
+
+/*
+ * Function    : write_at
+ * Parameters  : Fat32 image file, buffer, number of bytes, and the image offset to write to
+ * Returns     : Number of bytes written
+ * Description : Positional write. The stdio buffers of the image are flushed around it, so the
+ *               fseek/fread based commands never see data from before the write.
+ */
+ssize_t write_at( FILE *fp, const void *buffer, size_t size, off_t offset )
+{
+    int fd = fileno( fp );
+    size_t done = 0;
+
+    fflush( fp );
+    while ( done < size )
+    {
+        ssize_t n = pwrite( fd, ( const uint8_t * )buffer + done, size - done, offset + done );
+        if ( n < 0 && errno == EINTR ) continue;
+        if ( n <= 0 ) break;
+        done += n;
+    }
+    fflush( fp );
+    return done;
+}
+
+/*
+ * Function    : fat_store
+ * Parameters  : Fat32 info structure, cluster number, and the value of its FAT entry
+ * Description : Changes a FAT entry in memory, keeping its 4 reserved high bits, and marks its sector
+ *               for the next flush_fat(). Unlike fat_set() it leaves the free extent index alone, which
+ *               suits clusters reserved by an allocation, as they have left the index already. Workers
+ *               may store entries of different clusters at the same time.
+ */
+void fat_store( struct f32info *f32, uint32_t cluster, uint32_t value )
+{
+    uint32_t sector_entries = ( uint16_t )f32->BPB_BytsPerSec / 4;
+
+    if ( !fat_dirty || cluster >= fat_entries ) return;
+    fat_table[ cluster ] = ( fat_table[ cluster ] & 0xf0000000 ) | ( value & 0x0fffffff );
+    __atomic_store_n( &fat_dirty[ cluster / sector_entries ], 1, __ATOMIC_RELAXED );
+}
+
+/*
+ * Function    : fat_set
+ * Parameters  : Fat32 info structure, cluster number, and the value of its FAT entry
+ * Description : Changes a FAT entry in memory, keeping its 4 reserved high bits. The sector it lives
+ *               in is written to every FAT by the next flush_fat(). A cluster that becomes free, or
+ *               stops being free, is added to or taken from the free extent index once it is built.
+ */
+void fat_set( struct f32info *f32, uint32_t cluster, uint32_t value )
+{
+    if ( !fat_dirty || cluster >= fat_entries ) return;
+
+    int was_free = !( fat_table[ cluster ] & 0x0fffffff );
+    fat_store( f32, cluster, value );
+
+    if ( !allocator.groups || was_free == !( value & 0x0fffffff ) )
+        ;
+    else if ( was_free )
+    {
+        // Clusters handed out by allocate_clusters() have left the index already
+        struct FreeExtents *tree = &group_of( cluster )->extents;
+        struct FreeExtent *extent = extent_floor( tree, cluster );
+        if ( extent && cluster < extent->first + extent->count ) extent_take( tree, extent, cluster, 1 );
+    }
+    else add_free_clusters( cluster, 1 );
+}
+
+/*
+ * Function    : flush_fat
+ * Parameters  : Fat32 info structure and the fat32 image
+ * Returns     : 1 on success, 0 if a write failed
+ * Description : Writes every FAT sector changed since the last flush to each copy of the FAT,
+ *               one write per sector and copy no matter how many entries of it changed. Workers
+ *               filling in chains from different allocation groups only mark sectors dirty, so
+ *               their changes merge here into the same writes.
+ */
+int flush_fat( struct f32info *f32, FILE *fp )
+{
+    uint32_t sector_size = ( uint16_t )f32->BPB_BytsPerSec;
+    uint32_t sectors = ( uint32_t )f32->BPB_FATSz32;
+    off_t fat_offset = ( off_t )sector_size * ( uint16_t )f32->BPB_RsvdSecCnt;
+    uint32_t sector;
+    int copy, ok = 1;
+
+    if ( !fat_dirty ) return 1;
+
+    for ( sector = 0; sector < sectors; sector++ )
+    {
+        if ( !fat_dirty[ sector ] ) continue;
+
+        for ( copy = 0; copy < f32->BPB_NumFATS; copy++ )
+        {
+            off_t offset = fat_offset + ( ( off_t )copy * sectors + sector ) * sector_size;
+            if ( write_at( fp, ( uint8_t * )fat_table + ( uint64_t )sector * sector_size, sector_size, offset ) != sector_size ) ok = 0;
+        }
+        fat_dirty[ sector ] = 0;
+    }
+    return ok;
+}
+
+/*
+ * Function    : update_fsinfo
+ * Parameters  : Fat32 info structure, the fat32 image, change in the number of free clusters, and the
+ *               cluster to suggest for the next allocation
+ * Description : Keeps the free cluster count and next free hint of the FSInfo sector in step with an
+ *               allocation. A count marked unknown (0xffffffff) is left for the next fsck to compute.
+ */
+void update_fsinfo( struct f32info *f32, FILE *fp, int64_t change, uint32_t next )
+{
+    uint16_t sector = 0;
+    uint32_t fields[ 2 ], signature = 0;
+
+    if ( read_at( fp, &sector, 2, 48 ) != 2 || sector == 0 || sector == 0xffff ) return;
+    off_t offset = ( off_t )sector * ( uint16_t )f32->BPB_BytsPerSec;
+    if ( read_at( fp, &signature, 4, offset ) != 4 || signature != 0x41615252 ) return;
+    if ( read_at( fp, fields, 8, offset + 488 ) != 8 ) return;
+
+    if ( fields[ 0 ] != 0xffffffff ) fields[ 0 ] += change;
+    fields[ 1 ] = next;
+    write_at( fp, fields, 8, offset + 488 );
+}
+
+/*
+ * Function    : resolve_path
+ * Parameters  : Relative or absolute path, fat32 info structure, fat32 image, and the entry and long name to fill in
+ * Returns     : 1 if the path exists, 0 otherwise
+ * Description : Looks a path up one component at a time through whole directory chains, starting
+ *               from the root or the working directory. Components may be long or 8.3 names.
+ *               Directories are listed with list_directory(), from the index when one is loaded.
+ *               The root directory resolves to an entry with attribute 0x10 and the root cluster.
+ */
+int resolve_path( const char *path, struct f32info *f32, FILE *fp, struct DirectoryEntry *found, struct LongName *long_name )
+{
+    char buffer[ MAX_COMMAND_SIZE + 1 ];
+    char *save = NULL;
+    uint32_t cluster = ( path && path[ 0 ] == '/' ) ? ( uint32_t )f32->BPB_RootClus : cwd_cluster;
+
+    memset( found, 0, sizeof( struct DirectoryEntry ) );
+    memset( found->DIR_Name, ' ', 11 );
+    found->DIR_Attr = 0x10;
+    if ( long_name ) long_name->valid = 0;
+
+    snprintf( buffer, sizeof( buffer ), "%s", path ? path : "" );
+    char *token = strtok_r( buffer, "/", &save );
+
+    while ( token != NULL )
+    {
+        if ( !( found->DIR_Attr & 0x10 ) ) return 0; // A file in the middle of the path
+
+        if ( strcmp( token, "." ) != 0 )
+        {
+            int count;
+            struct DirectoryEntry *entries = list_directory( cluster, f32, fp, &count );
+            if ( !entries ) return 0;
+
+            int entry = find_entry( token, entries, count, long_name );
+            if ( entry == -1 )
+            {
+                free( entries );
+                return 0;
+            }
+            *found = entries[ entry ];
+            free( entries );
+
+            cluster = first_cluster( found );
+            if ( cluster == 0 && ( found->DIR_Attr & 0x10 ) ) cluster = f32->BPB_RootClus; // ".." of a top level directory
+        }
+        token = strtok_r( NULL, "/", &save );
+    }
+
+    if ( found->DIR_Attr & 0x10 )
+    {
+        found->DIR_FirstClusterHigh = cluster >> 16;
+        found->DIR_FirstClusterLow = cluster & 0xffff;
+    }
+    return 1;
+}
+
+/*
+ * Function    : stat_entry
+ * Parameters  : User filename input and directory entry array
+ * Description : Prints attributes of selected file / directory
+ */
+void stat_entry( char *filename, struct DirectoryEntry *dir )
+{
+    int entry;
+    char name_buffer[ 12 ];
+    struct LongName long_name;
+
+    entry = find_entry( filename, dir, 16, &long_name );
+
+    // File not found
+    if ( entry == -1 )
+    {
+        printf( "Error: File not found. \n" );
+    }
+    // File found
+    else
+    {
+        strncpy( name_buffer, dir[ entry ].DIR_Name, 11 ); // Copy 11 characters from DIR_Name (total size is 11 bytes) to name buffer
+        name_buffer[ 11 ] = '\0';                          // Manually add null character in index 12
+
+        printf( "Name:               %s \n", name_buffer );
+        if ( long_name.valid )
+        {
+            char long_buffer[ LFN_MAX_UNITS * 3 + 1 ];
+            utf16_to_utf8( long_name.chars, long_name.length, long_buffer, sizeof( long_buffer ) );
+            printf( "LongName:           %s \n", long_buffer );
+        }
+        printf( "Attribute:          %#x\n", dir[ entry ].DIR_Attr );
+        printf( "FirstClusterHigh:   %u \n", dir[ entry ].DIR_FirstClusterHigh );
+        printf( "FirstClusterLow:    %u \n", dir[ entry ].DIR_FirstClusterLow );
+        printf( "FileSize:           %u \n", dir[ entry ].DIR_FileSize );
+    }
+}
+
+/*
+ * Function    : cd
+ * Parameters  : Relative or absolute path, directory, fat32info, and the current file pointer
+ * Description : Changes the currect working directory to the given directory. The whole path is
+ *               resolved first, so a path that fails part way leaves the working directory as it was.
+ */
+void cd( char *filepath, struct DirectoryEntry *dir, struct f32info *f32, FILE *fp )
+{
+    struct DirectoryEntry target;
+
+    if ( filepath == NULL ) return;
+
+    // File not found
+    if ( !resolve_path( filepath, f32, fp, &target, NULL ) )
+    {
+        printf( "Error: File not found. \n" );
+        return;
+    }
+
+    // Fails if selected entry is not a directory
+    if ( !( target.DIR_Attr & 0x10 ) )
+    {
+        printf( "Error: Entry is not a directory. \n" );
+        return;
+    }
+
+    uint32_t cluster = first_cluster( &target ); // ".." of a top level directory resolves to the root
+    off_t offset = LBAToOffset( cluster, f32 );
+
+    fseeko( fp, offset, SEEK_SET );
+    fread( &dir[ 0 ], 32, 16, fp );
+    cwd_cluster = cluster;
+}
+
+/*
+ * Function    : ls
+ * Parameters  : Directory path (NULL for the working directory), fat32info, and the current file pointer
+ * Description : Lists all files and sub-directories contained in specified directory, through its
+ *               whole cluster chain. With an index loaded the directory is listed from the index.
+ */
+void ls( char *filename, struct f32info *f32, FILE *fp )
+{
+    struct DirectoryEntry target;
+    int count, i;
+
+    if ( !resolve_path( filename, f32, fp, &target, NULL ) )
+    {
+        printf( "Error: File not found. \n" );
+        return;
+    }
+    if ( !( target.DIR_Attr & 0x10 ) )
+    {
+        printf( "Error: Entry is not a directory. \n" );
+        return;
+    }
+
+    struct DirectoryEntry *entries = list_directory( first_cluster( &target ), f32, fp, &count );
+    if ( !entries )
+    {
+        printf( "Error: Could not read directory. \n" );
+        return;
+    }
+
+    // As DIR_Name does not terminate with a '\0' null character,
+    // it needs to be added manually
+    char name_buffer[ 12 ];
+    char long_buffer[ LFN_MAX_UNITS * 3 + 1 ];
+    struct DirectoryWalk walk;
+
+    // Visit only read-only files, sub-directories, or archives that are not deleted
+    walk_begin( &walk, entries, count, 1 );
+    while ( ( i = walk_next( &walk ) ) != -1 )
+    {
+        strncpy( name_buffer, entries[ i ].DIR_Name, 11 ); // Copy 11 characters from DIR_Name (total size is 11 bytes) to name buffer
+        name_buffer[ 11 ] = '\0';                          // Manually add null character in index 12
+
+        if ( walk.has_long_name )
+        {
+            utf16_to_utf8( walk.name.chars, walk.name.length, long_buffer, sizeof( long_buffer ) );
+            printf( "%s %s\n", name_buffer, long_buffer ); // Print name buffer followed by the long name
+        }
+        else
+        {
+            printf( "%s \n", name_buffer ); // Print name buffer
+        }
+    }
+    free( entries );
+}
+
+/*
+ * Function    : out_open
+ * Parameters  : Output buffer and the file descriptor it writes to
+ * Description : Prepares a large output buffer, so listings are written a megabyte at a time
+ *               instead of one printf per entry. Pending stdout output is flushed first to keep
+ *               the order of everything printed.
+ */
+void out_open( struct OutputBuffer *out, int fd )
+{
+    fflush( stdout );
+    out->fd = fd;
+    out->used = 0;
+    out->capacity = OUTPUT_BUFFER_SIZE;
+    out->data = ( char * )malloc( out->capacity );
+    out->failed = out->data == NULL;
+}
+
+/*
+ * Function    : out_flush
+ * Parameters  : Output buffer
+ * Description : Writes everything buffered so far
+ */
+void out_flush( struct OutputBuffer *out )
+{
+    size_t done = 0;
+    while ( done < out->used && !out->failed )
+    {
+        ssize_t n = write( out->fd, out->data + done, out->used - done );
+        if ( n < 0 && errno == EINTR ) continue;
+        if ( n <= 0 ) out->failed = 1;
+        else done += n;
+    }
+    out->used = 0;
+}
+
+/*
+ * Function    : out_write
+ * Parameters  : Output buffer, data, and number of bytes
+ */
+void out_write( struct OutputBuffer *out, const void *data, size_t size )
+{
+    if ( out->failed || size == 0 ) return;
+    if ( out->used + size > out->capacity ) out_flush( out );
+
+    if ( size > out->capacity ) // Larger than the whole buffer, write it through
+    {
+        out->used = 0;
+        size_t done = 0;
+        while ( done < size && !out->failed )
+        {
+            ssize_t n = write( out->fd, ( const char * )data + done, size - done );
+            if ( n < 0 && errno == EINTR ) continue;
+            if ( n <= 0 ) out->failed = 1;
+            else done += n;
+        }
+        return;
+    }
+
+    memcpy( out->data + out->used, data, size );
+    out->used += size;
+}
+
+/*
+ * Function    : out_close
+ * Parameters  : Output buffer
+ * Returns     : 1 if everything was written, 0 otherwise
+ */
+int out_close( struct OutputBuffer *out )
+{
+    out_flush( out );
+    free( out->data );
+    out->data = NULL;
+    return !out->failed;
+}
+
+/*
+ * Function    : text_append
+ * Parameters  : Growable text, data, and number of bytes
+ * Description : Appends to a piece of text that is assembled by a worker and written out later
+ */
+void text_append( struct Text *text, const char *data, size_t size )
+{
+    if ( size == 0 ) return; // data may be NULL then
+    if ( !grow_array( ( void ** )&text->data, &text->capacity, text->length + size, 1 ) ) return;
+    memcpy( text->data + text->length, data, size );
+    text->length += size;
+}
+
+/*
+ * Function    : worker_count
+ * Parameters  : None
+ * Returns     : Number of worker threads to use, one per online processor up to MAX_WORKERS
+ */
+int worker_count()
+{
+    long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+    if ( cpus < 1 ) cpus = 1;
+    if ( cpus > MAX_WORKERS ) cpus = MAX_WORKERS;
+    return ( int )cpus;
+}
+
+/*
+ * Function    : pool_wake
+ * Parameters  : Work pool
+ * Description : Wakes the idle workers to look for work again, or to notice there is none left
+ */
+void pool_wake( struct WorkPool *pool )
+{
+    pthread_mutex_lock( &pool->idle_lock );
+    pthread_cond_broadcast( &pool->more_work );
+    pthread_mutex_unlock( &pool->idle_lock );
+}
+
+/*
+ * Function    : pool_push
+ * Parameters  : Work pool, worker pushing the item, and the item
+ * Description : Adds an item to the bottom of the worker's own deque
+ */
+void pool_push( struct WorkPool *pool, int worker, uint32_t item )
+{
+    struct WorkDeque *deque = &pool->deques[ worker ];
+
+    __atomic_add_fetch( &pool->outstanding, 1, __ATOMIC_SEQ_CST );
+    pthread_mutex_lock( &deque->lock );
+    if ( deque->tail == deque->capacity && deque->head > 0 ) // Reuse the space stolen from the top
+    {
+        memmove( deque->items, deque->items + deque->head, ( deque->tail - deque->head ) * sizeof( uint32_t ) );
+        deque->tail -= deque->head;
+        deque->head = 0;
+    }
+    if ( grow_array( ( void ** )&deque->items, &deque->capacity, deque->tail + 1, sizeof( uint32_t ) ) )
+    {
+        deque->items[ deque->tail++ ] = item;
+    }
+    pthread_mutex_unlock( &deque->lock );
+
+    __atomic_add_fetch( &pool->pushes, 1, __ATOMIC_SEQ_CST );
+    if ( __atomic_load_n( &pool->waiting, __ATOMIC_SEQ_CST ) > 0 ) pool_wake( pool );
+}
+
+/*
+ * Function    : pool_take
+ * Parameters  : Work pool, worker looking for work, and the item to fill in
+ * Returns     : 1 if an item was taken, 0 if every deque was empty
+ * Description : Pops the newest item of the worker's own deque, which keeps a worker deep in the
+ *               subtree it is in. When that is empty, steals the oldest item of another worker,
+ *               which tends to be the root of a large unexplored subtree.
+ */
+int pool_take( struct WorkPool *pool, int worker, uint32_t *item )
+{
+    int i;
+
+    // Every deque, as pool->workers still grows while the first workers run. The deque of a worker
+    // that did not start stays empty.
+    for ( i = 0; i < pool->deque_count; i++ )
+    {
+        int victim = ( worker + i ) % pool->deque_count;
+        struct WorkDeque *deque = &pool->deques[ victim ];
+        int taken = 0;
+
+        pthread_mutex_lock( &deque->lock );
+        if ( deque->head < deque->tail )
+        {
+            *item = victim == worker ? deque->items[ --deque->tail ] : deque->items[ deque->head++ ];
+            taken = 1;
+        }
+        if ( deque->head == deque->tail ) deque->head = deque->tail = 0;
+        pthread_mutex_unlock( &deque->lock );
+
+        if ( taken ) return 1;
+    }
+    return 0;
+}
+
+/*
+ * Function    : pool_worker
+ * Parameters  : Worker state
+ * Description : Runs items until no worker has any left and none is running, since a running
+ *               item may still push more. A worker that finds nothing to take sleeps until an
+ *               item is pushed or the last one finishes, rather than polling the deques.
+ */
+void *pool_worker( void *argument )
+{
+    struct WorkerArgument *self = ( struct WorkerArgument * )argument;
+    struct WorkPool *pool = self->pool;
+    uint32_t item;
+
+    while ( __atomic_load_n( &pool->outstanding, __ATOMIC_SEQ_CST ) > 0 )
+    {
+        uint64_t pushes = __atomic_load_n( &pool->pushes, __ATOMIC_SEQ_CST );
+        if ( !pool_take( pool, self->worker, &item ) )
+        {
+            // Others are busy on items that may push more work. Counting ourselves as waiting
+            // before checking again means a push or the last item finishing cannot be missed.
+            pthread_mutex_lock( &pool->idle_lock );
+            __atomic_add_fetch( &pool->waiting, 1, __ATOMIC_SEQ_CST );
+            while ( __atomic_load_n( &pool->pushes, __ATOMIC_SEQ_CST ) == pushes && __atomic_load_n( &pool->outstanding, __ATOMIC_SEQ_CST ) > 0 )
+            {
+                pthread_cond_wait( &pool->more_work, &pool->idle_lock );
+            }
+            __atomic_sub_fetch( &pool->waiting, 1, __ATOMIC_SEQ_CST );
+            pthread_mutex_unlock( &pool->idle_lock );
+            continue;
+        }
+        pool->run( pool, self->worker, item );
+        if ( __atomic_sub_fetch( &pool->outstanding, 1, __ATOMIC_SEQ_CST ) == 0 ) pool_wake( pool );
+    }
+    return NULL;
+}
+
+/*
+ * Function    : pool_start
+ * Parameters  : Work pool with run and context set, number of workers, and the first items
+ * Returns     : 1 if at least one worker was started, 0 otherwise. pool_finish() is needed either way.
+ */
+int pool_start( struct WorkPool *pool, int workers, const uint32_t *first, uint32_t count )
+{
+    int i;
+
+    pool->workers = 0;
+    pool->deque_count = workers;
+    pool->outstanding = 0;
+    pool->pushes = 0;
+    pool->waiting = 0;
+    pthread_mutex_init( &pool->idle_lock, NULL );
+    pthread_cond_init( &pool->more_work, NULL );
+    pool->deques = ( struct WorkDeque * )calloc( workers, sizeof( struct WorkDeque ) );
+    pool->threads = ( pthread_t * )calloc( workers, sizeof( pthread_t ) );
+    pool->arguments = ( struct WorkerArgument * )calloc( workers, sizeof( struct WorkerArgument ) );
+    if ( !pool->deques || !pool->threads || !pool->arguments )
+    {
+        pool->deque_count = 0;
+        return 0;
+    }
+
+    for ( i = 0; i < workers; i++ ) pthread_mutex_init( &pool->deques[ i ].lock, NULL );
+    for ( i = 0; i < ( int )count; i++ ) pool_push( pool, 0, first[ i ] ); // The other workers steal them
+
+    for ( i = 0; i < workers; i++ )
+    {
+        pool->arguments[ i ].pool = pool;
+        pool->arguments[ i ].worker = i;
+        if ( pthread_create( &pool->threads[ i ], NULL, pool_worker, &pool->arguments[ i ] ) != 0 ) break;
+        pool->workers++;
+    }
+    return pool->workers > 0;
+}
+
+/*
+ * Function    : pool_finish
+ * Parameters  : Work pool
+ * Description : Waits for the workers and releases the pool
+ */
+void pool_finish( struct WorkPool *pool )
+{
+    int i;
+    for ( i = 0; i < pool->workers; i++ ) pthread_join( pool->threads[ i ], NULL );
+    for ( i = 0; i < pool->deque_count; i++ )
+    {
+        pthread_mutex_destroy( &pool->deques[ i ].lock );
+        free( pool->deques[ i ].items );
+    }
+    free( pool->deques );
+    free( pool->threads );
+    free( pool->arguments );
+    pthread_mutex_destroy( &pool->idle_lock );
+    pthread_cond_destroy( &pool->more_work );
+}
+
+/*
+ * Function    : parallel_worker
+ * Parameters  : Worker state
+ * Description : Runs the next item of the loop until there are none left
+ */
+void *parallel_worker( void *argument )
+{
+    struct ParallelWorker *self = ( struct ParallelWorker * )argument;
+    struct ParallelFor *loop = self->loop;
+    uint32_t item;
+
+    while ( ( item = __atomic_fetch_add( &loop->next, 1, __ATOMIC_RELAXED ) ) < loop->count )
+    {
+        loop->run( loop->context, self->worker, item );
+    }
+    return NULL;
+}
+
+/*
+ * Function    : parallel_for
+ * Parameters  : Number of items, number of workers, the function that runs one item, and context for it
+ * Description : Runs items 0 to count - 1 on up to the given number of workers, handing them out in
+ *               order. The calling thread is worker 0, so the loop completes even if no thread starts.
+ */
+void parallel_for( uint32_t count, int workers, void ( *run )( void *context, int worker, uint32_t item ), void *context )
+{
+    pthread_t threads[ MAX_WORKERS ];
+    struct ParallelWorker arguments[ MAX_WORKERS ];
+    struct ParallelFor loop;
+    int i, started = 0;
+
+    if ( workers > MAX_WORKERS ) workers = MAX_WORKERS;
+    if ( ( uint32_t )workers > count ) workers = count;
+    if ( workers < 1 ) workers = 1; // Worker 0 still needs its arguments when there is nothing to do
+
+    loop.next = 0;
+    loop.count = count;
+    loop.run = run;
+    loop.context = context;
+
+    for ( i = 0; i < workers; i++ )
+    {
+        arguments[ i ].loop = &loop;
+        arguments[ i ].worker = i;
+    }
+    for ( i = 1; i < workers; i++ )
+    {
+        if ( pthread_create( &threads[ started ], NULL, parallel_worker, &arguments[ i ] ) != 0 ) break;
+        started++;
+    }
+    parallel_worker( &arguments[ 0 ] );
+    for ( i = 0; i < started; i++ ) pthread_join( threads[ i ], NULL );
+}
+
+/*
+ * Function    : tree_node
+ * Parameters  : Directory tree and a node number
+ * Returns     : The node. Nodes are allocated in chunks that never move, so the pointer stays valid
+ *               while other workers add nodes.
+ */
+struct TreeNode *tree_node( struct DirectoryTree *tree, uint32_t id )
+{
+    return &tree->chunks[ id / TREE_CHUNK ][ id % TREE_CHUNK ];
+}
+
+/*
+ * Function    : tree_add
+ * Parameters  : Directory tree, first cluster of the directory, and its display path (copied)
+ * Returns     : The number of the new node, or INDEX_NONE if the directory was already added or
+ *               memory ran out
+ */
+uint32_t tree_add( struct DirectoryTree *tree, uint32_t cluster, const char *path )
+{
+    uint32_t id = INDEX_NONE;
+
+    if ( cluster < 2 || cluster >= tree->clusters ) return INDEX_NONE;
+    if ( __atomic_fetch_or( &tree->visited[ cluster / 64 ], 1ULL << ( cluster % 64 ), __ATOMIC_SEQ_CST ) & ( 1ULL << ( cluster % 64 ) ) )
+    {
+        return INDEX_NONE; // Loop in a corrupted image
+    }
+
+    pthread_mutex_lock( &tree->lock );
+    if ( tree->count % TREE_CHUNK == 0 && tree->count / TREE_CHUNK < TREE_MAX_CHUNKS )
+    {
+        tree->chunks[ tree->count / TREE_CHUNK ] = ( struct TreeNode * )calloc( TREE_CHUNK, sizeof( struct TreeNode ) );
+    }
+    if ( tree->count / TREE_CHUNK < TREE_MAX_CHUNKS && tree->chunks[ tree->count / TREE_CHUNK ] )
+    {
+        id = tree->count++;
+        struct TreeNode *node = tree_node( tree, id );
+        node->cluster = cluster;
+        node->path = strdup( path );
+    }
+    pthread_mutex_unlock( &tree->lock );
+    return id;
+}
+
+/*
+ * Function    : tree_add_child
+ * Parameters  : Directory tree, parent node, first cluster of the sub-directory, and its name
+ * Returns     : The number of the new node, or INDEX_NONE if it was not added
+ * Description : Adds a sub-directory and records it as the next child of its parent. Only the
+ *               worker visiting the parent calls this, before the parent is marked done.
+ */
+uint32_t tree_add_child( struct DirectoryTree *tree, struct TreeNode *parent, uint32_t cluster, const char *name )
+{
+    size_t length = strlen( parent->path );
+    char *path = ( char * )malloc( length + strlen( name ) + 2 );
+    if ( !path ) return INDEX_NONE;
+    sprintf( path, "%s%s%s", parent->path, ( length > 0 && parent->path[ length - 1 ] == '/' ) ? "" : "/", name );
+
+    uint32_t id = tree_add( tree, cluster, path );
+    free( path );
+    if ( id != INDEX_NONE ) tree_node( tree, id )->depth = parent->depth + 1;
+
+    if ( id != INDEX_NONE && grow_array( ( void ** )&parent->children, &parent->child_capacity, parent->child_count + 1, sizeof( uint32_t ) ) )
+    {
+        parent->children[ parent->child_count++ ] = id;
+    }
+    return id;
+}
+
+/*
+ * Function    : tree_done
+ * Parameters  : Directory tree and a node whose text and children are complete
+ * Description : Hands the node over to the merge stage
+ */
+void tree_done( struct DirectoryTree *tree, struct TreeNode *node )
+{
+    pthread_mutex_lock( &tree->lock );
+    node->done = 1;
+    pthread_cond_broadcast( &tree->changed );
+    pthread_mutex_unlock( &tree->lock );
+}
+
+/*
+ * Function    : tree_init
+ * Parameters  : Directory tree, fat32 info structure, and the fat32 image
+ * Returns     : 1 on success, 0 if memory ran out
+ */
+int tree_init( struct DirectoryTree *tree, struct f32info *f32, FILE *fp )
+{
+    memset( tree, 0, sizeof( struct DirectoryTree ) );
+    tree->f32 = f32;
+    tree->fp = fp;
+    tree->chunks = ( struct TreeNode ** )calloc( TREE_MAX_CHUNKS, sizeof( struct TreeNode * ) );
+    tree->clusters = volume_clusters( f32 );
+    tree->visited = ( uint64_t * )calloc( ( ( uint64_t )tree->clusters + 63 ) / 64, 8 );
+    pthread_mutex_init( &tree->lock, NULL );
+    pthread_cond_init( &tree->changed, NULL );
+    return tree->chunks && tree->visited;
+}
+
+/*
+ * Function    : tree_merge
+ * Parameters  : Directory tree and the output to write to
+ * Description : Writes the text of every node in depth first order, children in the order of
+ *               their directory entries, no matter which worker finished first. Each node is written
+ *               as soon as it and everything before it are done, so output streams during the walk,
+ *               and its text is released right after.
+ */
+void tree_merge( struct DirectoryTree *tree, struct OutputBuffer *out )
+{
+    uint32_t *stack = NULL;
+    uint64_t stack_capacity = 0, depth = 0;
+    uint32_t i;
+
+    if ( tree->count == 0 || !grow_array( ( void ** )&stack, &stack_capacity, 1, sizeof( uint32_t ) ) ) return;
+    stack[ depth++ ] = 0;
+
+    while ( depth > 0 )
+    {
+        struct TreeNode *node = tree_node( tree, stack[ --depth ] );
+
+        pthread_mutex_lock( &tree->lock );
+        while ( !node->done ) pthread_cond_wait( &tree->changed, &tree->lock );
+        pthread_mutex_unlock( &tree->lock );
+
+        if ( node->text.length > 0 ) out_write( out, node->text.data, node->text.length );
+        free( node->text.data );
+        node->text.data = NULL;
+
+        if ( !grow_array( ( void ** )&stack, &stack_capacity, depth + node->child_count, sizeof( uint32_t ) ) ) break;
+        for ( i = node->child_count; i > 0; i-- ) stack[ depth++ ] = node->children[ i - 1 ];
+    }
+    free( stack );
+}
+
+/*
+ * Function    : tree_free
+ * Parameters  : Directory tree
+ */
+void tree_free( struct DirectoryTree *tree )
+{
+    uint32_t i;
+    for ( i = 0; i < tree->count; i++ )
+    {
+        struct TreeNode *node = tree_node( tree, i );
+        free( node->path );
+        free( node->text.data );
+        free( node->children );
+    }
+    for ( i = 0; tree->chunks && i < TREE_MAX_CHUNKS && tree->chunks[ i ]; i++ ) free( tree->chunks[ i ] );
+    free( tree->chunks );
+    free( tree->visited );
+    pthread_mutex_destroy( &tree->lock );
+    pthread_cond_destroy( &tree->changed );
+}
+
+/*
+ * Function    : walk_tree
+ * Parameters  : Directory tree, first cluster and display path of the top directory, the function that
+ *               visits one directory, context for it, and the output to merge into
+ * Returns     : 1 on success, 0 if the walk could not be started
+ * Description : Visits the directory and every sub-directory the visit function adds, in parallel
+ *               on a work stealing pool, while this thread merges their text into the output in order.
+ */
+int walk_tree( struct DirectoryTree *tree, uint32_t cluster, const char *path,
+               void ( *visit )( struct WorkPool *, int, uint32_t ), void *context, struct OutputBuffer *out )
+{
+    struct WorkPool pool;
+    uint32_t top = 0;
+
+    if ( tree_add( tree, cluster, path ) != top ) return 0;
+
+    memset( &pool, 0, sizeof( pool ) );
+    pool.run = visit;
+    pool.context = context;
+
+    if ( !pool_start( &pool, worker_count(), &top, 1 ) )
+    {
+        pool_finish( &pool );
+        return 0;
+    }
+    tree_merge( tree, out );
+    pool_finish( &pool );
+    return 1;
+}
+
+/*
+ * Function    : list_visit
+ * Parameters  : Work pool, worker, and the tree node of a directory
+ * Description : Lists one directory for ls -R the same way ls prints it, and queues its sub-directories
+ */
+void list_visit( struct WorkPool *pool, int worker, uint32_t id )
+{
+    struct DirectoryTree *tree = ( struct DirectoryTree * )pool->context;
+    struct TreeNode *node = tree_node( tree, id );
+    struct DirectoryWalk walk;
+    char line[ LFN_MAX_UNITS * 3 + 32 ];
+    char name[ LFN_MAX_UNITS * 3 + 1 ];
+    int count, i, n;
+
+    n = snprintf( line, sizeof( line ), "%s%s:\n", id == 0 ? "" : "\n", node->path );
+    text_append( &node->text, line, n );
+
+    struct DirectoryEntry *entries = list_directory( node->cluster, tree->f32, tree->fp, &count );
+    if ( entries )
+    {
+        walk_begin( &walk, entries, count, 1 );
+        while ( ( i = walk_next( &walk ) ) != -1 )
+        {
+            char name_buffer[ 12 ];
+            memcpy( name_buffer, entries[ i ].DIR_Name, 11 );
+            name_buffer[ 11 ] = '\0';
+
+            if ( walk.has_long_name )
+            {
+                utf16_to_utf8( walk.name.chars, walk.name.length, name, sizeof( name ) );
+                n = snprintf( line, sizeof( line ), "%s %s\n", name_buffer, name );
+            }
+            else
+            {
+                format_short_name( entries[ i ].DIR_Name, name );
+                n = snprintf( line, sizeof( line ), "%s \n", name_buffer );
+            }
+            text_append( &node->text, line, n );
+
+            if ( ( entries[ i ].DIR_Attr & 0x10 ) && entries[ i ].DIR_Name[ 0 ] != '.' ) // Not "." or ".."
+            {
+                uint32_t child = tree_add_child( tree, node, first_cluster( &entries[ i ] ), name );
+                if ( child != INDEX_NONE ) pool_push( pool, worker, child );
+            }
+        }
+        free( entries );
+    }
+    tree_done( tree, node );
+}
+
+/*
+ * Function    : ls_recursive
+ * Parameters  : Directory path (NULL for the working directory), fat32info, and the current file pointer
+ * Description : Lists a directory and all of its sub-directories
+ */
+void ls_recursive( char *path, struct f32info *f32, FILE *fp )
+{
+    struct DirectoryEntry target;
+    struct DirectoryTree tree;
+    struct OutputBuffer out;
+
+    if ( !resolve_path( path, f32, fp, &target, NULL ) )
+    {
+        printf( "Error: File not found. \n" );
+        return;
+    }
+    if ( !( target.DIR_Attr & 0x10 ) )
+    {
+        printf( "Error: Entry is not a directory. \n" );
+        return;
+    }
+    memset( &tree, 0, sizeof( tree ) );
+    if ( ( !volume_index && !load_fat( f32, fp ) ) || !tree_init( &tree, f32, fp ) ) // A loaded index lists without the FAT
+    {
+        printf( "Error: Out of memory. \n" );
+        tree_free( &tree );
+        return;
+    }
+
+    out_open( &out, STDOUT_FILENO );
+    if ( !walk_tree( &tree, first_cluster( &target ), path ? path : ".", list_visit, &tree, &out ) )
+    {
+        printf( "Error: Could not start worker threads. \n" );
+    }
+    out_close( &out );
+    tree_free( &tree );
+}
+
+/*
+ * Function    : glob_match
+ * Parameters  : Pattern with * and ? wildcards and [set] classes, and a name
+ * Returns     : 1 if the whole name matches, 0 otherwise. Letters compare without case.
+ * Description : Backtracks only to the most recent *, so it runs in O(pattern * name) at worst.
+ */
+int glob_match( const char *pattern, const char *name )
+{
+    const char *star = NULL, *resume = NULL;
+
+    while ( *name )
+    {
+        if ( *pattern == '*' )
+        {
+            star = ++pattern;
+            resume = name;
+            continue;
+        }
+
+        int matched = 0;
+        const char *next = pattern + 1;
+        if ( *pattern == '?' ) matched = 1;
+        else if ( *pattern == '[' )
+        {
+            const char *p = pattern + 1;
+            int negate = ( *p == '!' || *p == '^' );
+            if ( negate ) p++;
+            int in_set = 0;
+            char c = toupper( ( unsigned char )*name );
+            do
+            {
+                if ( p[ 1 ] == '-' && p[ 2 ] && p[ 2 ] != ']' )
+                {
+                    if ( c >= toupper( ( unsigned char )p[ 0 ] ) && c <= toupper( ( unsigned char )p[ 2 ] ) ) in_set = 1;
+                    p += 3;
+                }
+                else
+                {
+                    if ( c == toupper( ( unsigned char )*p ) ) in_set = 1;
+                    p++;
+                }
+            } while ( *p && *p != ']' );
+            if ( *p == ']' )
+            {
+                matched = in_set != negate;
+                next = p + 1;
+            }
+            else matched = *name == '['; // No closing bracket, a literal [
+        }
+        else if ( *pattern ) matched = toupper( ( unsigned char )*pattern ) == toupper( ( unsigned char )*name );
+
+        if ( matched )
+        {
+            pattern = next;
+            name++;
+        }
+        else if ( star )
+        {
+            pattern = star;
+            name = ++resume;
+        }
+        else return 0;
+    }
+
+    while ( *pattern == '*' ) pattern++;
+    return *pattern == '\0';
+}
+
+/*
+ * Function    : parse_number
+ * Parameters  : Text starting with a decimal number, the value to fill in, and where the number ends
+ * Returns     : 1 on success, 0 if the text does not start with a digit or the number is too large
+ */
+int parse_number( const char *text, uint64_t *value, char **end )
+{
+    if ( !isdigit( ( unsigned char )text[ 0 ] ) ) return 0;
+    errno = 0;
+    *value = strtoull( text, end, 10 );
+    return errno != ERANGE;
+}
+
+/*
+ * Function    : parse_count
+ * Parameters  : Plain decimal number, and the value to fill in
+ * Returns     : 1 on success, 0 if the text is not a number that fits 64 bits
+ * Description : For cluster and sector numbers and counts of things, where a size suffix makes no sense
+ */
+int parse_count( const char *text, uint64_t *value )
+{
+    char *end;
+    return parse_number( text, value, &end ) && *end == '\0';
+}
+
+/*
+ * Function    : parse_size
+ * Parameters  : Byte count with an optional k, M or G suffix, and the value to fill in
+ * Returns     : 1 on success, 0 if the text is not a size or the size does not fit 64 bits
+ */
+int parse_size( const char *text, uint64_t *value )
+{
+    char *end;
+    int shift = 0;
+    if ( !parse_number( text, value, &end ) ) return 0;
+    switch ( toupper( ( unsigned char )*end ) )
+    {
+        case 'G': shift += 10; // fall through
+        case 'M': shift += 10; // fall through
+        case 'K': shift += 10; end++; break;
+        case 'C': end++; break;
+    }
+    if ( shift && *value > UINT64_MAX >> shift ) return 0;
+    *value <<= shift;
+    return *end == '\0';
+}
+
+/*
+ * Function    : parse_stamp
+ * Parameters  : Date as YYYY-MM-DD or YYYY-MM-DDTHH:MM, and the value to fill in
+ * Returns     : 1 on success, 0 if the text is not a date FAT can hold
+ * Description : Packs the date like a directory entry does, write date in the high 16 bits and
+ *               write time in the low 16 bits, so stamps compare as plain integers.
+ */
+int parse_stamp( const char *text, uint32_t *stamp )
+{
+    int year, month, day, hour = 0, minute = 0, used = 0;
+
+    if ( sscanf( text, "%d-%d-%d%n", &year, &month, &day, &used ) != 3 ) return 0;
+    if ( text[ used ] == 'T' )
+    {
+        int more = 0;
+        if ( sscanf( text + used, "T%d:%d%n", &hour, &minute, &more ) != 2 ) return 0;
+        used += more;
+    }
+    if ( text[ used ] != '\0' || year < 1980 || year > 2107 || month < 1 || month > 12 || day < 1 || day > 31 ||
+         hour < 0 || hour > 23 || minute < 0 || minute > 59 )
+    {
+        return 0;
+    }
+    *stamp = ( uint32_t )( ( ( year - 1980 ) << 9 ) | ( month << 5 ) | day ) << 16 | ( hour << 11 ) | ( minute << 5 );
+    return 1;
+}
+
+/*
+ * Function    : parse_attributes
+ * Parameters  : Attribute letters (r, h, s, v, d, a) and the mask to fill in
+ * Returns     : 1 on success, 0 on an unknown letter
+ */
+int parse_attributes( const char *text, uint8_t *mask )
+{
+    *mask = 0;
+    for ( ; *text; text++ )
+    {
+        const char *letters = "rhsvda";
+        const char *found = strchr( letters, tolower( ( unsigned char )*text ) );
+        if ( !found ) return 0;
+        *mask |= 1 << ( found - letters );
+    }
+    return 1;
+}
+
+/*
+ * Function    : compile_find
+ * Parameters  : Test arguments, number of arguments, and the filter to fill in
+ * Returns     : 1 on success, 0 after printing an error
+ * Description : Folds every test into one range or mask per field, so repeated tests cost nothing,
+ *               then orders the tests that are left cheapest first with the name glob last.
+ *               Tests:
+ *                   -name GLOB                  long or 8.3 name matches GLOB
+ *                   -type f|d                   files or directories only
+ *                   -size [+|-]N[k|M|G]          more than, less than, or exactly N bytes
+ *                   -attr LETTERS / -noattr LETTERS   all of / none of the attributes rhsvda
+ *                   -cluster LOW[-HIGH]         first cluster in the range
+ *                   -after DATE / -before DATE  last written on or after / before DATE
+ *                   -mindepth N / -maxdepth N   depth below the starting directory
+ */
+int compile_find( char **argument, int count, struct FindFilter *filter )
+{
+    uint64_t size_low = 0, size_high = UINT64_MAX;
+    uint64_t cluster_low = 0, cluster_high = UINT64_MAX;
+    uint64_t stamp_low = 0, stamp_high = UINT64_MAX;
+    uint8_t attr_set = 0, attr_clear = 0;
+    int type = -1;
+    int i;
+
+    memset( filter, 0, sizeof( struct FindFilter ) );
+    filter->min_depth = 1;
+    filter->max_depth = INT_MAX;
+
+    for ( i = 0; i < count; i++ )
+    {
+        const char *test = argument[ i ];
+        const char *value = i + 1 < count ? argument[ i + 1 ] : NULL;
+        uint64_t number, high;
+        uint32_t stamp;
+        uint8_t mask;
+        char *end;
+
+        if ( value == NULL )
+        {
+            printf( "Error: %s needs a value.\n", test );
+            return 0;
+        }
+        i++;
+
+        if ( !strcmp( test, "-name" ) )
+        {
+            if ( filter->pattern_count == FIND_MAX_PATTERNS )
+            {
+                printf( "Error: Too many -name tests.\n" );
+                return 0;
+            }
+            filter->pattern[ filter->pattern_count++ ] = value;
+        }
+        else if ( !strcmp( test, "-type" ) && ( !strcmp( value, "f" ) || !strcmp( value, "d" ) ) )
+        {
+            int wanted = value[ 0 ] == 'd';
+            if ( type != -1 && type != wanted ) filter->empty = 1;
+            type = wanted;
+        }
+        else if ( !strcmp( test, "-size" ) && parse_size( value + ( value[ 0 ] == '+' || value[ 0 ] == '-' ), &number ) )
+        {
+            if ( value[ 0 ] == '+' )
+            {
+                if ( number + 1 > size_low ) size_low = number + 1;
+            }
+            else if ( value[ 0 ] == '-' )
+            {
+                if ( number == 0 ) filter->empty = 1;
+                else if ( number - 1 < size_high ) size_high = number - 1;
+            }
+            else
+            {
+                if ( number > size_low ) size_low = number;
+                if ( number < size_high ) size_high = number;
+            }
+        }
+        else if ( !strcmp( test, "-cluster" ) && isdigit( ( unsigned char )value[ 0 ] ) )
+        {
+            number = high = strtoull( value, &end, 0 );
+            if ( *end == '-' ) high = strtoull( end + 1, &end, 0 );
+            if ( *end != '\0' )
+            {
+                printf( "Error: Bad cluster range %s.\n", value );
+                return 0;
+            }
+            if ( number > cluster_low ) cluster_low = number;
+            if ( high < cluster_high ) cluster_high = high;
+        }
+        else if ( ( !strcmp( test, "-after" ) || !strcmp( test, "-before" ) ) && parse_stamp( value, &stamp ) )
+        {
+            if ( test[ 1 ] == 'a' )
+            {
+                if ( stamp > stamp_low ) stamp_low = stamp;
+            }
+            else if ( stamp == 0 ) filter->empty = 1;
+            else if ( stamp - 1 < stamp_high ) stamp_high = stamp - 1;
+        }
+        else if ( ( !strcmp( test, "-attr" ) || !strcmp( test, "-noattr" ) ) && parse_attributes( value, &mask ) )
+        {
+            if ( test[ 1 ] == 'a' ) attr_set |= mask;
+            else attr_clear |= mask;
+        }
+        else if ( ( !strcmp( test, "-mindepth" ) || !strcmp( test, "-maxdepth" ) ) && isdigit( ( unsigned char )value[ 0 ] ) )
+        {
+            long depth = strtol( value, &end, 10 );
+            if ( *end != '\0' || depth > INT_MAX )
+            {
+                printf( "Error: Bad depth %s.\n", value );
+                return 0;
+            }
+            if ( test[ 2 ] == 'i' ) filter->min_depth = ( int )depth;
+            else filter->max_depth = ( int )depth;
+        }
+        else
+        {
+            printf( "Error: Bad find test %s %s.\n", test, value );
+            return 0;
+        }
+    }
+
+    // Directories have no size, and -type d with a size test can never match
+    if ( type == 1 ) attr_set |= 0x10;
+    if ( type == 0 ) attr_clear |= 0x10;
+    if ( attr_set & 0x10 && size_low > 0 ) filter->empty = 1;
+
+    if ( size_low > size_high || cluster_low > cluster_high || stamp_low > stamp_high || ( attr_set & attr_clear ) ||
+         filter->min_depth > filter->max_depth )
+    {
+        filter->empty = 1;
+    }
+
+    if ( attr_set || attr_clear )
+    {
+        filter->test[ filter->test_count ].field = FIND_ATTR;
+        filter->test[ filter->test_count ].low = attr_set;
+        filter->test[ filter->test_count++ ].high = attr_clear;
+    }
+    if ( size_low > 0 || size_high != UINT64_MAX )
+    {
+        filter->test[ filter->test_count ].field = FIND_SIZE;
+        filter->test[ filter->test_count ].low = size_low;
+        filter->test[ filter->test_count++ ].high = size_high;
+    }
+    if ( cluster_low > 0 || cluster_high != UINT64_MAX )
+    {
+        filter->test[ filter->test_count ].field = FIND_CLUSTER;
+        filter->test[ filter->test_count ].low = cluster_low;
+        filter->test[ filter->test_count++ ].high = cluster_high;
+    }
+    if ( stamp_low > 0 || stamp_high != UINT64_MAX )
+    {
+        filter->test[ filter->test_count ].field = FIND_STAMP;
+        filter->test[ filter->test_count ].low = stamp_low;
+        filter->test[ filter->test_count++ ].high = stamp_high;
+    }
+    return 1;
+}
+
+/*
+ * Function    : find_batch
+ * Parameters  : Filter, entries of the batch, their names, and a mask of the entries in the batch
+ * Returns     : Mask of the entries that pass every test
+ * Description : Runs one test at a time over the whole batch, and stops as soon as nothing is left.
+ *               Only the numeric fields of an entry are touched until the name globs run.
+ */
+uint64_t find_batch( const struct FindFilter *filter, struct DirectoryEntry **entry, char ( *name )[ LFN_MAX_UNITS * 3 + 1 ],
+                     char ( *short_name )[ 13 ], uint64_t bits )
+{
+    uint64_t value[ SCAN_BLOCK ];
+    int t, i, p;
+
+    for ( t = 0; t < filter->test_count && bits; t++ )
+    {
+        const struct FindTest *test = &filter->test[ t ];
+        uint64_t pass = 0;
+
+        for ( i = 0; i < SCAN_BLOCK; i++ )
+        {
+            switch ( test->field )
+            {
+                case FIND_ATTR: value[ i ] = entry[ i ] ? entry[ i ]->DIR_Attr : 0; break;
+                case FIND_SIZE: value[ i ] = entry[ i ] ? entry[ i ]->DIR_FileSize : 0; break;
+                case FIND_CLUSTER: value[ i ] = entry[ i ] ? first_cluster( entry[ i ] ) : 0; break;
+                case FIND_STAMP:
+                    value[ i ] = entry[ i ] ? ( uint32_t )( entry[ i ]->Unused2[ 2 ] | entry[ i ]->Unused2[ 3 ] << 8 ) << 16 |
+                                                  ( entry[ i ]->Unused2[ 0 ] | entry[ i ]->Unused2[ 1 ] << 8 )
+                                            : 0;
+                    break;
+            }
+        }
+
+        if ( test->field == FIND_ATTR )
+        {
+            for ( i = 0; i < SCAN_BLOCK; i++ )
+            {
+                pass |= ( uint64_t )( ( value[ i ] & test->low ) == test->low && ( value[ i ] & test->high ) == 0 ) << i;
+            }
+        }
+        else
+        {
+            for ( i = 0; i < SCAN_BLOCK; i++ )
+            {
+                pass |= ( uint64_t )( value[ i ] - test->low <= test->high - test->low ) << i; // low <= value <= high
+            }
+        }
+        bits &= pass;
+    }
+
+    for ( p = 0; p < filter->pattern_count && bits; p++ )
+    {
+        uint64_t left = bits;
+        while ( left )
+        {
+            i = __builtin_ctzll( left );
+            left &= left - 1;
+            if ( !glob_match( filter->pattern[ p ], name[ i ] ) && !glob_match( filter->pattern[ p ], short_name[ i ] ) )
+            {
+                bits &= ~( 1ULL << i );
+            }
+        }
+    }
+    return bits;
+}
+
+/*
+ * Function    : find_visit
+ * Parameters  : Work pool, worker, and the tree node of a directory
+ * Description : Collects the entries of one directory in batches of SCAN_BLOCK, filters each batch,
+ *               and queues the sub-directories. Sub-directories at the maximum depth are not opened.
+ */
+void find_visit( struct WorkPool *pool, int worker, uint32_t id )
+{
+    struct FindSearch *search = ( struct FindSearch * )pool->context;
+    struct DirectoryTree *tree = &search->tree;
+    struct TreeNode *node = tree_node( tree, id );
+    struct DirectoryEntry *batch[ SCAN_BLOCK ];
+    static __thread char name[ SCAN_BLOCK ][ LFN_MAX_UNITS * 3 + 1 ]; // Too large for small thread stacks
+    char short_name[ SCAN_BLOCK ][ 13 ];
+    struct DirectoryWalk walk;
+    uint64_t bits = 0;
+    int depth = node->depth + 1; // Depth of the entries in this directory
+    int count, i, n = 0, done = 0;
+
+    struct DirectoryEntry *entries = list_directory( node->cluster, tree->f32, tree->fp, &count );
+    if ( entries ) walk_begin( &walk, entries, count, 0 );
+
+    while ( entries && !done )
+    {
+        i = walk_next( &walk );
+        done = i == -1;
+
+        if ( !done && entries[ i ].DIR_Name[ 0 ] != '.' ) // Not "." or ".."
+        {
+            batch[ n ] = &entries[ i ];
+            format_short_name( entries[ i ].DIR_Name, short_name[ n ] );
+            if ( walk.has_long_name ) utf16_to_utf8( walk.name.chars, walk.name.length, name[ n ], sizeof( name[ n ] ) );
+            else strcpy( name[ n ], short_name[ n ] );
+            bits |= 1ULL << n++;
+        }
+        if ( n < SCAN_BLOCK && !done ) continue;
+
+        for ( i = n; i < SCAN_BLOCK; i++ ) batch[ i ] = NULL;
+        uint64_t matched = depth >= search->filter.min_depth ? find_batch( &search->filter, batch, name, short_name, bits ) : 0;
+
+        for ( i = 0; i < n; i++ )
+        {
+            if ( matched & ( 1ULL << i ) )
+            {
+                size_t length = strlen( node->path );
+                text_append( &node->text, node->path, length );
+                if ( length == 0 || node->path[ length - 1 ] != '/' ) text_append( &node->text, "/", 1 );
+                text_append( &node->text, name[ i ], strlen( name[ i ] ) );
+                text_append( &node->text, "\n", 1 );
+            }
+            if ( ( batch[ i ]->DIR_Attr & 0x10 ) && depth < search->filter.max_depth )
+            {
+                uint32_t child = tree_add_child( tree, node, first_cluster( batch[ i ] ), name[ i ] );
+                if ( child != INDEX_NONE ) pool_push( pool, worker, child );
+            }
+        }
+        n = 0;
+        bits = 0;
+    }
+    free( entries );
+    tree_done( tree, node );
+}
+
+/*
+ * Function    : find
+ * Parameters  : Command tokens after "find", number of them, fat32info, and the current file pointer
+ * Description : Prints the path of every entry below a directory that passes all the tests,
+ *               see compile_find(). The directory is the first token unless it starts with '-',
+ *               and defaults to the working directory.
+ */
+void find( char **argument, int count, struct f32info *f32, FILE *fp )
+{
+    struct DirectoryEntry target;
+    struct FindSearch search;
+    struct OutputBuffer out;
+    char *path = NULL;
+    int i, used = 0;
+
+    for ( i = 0; i < count; i++ ) // Drop the empty tokens left by repeated spaces
+    {
+        if ( argument[ i ] ) argument[ used++ ] = argument[ i ];
+    }
+    count = used;
+
+    if ( count > 0 && argument[ 0 ][ 0 ] != '-' )
+    {
+        path = argument[ 0 ];
+        argument++;
+        count--;
+    }
+    if ( !compile_find( argument, count, &search.filter ) ) return;
+
+    if ( !resolve_path( path, f32, fp, &target, NULL ) )
+    {
+        printf( "Error: File not found. \n" );
+        return;
+    }
+    if ( !( target.DIR_Attr & 0x10 ) )
+    {
+        printf( "Error: Entry is not a directory. \n" );
+        return;
+    }
+    if ( search.filter.empty || search.filter.max_depth == 0 ) return; // Nothing can match, skip the walk
+
+    memset( &search.tree, 0, sizeof( search.tree ) );
+    if ( ( !volume_index && !load_fat( f32, fp ) ) || !tree_init( &search.tree, f32, fp ) ) // A loaded index lists without the FAT
+    {
+        printf( "Error: Out of memory. \n" );
+        tree_free( &search.tree );
+        return;
+    }
+
+    out_open( &out, STDOUT_FILENO );
+    if ( !walk_tree( &search.tree, first_cluster( &target ), path ? path : ".", find_visit, &search, &out ) )
+    {
+        printf( "Error: Could not start worker threads. \n" );
+    }
+    out_close( &out );
+    tree_free( &search.tree );
+}
+
+/*
+ * Function    : adjust_totals
+ * Parameters  : Volume index, a directory dentry, and the change in bytes and clusters below it
+ * Description : Applies a change to the totals of the directory and every directory above it. A
+ *               directory whose totals are unknown has unknown totals above it too, so it stops there.
+ */
+void adjust_totals( struct VolumeIndex *index, uint32_t dentry, int64_t size, int64_t clusters )
+{
+    while ( index->dentries[ dentry ].total_clusters != TOTALS_UNKNOWN )
+    {
+        index->dentries[ dentry ].total_size += size;
+        index->dentries[ dentry ].total_clusters += clusters;
+        if ( dentry == 0 ) break;
+        dentry = index->dentries[ dentry ].parent;
+    }
+}
+
+/*
+ * Function    : forget_totals
+ * Parameters  : Volume index and a directory dentry
+ * Description : Marks the totals of the directory and every directory above it as unknown
+ */
+void forget_totals( struct VolumeIndex *index, uint32_t dentry )
+{
+    while ( index->dentries[ dentry ].total_clusters != TOTALS_UNKNOWN )
+    {
+        index->dentries[ dentry ].total_clusters = TOTALS_UNKNOWN;
+        if ( dentry == 0 ) break;
+        dentry = index->dentries[ dentry ].parent;
+    }
+}
+
+/*
+ * Function    : track_entry
+ * Parameters  : Fat32 info structure, the fat32 image, cluster of the directory holding the entry,
+ *               index of the entry in that cluster, the entry, and 1 if it was deleted or 0 if restored
+ * Description : Keeps the directory totals of the index right across del and undel, so du does not
+ *               sum the subtrees again. Called before invalidate_index(), whose rebuild carries the
+ *               totals over. The entry is matched by position, first cluster and name, since compact
+ *               and put may have moved or reused entries since the index was built.
+ */
+void track_entry( struct f32info *f32, FILE *fp, uint32_t directory_cluster, uint32_t entry_index,
+                  struct DirectoryEntry *entry, int deleted )
+{
+    struct VolumeIndex *index = volume_index ? volume_index : stale_index;
+    uint32_t parent, i;
+
+    if ( !index || ( parent = index_directory( index, directory_cluster ) ) == INDEX_NONE ) return;
+
+    if ( deleted && !( entry->DIR_Attr & 0x10 ) )
+    {
+        struct IndexDentry *directory = &index->dentries[ parent ];
+        for ( i = 0; i < directory->child_count; i++ )
+        {
+            struct IndexDentry *child = &index->dentries[ directory->first_child + i ];
+            if ( child->entry_cluster == directory_cluster && child->entry_index == entry_index &&
+                 child->first_cluster == first_cluster( entry ) && !memcmp( child->short_name + 1, entry->DIR_Name + 1, 10 ) )
+            {
+                if ( child->total_clusters == TOTALS_UNKNOWN ) break;
+                adjust_totals( index, parent, -( int64_t )child->total_size, -( int64_t )child->total_clusters );
+                return;
+            }
+        }
+        forget_totals( index, parent );
+        return;
+    }
+
+    // A deleted directory would still be listed by du from this index, and a restored one brings
+    // back a subtree nobody summed
+    if ( ( entry->DIR_Attr & 0x10 ) || !load_fat( f32, fp ) )
+    {
+        forget_totals( index, parent );
+        return;
+    }
+
+    int64_t clusters = 0;
+    uint32_t next;
+    for ( next = first_cluster( entry ); next >= 2 && next < fat_entries && clusters < fat_entries; next = next_cluster( next ) )
+    {
+        clusters++;
+    }
+    adjust_totals( index, parent, entry->DIR_FileSize, clusters );
+}
+
+/*
+ * Function    : sum_totals
+ * Parameters  : Volume index and a directory dentry whose sub-directories all have known totals
+ * Description : Sets the totals of the directory from its own clusters and the totals of its children
+ */
+void sum_totals( struct VolumeIndex *index, uint32_t dentry )
+{
+    struct IndexDentry *directory = &index->dentries[ dentry ];
+    uint64_t size = 0, clusters = extent_clusters( index->extents, directory );
+    uint32_t i;
+
+    for ( i = 0; i < directory->child_count; i++ )
+    {
+        struct IndexDentry *child = &index->dentries[ directory->first_child + i ];
+        size += child->total_size;
+        clusters += __atomic_load_n( &child->total_clusters, __ATOMIC_ACQUIRE );
+    }
+    directory->total_size = size;
+    __atomic_store_n( &directory->total_clusters, clusters, __ATOMIC_RELEASE );
+}
+
+// Bottom up summing of the totals below one directory, see compute_totals()
+struct TotalsJob
+{
+    struct VolumeIndex *index;
+    uint32_t top;
+};
+
+/*
+ * Function    : totals_visit
+ * Parameters  : Work pool, worker, and a directory dentry whose sub-directories are all summed
+ * Description : Sums the directory, then queues its parent if this was the last sub-directory
+ *               the parent was waiting for
+ */
+void totals_visit( struct WorkPool *pool, int worker, uint32_t dentry )
+{
+    struct TotalsJob *job = ( struct TotalsJob * )pool->context;
+    struct VolumeIndex *index = job->index;
+
+    sum_totals( index, dentry );
+    if ( dentry == job->top ) return;
+
+    uint32_t parent = index->dentries[ dentry ].parent;
+    if ( __atomic_sub_fetch( &index->dentries[ parent ].total_size, 1, __ATOMIC_ACQ_REL ) == 0 ) pool_push( pool, worker, parent );
+}
+
+/*
+ * Function    : compute_totals
+ * Parameters  : Volume index and a directory dentry
+ * Returns     : 1 if the totals of the directory are known afterwards, 0 if memory ran out
+ * Description : Sums every directory below the given one whose totals are unknown, deepest first.
+ *               Directories with known totals are not entered, so a subtree is summed once and
+ *               later calls on it or on anything containing it only add up what changed.
+ *               While a directory waits, its total_size counts the sub-directories it waits for.
+ *               Directories whose sub-directories are done are summed in parallel.
+ */
+int compute_totals( struct VolumeIndex *index, uint32_t top )
+{
+    struct TotalsJob job;
+    struct WorkPool pool;
+    uint32_t *pending = NULL, *ready = NULL;
+    uint64_t pending_capacity = 0, ready_capacity = 0, pending_count = 0, ready_count = 0, k;
+    uint32_t i;
+
+    if ( index->dentries[ top ].total_clusters != TOTALS_UNKNOWN ) return 1;
+
+    if ( !grow_array( ( void ** )&pending, &pending_capacity, 1, sizeof( uint32_t ) ) ) return 0;
+    pending[ pending_count++ ] = top;
+    for ( k = 0; k < pending_count; k++ )
+    {
+        struct IndexDentry *directory = &index->dentries[ pending[ k ] ];
+        directory->total_size = 0;
+
+        for ( i = 0; i < directory->child_count; i++ )
+        {
+            uint32_t child = directory->first_child + i;
+            if ( index->dentries[ child ].total_clusters != TOTALS_UNKNOWN ) continue;
+
+            if ( !grow_array( ( void ** )&pending, &pending_capacity, pending_count + 1, sizeof( uint32_t ) ) )
+            {
+                free( pending );
+                return 0;
+            }
+            pending[ pending_count++ ] = child;
+            directory->total_size++;
+        }
+    }
+
+    // Few directories are summed faster than threads start. Parents were found before their
+    // children, so the reverse order is bottom up.
+    if ( pending_count < MAX_WORKERS * 16 )
+    {
+        for ( k = pending_count; k > 0; k-- ) sum_totals( index, pending[ k - 1 ] );
+        free( pending );
+        return 1;
+    }
+
+    for ( k = 0; k < pending_count; k++ )
+    {
+        if ( index->dentries[ pending[ k ] ].total_size != 0 ) continue;
+        if ( !grow_array( ( void ** )&ready, &ready_capacity, ready_count + 1, sizeof( uint32_t ) ) ) break;
+        ready[ ready_count++ ] = pending[ k ];
+    }
+
+    job.index = index;
+    job.top = top;
+    memset( &pool, 0, sizeof( pool ) );
+    pool.run = totals_visit;
+    pool.context = &job;
+
+    int started = k == pending_count && pool_start( &pool, worker_count(), ready, ( uint32_t )ready_count );
+    pool_finish( &pool );
+    if ( !started )
+    {
+        for ( k = pending_count; k > 0; k-- ) sum_totals( index, pending[ k - 1 ] );
+    }
+
+    free( pending );
+    free( ready );
+    return index->dentries[ top ].total_clusters != TOTALS_UNKNOWN;
+}
+
+/*
+ * Function    : du
+ * Parameters  : Path (NULL for the working directory), fat32info, and the current file pointer
+ * Description : Prints the bytes stored and the bytes allocated below a directory, first for each of
+ *               its sub-directories and then for the directory itself, or for a single file.
+ *               Totals are kept in the volume index, so asking again is immediate. del, undel, put
+ *               and compact adjust them in the retired index, which then still answers for every
+ *               directory whose totals are known, without the rebuild get_index() would do.
+ */
+void du( char *path, struct f32info *f32, FILE *fp )
+{
+    struct DirectoryEntry target;
+    struct LongName long_name;
+    char name[ LFN_MAX_UNITS * 3 + 1 ];
+    uint32_t i;
+
+    if ( !resolve_path( path, f32, fp, &target, &long_name ) )
+    {
+        printf( "Error: File not found. \n" );
+        return;
+    }
+
+    uint64_t bytes = cluster_size( f32 );
+
+    if ( !( target.DIR_Attr & 0x10 ) )
+    {
+        uint64_t clusters = 0;
+        uint32_t next;
+        for ( next = first_cluster( &target ); next >= 2 && next < fat_entries && clusters < fat_entries; next = next_cluster( next ) )
+        {
+            clusters++;
+        }
+        printf( "%u\t%llu\t%s\n", target.DIR_FileSize, ( unsigned long long )( clusters * bytes ), path );
+        return;
+    }
+
+    struct VolumeIndex *index = volume_index ? volume_index : stale_index;
+    uint32_t dentry = index ? index_directory( index, first_cluster( &target ) ) : INDEX_NONE;
+    if ( dentry == INDEX_NONE || index->dentries[ dentry ].total_clusters == TOTALS_UNKNOWN )
+    {
+        index = get_index( f32, fp );
+        if ( !index )
+        {
+            printf( "Error: Could not index the file system image.\n" );
+            return;
+        }
+        dentry = index_directory( index, first_cluster( &target ) );
+    }
+    if ( dentry == INDEX_NONE || !compute_totals( index, dentry ) )
+    {
+        printf( "Error: Could not sum the directory. \n" );
+        return;
+    }
+
+    if ( !path ) path = ".";
+    struct IndexDentry *directory = &index->dentries[ dentry ];
+    for ( i = 0; i < directory->child_count; i++ )
+    {
+        struct IndexDentry *child = &index->dentries[ directory->first_child + i ];
+        if ( !( child->attr & 0x10 ) ) continue;
+
+        snprintf( name, sizeof( name ), "%s", index->names + child->name_offset );
+        printf( "%llu\t%llu\t%s%s%s\n", ( unsigned long long )child->total_size, ( unsigned long long )( child->total_clusters * bytes ),
+                path, path[ strlen( path ) - 1 ] == '/' ? "" : "/", name );
+    }
+    printf( "%llu\t%llu\t%s\n", ( unsigned long long )directory->total_size, ( unsigned long long )( directory->total_clusters * bytes ), path );
+}
+
+/*
+ * Function    : del
+ * Parameters  : User filename input, directory, fat32info, and the current file pointer
+ * Description : Deletes a file from the directory
+ */
+void del( char *filename, struct DirectoryEntry *dir, struct f32info *f32, FILE *fp )
+{
+    int entry;
+    char entry_attr;
+
+    entry = find_file( filename, dir );
+
+    // File not found
+    if ( entry == -1 )
+    {
+        printf( "Error: File not found. \n" );
+    }
+    // File found
+    else
+    {
+        struct deletedFile *new = create_deletedFile();
+        strncpy( new->name, dir[ entry ].DIR_Name, 11 );
+        new->directory = cwd_cluster;
+        new->entry = entry;
+
+        struct deletedFile *runner = head;
+        while ( runner->next != NULL )
+        {
+            runner = runner->next;
+        }
+        runner->next = new;
+
+        dir[ entry ].DIR_Name[ 0 ] = 0xe5;
+
+        // int offset = LBAToOffset( dir[i].DIR_FirstClusterLow, f32 ); //dir[i].DIR_FirstClusterLow
+        // fseek( fp, offset, SEEK_SET );
+        // fwrite( &( dir[i].DIR_Name[0] ), 1, 1, fp );
+        off_t offset = LBAToOffset( cwd_cluster, f32 ); // dir holds the first cluster of the working directory
+        fseeko( fp, offset, SEEK_SET );
+        fwrite( &dir[ 0 ], 32, 16, fp ); // update image file
+        fflush( fp );
+        track_entry( f32, fp, cwd_cluster, entry, &dir[ entry ], 1 );
+        invalidate_index();
+    }
+}
+
+/*
+ * Function    : undel
+ * Parameters  : User filename input, directory, fat32info, and the current file pointer
+ * Description : Undeletes a file from the directory
+ */
+void undel( char *filename, struct DirectoryEntry *dir, struct f32info *f32, FILE *fp )
+{
+    int i;
+    int file_deleted = 0;
+    int file_not_found = 1;
+    struct SearchKey key;
+
+    make_search_key( filename, &key );
+
+    // Search directory for entry
+    struct deletedFile *runner = head;
+    while ( runner->next != NULL )
+    {
+        if ( runner->next->directory == cwd_cluster && compare_filename( &key, runner->next->name ) ) // Found name match
+        {
+            file_deleted = 1;
+            break;
+        }
+        else runner = runner->next;
+    }
+    if ( file_deleted )
+    {
+        // Only deleted read-only files, sub-directories, or archives can be restored
+        struct EntryMasks masks;
+        classify_entries( dir, 16, &masks );
+
+        uint64_t bits = masks.deleted & masks.plain;
+        while ( bits )
+        {
+            i = __builtin_ctzll( bits );
+            bits &= bits - 1;
+
+            if ( compare_deleted_filename( &key, dir[ i ].DIR_Name ) ) // Found name match
+            {
+                file_not_found = 0;
+                break;
+            }
+        }
+    }
+
+    // File was not found
+    if ( file_not_found )
+    {
+        printf( "Error: File not found. \n" );
+    }
+    else
+    {
+        dir[ i ].DIR_Name[ 0 ] = runner->next->name[ 0 ];
+
+        // int offset = LBAToOffset( dir[i].DIR_FirstClusterLow, f32 ); //dir[i].DIR_FirstClusterLow
+        // fseek( fp, offset, SEEK_SET );
+        // fwrite( &( dir[i].DIR_Name[0] ), 1, 1, fp );
+        off_t offset = LBAToOffset( cwd_cluster, f32 ); // dir holds the first cluster of the working directory
+        fseeko( fp, offset, SEEK_SET );
+        fwrite( &dir[ 0 ], 32, 16, fp ); // update image file
+        fflush( fp );
+        track_entry( f32, fp, cwd_cluster, i, &dir[ i ], 0 );
+        invalidate_index();
+
+        // Delete file entry node
+        struct deletedFile *old = runner->next;
+        runner->next = runner->next->next;
+        free( old );
+    }
+}
+
+/*
+ * Function    : forget_deleted
+ * Parameters  : First cluster of a directory and the index of a deleted entry in it that no longer exists
+ * Description : Removes the entry from the list of files undel can restore. Entries are matched by
+ *               where they are, as files of the same name may be deleted in other directories.
+ */
+void forget_deleted( uint32_t directory, uint32_t entry )
+{
+    struct deletedFile *runner = head;
+    while ( runner->next != NULL )
+    {
+        if ( runner->next->directory == directory && runner->next->entry == entry )
+        {
+            struct deletedFile *old = runner->next;
+            runner->next = old->next;
+            free( old );
+            return;
+        }
+        runner = runner->next;
+    }
+}
+
+/*
+ * Function    : compact
+ * Parameters  : Directory path, directory, fat32info, and the current file pointer
+ * Description : Rewrites a directory without its deleted entries, keeping every long filename
+ *               sequence directly in front of its short entry, and frees the clusters at the end
+ *               of its chain that are no longer needed.
+ */
+void compact( char *path, struct DirectoryEntry *dir, struct f32info *f32, FILE *fp )
+{
+    struct DirectoryEntry target;
+    struct LongName name;
+    int count, i, j;
+
+    if ( !resolve_path( path, f32, fp, &target, NULL ) )
+    {
+        printf( "Error: File not found. \n" );
+        return;
+    }
+    if ( !( target.DIR_Attr & 0x10 ) )
+    {
+        printf( "Error: Entry is not a directory. \n" );
+        return;
+    }
+
+    uint32_t cluster = first_cluster( &target );
+    struct DirectoryEntry *entries = read_directory( cluster, f32, fp, &count );
+    if ( !entries )
+    {
+        printf( "Error: Could not read directory. \n" );
+        return;
+    }
+
+    // Clusters of the whole chain, including any after the end of directory marker
+    uint32_t chain_length = 0;
+    uint64_t chain_capacity = 0;
+    uint32_t *chain = NULL;
+    uint32_t next;
+    for ( next = cluster; next >= 2 && chain_length < fat_entries; next = next_cluster( next ) )
+    {
+        if ( !grow_array( ( void ** )&chain, &chain_capacity, chain_length + 1, sizeof( uint32_t ) ) ) break;
+        chain[ chain_length++ ] = next;
+    }
+
+    // Copy the entries worth keeping to the front. A long filename sequence is kept only if it
+    // is complete and belongs to the short entry that follows it.
+    int kept = 0, removed = 0, pending = -1, long_entries = 0; // live LFN entries since the last short one
+    name.valid = 0;
+    name.next_ord = 0;
+
+    for ( i = 0; i < count && entries[ i ].DIR_Name[ 0 ] != 0x00; i++ )
+    {
+        if ( ( uint8_t )entries[ i ].DIR_Name[ 0 ] == 0xe5 )
+        {
+            if ( entries[ i ].DIR_Attr != LFN_ATTR ) forget_deleted( cluster, i );
+            name.valid = 0;
+            pending = -1;
+            removed += 1 + long_entries; // A long name in front of a deleted entry goes with it
+            long_entries = 0;
+            continue;
+        }
+
+        if ( entries[ i ].DIR_Attr == LFN_ATTR )
+        {
+            if ( entries[ i ].DIR_Name[ 0 ] & LFN_LAST_ENTRY ) pending = i;
+            lfn_add_entry( &name, &entries[ i ] );
+            long_entries++;
+            continue;
+        }
+
+        // Long filename entries that are not copied are orphans, with or without a first entry
+        if ( lfn_finish( &name, &entries[ i ] ) && pending != -1 )
+        {
+            for ( j = pending; j < i; j++ ) entries[ kept++ ] = entries[ j ];
+            long_entries -= i - pending;
+        }
+        removed += long_entries;
+        entries[ kept++ ] = entries[ i ];
+        pending = -1;
+        long_entries = 0;
+    }
+    removed += long_entries; // Left before the end of directory marker
+    memset( &entries[ kept ], 0, ( size_t )( count - kept ) * sizeof( struct DirectoryEntry ) );
+
+    // Write the clusters that still hold entries and release the rest of the chain
+    uint32_t bytes = cluster_size( f32 );
+    uint32_t per_cluster = bytes / sizeof( struct DirectoryEntry );
+    uint32_t needed = kept == 0 ? 1 : ( kept + per_cluster - 1 ) / per_cluster;
+    uint32_t written = ( uint32_t )count / per_cluster < needed ? ( uint32_t )count / per_cluster : needed;
+
+    for ( i = 0; i < ( int )written; i++ )
+    {
+        write_at( fp, &entries[ i * per_cluster ], bytes, LBAToOffset( chain[ i ], f32 ) );
+    }
+
+    uint32_t freed = 0, lowest = 0xffffffff;
+    if ( chain_length > needed )
+    {
+        fat_set( f32, chain[ needed - 1 ], 0x0fffffff );
+        for ( i = needed; i < ( int )chain_length; i++ )
+        {
+            fat_set( f32, chain[ i ], 0 );
+            if ( chain[ i ] < lowest ) lowest = chain[ i ];
+            freed++;
+        }
+        if ( !flush_fat( f32, fp ) ) printf( "Error: Could not update the FAT: %s\n", strerror( errno ) );
+        else update_fsinfo( f32, fp, freed, lowest );
+    }
+
+    // Reload the working directory if it was the one compacted
+    if ( cluster == cwd_cluster )
+    {
+        read_at( fp, dir, 32 * 16, LBAToOffset( cwd_cluster, f32 ) );
+    }
+
+    struct VolumeIndex *index = volume_index ? volume_index : stale_index;
+    uint32_t dentry = index ? index_directory( index, cluster ) : INDEX_NONE;
+    if ( dentry != INDEX_NONE ) adjust_totals( index, dentry, 0, -( int64_t )freed );
+
+    invalidate_index();
+    printf( "Removed %d entries, freed %u of %u clusters.\n", removed, freed, chain_length );
+
+    free( chain );
+    free( entries );
+}
+
+/*
+ * Function    : write_all
+ * Parameters  : File descriptor, data, and number of bytes
+ * Returns     : 1 if everything was written, 0 otherwise
+ */
+int write_all( int fd, const void *data, size_t size )
+{
+    size_t done = 0;
+    while ( done < size )
+    {
+        ssize_t n = write( fd, ( const uint8_t * )data + done, size - done );
+        if ( n < 0 && errno == EINTR ) continue;
+        if ( n <= 0 ) return 0;
+        done += n;
+    }
+    return 1;
+}
+
+/*
+ * Function    : pwrite_all
+ * Parameters  : File descriptor, data, number of bytes, and the file offset to write them at
+ * Returns     : 1 if everything was written, 0 otherwise
+ */
+int pwrite_all( int fd, const void *data, size_t size, uint64_t offset )
+{
+    size_t done = 0;
+    while ( done < size )
+    {
+        ssize_t n = pwrite( fd, ( const uint8_t * )data + done, size - done, offset + done );
+        if ( n < 0 && errno == EINTR ) continue;
+        if ( n <= 0 ) return 0;
+        done += n;
+    }
+    return 1;
+}
+
+/*
+ * Function    : all_zero
+ * Parameters  : Data and number of bytes
+ * Returns     : 1 if every byte is zero
+ * Description : ORs 64 bytes at a time into four SSE2 registers and stops at the first block that
+ *               is not zero, so clusters with data cost almost nothing to reject
+ */
+int all_zero( const uint8_t *data, size_t size )
+{
+    size_t i = 0;
+#if defined( __SSE2__ )
+    for ( ; i + 64 <= size; i += 64 )
+    {
+        __m128i a = _mm_loadu_si128( ( const __m128i * )( data + i ) );
+        __m128i b = _mm_loadu_si128( ( const __m128i * )( data + i + 16 ) );
+        __m128i c = _mm_loadu_si128( ( const __m128i * )( data + i + 32 ) );
+        __m128i d = _mm_loadu_si128( ( const __m128i * )( data + i + 48 ) );
+        __m128i any = _mm_or_si128( _mm_or_si128( a, b ), _mm_or_si128( c, d ) );
+        if ( _mm_movemask_epi8( _mm_cmpeq_epi8( any, _mm_setzero_si128() ) ) != 0xffff ) return 0;
+    }
+#endif
+    for ( ; i + 8 <= size; i += 8 )
+    {
+        if ( xxh_read64( data + i ) ) return 0;
+    }
+    for ( ; i < size; i++ )
+    {
+        if ( data[ i ] ) return 0;
+    }
+    return 1;
+}
+
+/*
+ * Function    : write_sparse
+ * Parameters  : File descriptor of a regular file created empty, data, number of bytes, the file offset
+ *               they belong at, and the cluster size
+ * Returns     : 1 if everything was written, 0 otherwise
+ * Description : Writes the clusters that hold data and skips each run of all-zero clusters, which
+ *               stays a hole in the new file, so zeros cost neither bandwidth nor space on the host.
+ *               The caller sets the final length with ftruncate(). File systems without holes fill
+ *               them with zeros themselves.
+ */
+int write_sparse( int fd, const uint8_t *data, size_t size, uint64_t offset, uint32_t cluster_bytes )
+{
+    size_t start = 0;
+
+    while ( start < size )
+    {
+        size_t step = size - start < cluster_bytes ? size - start : cluster_bytes;
+        size_t end = start + step;
+        int zero = all_zero( data + start, step );
+
+        // Extend the run while the clusters stay zero, or stay not zero
+        while ( end < size )
+        {
+            step = size - end < cluster_bytes ? size - end : cluster_bytes;
+            if ( all_zero( data + end, step ) != zero ) break;
+            end += step;
+        }
+
+        if ( !zero && !pwrite_all( fd, data + start, end - start, offset + start ) ) return 0;
+        start = end;
+    }
+    return 1;
+}
+
+/*
+ * Function    : chain_run
+ * Parameters  : Cluster a run starts at, set to the cluster that follows the run, and the most clusters wanted
+ * Returns     : Number of consecutive clusters from the first one on, at least 1
+ */
+uint32_t chain_run( uint32_t *cluster, uint32_t limit )
+{
+    uint32_t first = *cluster, run = 1;
+
+    *cluster = next_cluster( first );
+    while ( *cluster == first + run && run < limit )
+    {
+        run++;
+        *cluster = next_cluster( *cluster );
+    }
+    return run;
+}
+
+/*
+ * Function    : copy_chain
+ * Parameters  : Fat32 info structure, the fat32 image, first cluster, number of bytes, file descriptor
+ *               to write to (-1 to only hash), a buffer with its size, a hasher to feed the data to (or NULL),
+ *               whether the file descriptor is a regular file to leave holes in, see write_sparse(), and
+ *               the file offset such a file is written from
+ * Returns     : Number of bytes copied, less than asked for if the chain ended early or I/O failed
+ * Description : Copies a file out of the image. Runs of consecutive clusters are read with one pread
+ *               each, up to a buffer at a time, so a contiguous file costs a handful of system calls.
+ *               The checksum is taken from the buffer while it is still in cache, before it is written.
+ */
+uint64_t copy_chain( struct f32info *f32, FILE *fp, uint32_t cluster, uint64_t size, int fd, uint8_t *buffer, size_t buffer_size,
+                     struct Hasher *hasher, int sparse, uint64_t offset )
+{
+    uint32_t bytes = cluster_size( f32 );
+    uint32_t per_buffer = buffer_size / bytes;
+    uint64_t done = 0;
+
+    while ( done < size && cluster >= 2 )
+    {
+        uint32_t first = cluster;
+        uint32_t needed = ( size - done + bytes - 1 ) / bytes;
+        uint32_t run = chain_run( &cluster, needed < per_buffer ? needed : per_buffer );
+        uint64_t want = ( uint64_t )run * bytes < size - done ? ( uint64_t )run * bytes : size - done;
+        if ( read_at( fp, buffer, want, LBAToOffset( first, f32 ) ) != ( ssize_t )want ) break;
+        if ( hasher ) hasher_update( hasher, buffer, want );
+        if ( sparse ? !write_sparse( fd, buffer, want, offset + done, bytes ) : fd >= 0 && !write_all( fd, buffer, want ) ) break;
+        done += want;
+    }
+    return done;
+}
+
+/*
+ * Function    : extract_file
+ * Parameters  : Fat32 info structure, the fat32 image, the file to extract, a copy buffer with its size,
+ *               and the checksum to compute (HASH_NONE for none)
+ * Returns     : 1 on success, 0 after printing an error
+ * Description : Writes one file of the image to the host. A regular file is written sparse, the
+ *               all-zero clusters are left as holes rather than allocated. The checksum ends up in
+ *               job->digest.
+ */
+int extract_file( struct f32info *f32, FILE *fp, struct ExtractJob *job, uint8_t *buffer, size_t buffer_size, int hash_kind )
+{
+    struct Hasher hasher;
+
+    job->digest[ 0 ] = '\0';
+
+    int fd = open( job->host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if ( fd < 0 )
+    {
+        printf( "Error: Could not create %s: %s\n", job->host_path, strerror( errno ) );
+        return 0;
+    }
+    struct stat host;
+    int sparse = fstat( fd, &host ) == 0 && S_ISREG( host.st_mode );
+
+    if ( hash_kind != HASH_NONE ) hasher_init( &hasher, hash_kind );
+    uint64_t copied = copy_chain( f32, fp, job->cluster, job->size, fd, buffer, buffer_size, hash_kind != HASH_NONE ? &hasher : NULL, sparse, 0 );
+    int error = copied < job->size ? errno : 0;
+    // Also sets the length of a file that ends in a hole
+    if ( ( copied < job->size || sparse ) && ftruncate( fd, copied ) != 0 ) error = errno;
+    if ( close( fd ) != 0 && !error ) error = errno;
+
+    if ( copied < job->size )
+    {
+        printf( "Error: Copied %llu of %llu bytes of %s: %s\n", ( unsigned long long )copied,
+                ( unsigned long long )job->size, job->host_path, error ? strerror( error ) : "cluster chain too short" );
+        return 0;
+    }
+    if ( error )
+    {
+        printf( "Error: Could not write %s: %s\n", job->host_path, strerror( error ) );
+        return 0;
+    }
+    if ( hash_kind != HASH_NONE ) hasher_final( &hasher, job->digest );
+    return 1;
+}
+
+/*
+ * Function    : elapsed_seconds
+ * Parameters  : Start time taken with clock_gettime( CLOCK_MONOTONIC )
+ * Returns     : Seconds since then
+ */
+double elapsed_seconds( const struct timespec *start )
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return ( now.tv_sec - start->tv_sec ) + ( now.tv_nsec - start->tv_nsec ) / 1e9;
+}
+
+/*
+ * Function    : compare_jobs
+ * Parameters  : Two extraction jobs
+ * Returns     : Order of their first clusters, for qsort
+ */
+int compare_jobs( const void *a, const void *b )
+{
+    uint32_t x = ( ( const struct ExtractJob * )a )->cluster, y = ( ( const struct ExtractJob * )b )->cluster;
+    return ( x > y ) - ( x < y );
+}
+
+/*
+ * Function    : extract_visit
+ * Parameters  : Extraction, worker, and job
+ * Description : Extracts one file with the worker's own buffer
+ */
+void extract_visit( void *context, int worker, uint32_t item )
+{
+    struct Extraction *extraction = ( struct Extraction * )context;
+    struct ExtractJob *job = &extraction->jobs[ item ];
+
+    if ( !extraction->buffers[ worker ] ) extraction->buffers[ worker ] = ( uint8_t * )malloc( COPY_BUFFER_SIZE );
+    if ( !extraction->buffers[ worker ] )
+    {
+        printf( "Error: Out of memory. \n" );
+        return;
+    }
+
+    if ( extract_file( extraction->f32, extraction->fp, job, extraction->buffers[ worker ], COPY_BUFFER_SIZE, extraction->hash_kind ) )
+    {
+        __atomic_add_fetch( &extraction->files, 1, __ATOMIC_RELAXED );
+        __atomic_add_fetch( &extraction->bytes, job->size, __ATOMIC_RELAXED );
+    }
+}
+
+/*
+ * Function    : take_copy_options
+ * Parameters  : Command tokens and their count
+ * Returns     : 1 on success, 0 after printing an error
+ * Description : Removes --hash, --manifest, --verify, --workers and --chunk with their values from
+ *               the tokens, so the remaining arguments are where the command expects them
+ */
+int take_copy_options( char **token, int *token_count, struct CopyOptions *options )
+{
+    int i, kept = 1;
+
+    memset( options, 0, sizeof( struct CopyOptions ) );
+    for ( i = 1; i < *token_count; i++ )
+    {
+        char *value = i + 1 < *token_count ? token[ i + 1 ] : NULL;
+        if ( token[ i ] == NULL ) continue;
+
+        if ( strcmp( token[ i ], "--hash" ) && strcmp( token[ i ], "--manifest" ) && strcmp( token[ i ], "--verify" ) &&
+             strcmp( token[ i ], "--workers" ) && strcmp( token[ i ], "--chunk" ) )
+        {
+            token[ kept++ ] = token[ i ];
+            continue;
+        }
+        if ( value == NULL )
+        {
+            printf( "Error: %s needs a value.\n", token[ i ] );
+            return 0;
+        }
+        if ( !strcmp( token[ i ], "--hash" ) && ( options->kind = hash_kind( value ) ) == HASH_NONE )
+        {
+            printf( "Error: Unknown hash %s, use crc32c, xxh3 or sha256.\n", value );
+            return 0;
+        }
+        if ( !strcmp( token[ i ], "--workers" ) && ( ( options->workers = atoi( value ) ) < 1 || options->workers > MAX_WORKERS ) )
+        {
+            printf( "Error: --workers takes 1 to %d.\n", MAX_WORKERS );
+            return 0;
+        }
+        if ( !strcmp( token[ i ], "--chunk" ) && ( !parse_size( value, &options->chunk ) || options->chunk == 0 ) )
+        {
+            printf( "Error: --chunk takes a size such as 64M.\n" );
+            return 0;
+        }
+        if ( !strcmp( token[ i ], "--manifest" ) ) options->manifest = value;
+        if ( !strcmp( token[ i ], "--verify" ) ) options->verify = value;
+        i++;
+    }
+    for ( i = kept; i < *token_count; i++ ) token[ i ] = NULL;
+    *token_count = kept;
+    return 1;
+}
+
+/*
+ * Function    : compare_manifest_lines
+ * Parameters  : Two manifest lines
+ * Returns     : Order of their names, for qsort and bsearch
+ */
+int compare_manifest_lines( const void *a, const void *b )
+{
+    return strcmp( ( ( const struct ManifestLine * )a )->name, ( ( const struct ManifestLine * )b )->name );
+}
+
+/*
+ * Function    : free_manifest
+ * Parameters  : Manifest
+ */
+void free_manifest( struct Manifest *manifest )
+{
+    for ( uint32_t i = 0; i < manifest->count; i++ ) free( manifest->lines[ i ].name );
+    free( manifest->lines );
+    memset( manifest, 0, sizeof( struct Manifest ) );
+}
+
+/*
+ * Function    : load_manifest
+ * Parameters  : Path of a manifest and the manifest to fill in
+ * Returns     : 1 on success, 0 after printing an error
+ * Description : Reads "<digest>  <name>" lines as sha256sum writes them. The algorithm follows from
+ *               the length of the digests, which must all be the same.
+ */
+int load_manifest( const char *path, struct Manifest *manifest )
+{
+    char line[ PATH_MAX + HASH_HEX_SIZE + 4 ];
+    uint64_t capacity = 0;
+    int number = 0;
+
+    memset( manifest, 0, sizeof( struct Manifest ) );
+    FILE *in = fopen( path, "r" );
+    if ( !in )
+    {
+        printf( "Error: Could not open %s: %s\n", path, strerror( errno ) );
+        return 0;
+    }
+
+    while ( fgets( line, sizeof( line ), in ) )
+    {
+        size_t length = strcspn( line, "\r\n" );
+        size_t digits = strspn( line, "0123456789abcdefABCDEF" );
+        int kind = digits == 8 ? HASH_CRC32C : digits == 16 ? HASH_XXH3 : digits == 64 ? HASH_SHA256 : HASH_NONE;
+        number++;
+        line[ length ] = '\0';
+        if ( length == 0 ) continue;
+
+        // Two spaces, or a space and '*' for files hashed in binary mode
+        if ( kind == HASH_NONE || length < digits + 3 || line[ digits ] != ' ' || ( line[ digits + 1 ] != ' ' && line[ digits + 1 ] != '*' ) ||
+             ( manifest->kind != HASH_NONE && kind != manifest->kind ) )
+        {
+            printf( "Error: %s line %d is not a checksum line.\n", path, number );
+            break;
+        }
+        manifest->kind = kind;
+
+        if ( !grow_array( ( void ** )&manifest->lines, &capacity, manifest->count + 1, sizeof( struct ManifestLine ) ) ) break;
+        struct ManifestLine *entry = &manifest->lines[ manifest->count ];
+        for ( size_t i = 0; i < digits; i++ ) entry->digest[ i ] = tolower( ( unsigned char )line[ i ] );
+        entry->digest[ digits ] = '\0';
+        if ( !( entry->name = strdup( line + digits + 2 ) ) ) break;
+        manifest->count++;
+    }
+    int complete = feof( in );
+    fclose( in );
+
+    if ( !complete || manifest->count == 0 )
+    {
+        if ( complete ) printf( "Error: %s has no checksums.\n", path );
+        free_manifest( manifest );
+        return 0;
+    }
+    qsort( manifest->lines, manifest->count, sizeof( struct ManifestLine ), compare_manifest_lines );
+    return 1;
+}
+
+/*
+ * Function    : prepare_hashes
+ * Parameters  : Options of get or mget and the manifest to verify against
+ * Returns     : 1 if the extraction can go ahead, 0 after printing an error
+ * Description : Loads the manifest of --verify and settles which checksum the copy computes. Without
+ *               --hash, verifying uses the algorithm of the manifest and --manifest uses sha256.
+ */
+int prepare_hashes( struct CopyOptions *options, struct Manifest *manifest )
+{
+    memset( manifest, 0, sizeof( struct Manifest ) );
+    if ( options->verify )
+    {
+        if ( !load_manifest( options->verify, manifest ) ) return 0;
+        if ( options->kind != HASH_NONE && options->kind != manifest->kind )
+        {
+            printf( "Error: %s was not made with the hash asked for.\n", options->verify );
+            free_manifest( manifest );
+            return 0;
+        }
+        options->kind = manifest->kind;
+    }
+    if ( options->manifest && options->kind == HASH_NONE ) options->kind = HASH_SHA256;
+    return 1;
+}
+
+/*
+ * Function    : compare_job_names
+ * Parameters  : Two extraction jobs
+ * Returns     : Order of their manifest names, for qsort
+ */
+int compare_job_names( const void *a, const void *b )
+{
+    return strcmp( ( ( const struct ExtractJob * )a )->name, ( ( const struct ExtractJob * )b )->name );
+}
+
+/*
+ * Function    : report_hashes
+ * Parameters  : Extracted files, their count, options of get or mget, and the manifest to verify against
+ * Description : Prints the checksums, writes them to the --manifest file, and checks them against the
+ *               --verify manifest. The manifest is freed. Jobs end up sorted by name.
+ */
+void report_hashes( struct ExtractJob *jobs, uint32_t count, struct CopyOptions *options, struct Manifest *manifest )
+{
+    uint32_t passed = 0, failed = 0, missing = 0, i;
+
+    if ( options->kind == HASH_NONE ) return;
+    qsort( jobs, count, sizeof( struct ExtractJob ), compare_job_names );
+
+    FILE *out = NULL;
+    if ( options->manifest && !( out = fopen( options->manifest, "w" ) ) )
+    {
+        printf( "Error: Could not create %s: %s\n", options->manifest, strerror( errno ) );
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        struct ManifestLine key = { "", ( char * )jobs[ i ].name };
+        struct ManifestLine *expected = NULL;
+
+        if ( jobs[ i ].digest[ 0 ] == '\0' ) // extract_file() printed why
+        {
+            if ( options->verify ) printf( "%s: FAILED open or read\n", jobs[ i ].name );
+            failed++;
+            continue;
+        }
+        if ( out ) fprintf( out, "%s  %s\n", jobs[ i ].digest, jobs[ i ].name );
+        if ( !options->verify )
+        {
+            if ( !options->manifest ) printf( "%s  %s\n", jobs[ i ].digest, jobs[ i ].name );
+            continue;
+        }
+
+        expected = ( struct ManifestLine * )bsearch( &key, manifest->lines, manifest->count, sizeof( struct ManifestLine ), compare_manifest_lines );
+        if ( !expected )
+        {
+            printf( "%s: not in manifest\n", jobs[ i ].name );
+            missing++;
+        }
+        else if ( strcmp( expected->digest, jobs[ i ].digest ) )
+        {
+            printf( "%s: FAILED\n", jobs[ i ].name );
+            failed++;
+        }
+        else
+        {
+            printf( "%s: OK\n", jobs[ i ].name );
+            passed++;
+        }
+    }
+
+    if ( out && fclose( out ) != 0 ) printf( "Error: Could not write %s: %s\n", options->manifest, strerror( errno ) );
+    if ( options->verify )
+    {
+        printf( "Verified %u files: %u OK, %u FAILED, %u not in manifest.\n", passed + failed + missing, passed, failed, missing );
+    }
+    free_manifest( manifest );
+}
+
+/*
+ * Function    : split_visit
+ * Parameters  : Split copy, worker, and piece
+ * Description : Copies one piece of the file to its place in the output with the worker's own buffer
+ */
+void split_visit( void *context, int worker, uint32_t item )
+{
+    struct SplitCopy *split = ( struct SplitCopy * )context;
+    struct SplitPiece *piece = &split->pieces[ item ];
+
+    uint64_t done = 0;
+    int error = 0;
+    if ( !__atomic_load_n( &split->error, __ATOMIC_RELAXED ) ) // Skipped once another piece failed
+    {
+        if ( !split->buffers[ worker ] ) split->buffers[ worker ] = ( uint8_t * )malloc( COPY_BUFFER_SIZE );
+        error = ENOMEM;
+        if ( split->buffers[ worker ] )
+        {
+            errno = 0;
+            done = copy_chain( split->f32, split->fp, piece->cluster, piece->size, split->fd, split->buffers[ worker ], COPY_BUFFER_SIZE, NULL, 1, piece->offset );
+            error = done < piece->size ? errno : 0; // 0 if the chain ended early
+        }
+    }
+    if ( error )
+    {
+        int expected = 0;
+        __atomic_compare_exchange_n( &split->error, &expected, error, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED );
+    }
+    __atomic_add_fetch( &split->copied, done, __ATOMIC_RELAXED );
+
+    // Everything from a piece that stopped short on is holes or garbage
+    uint64_t end = piece->offset + done, complete = __atomic_load_n( &split->complete, __ATOMIC_RELAXED );
+    while ( done < piece->size && end < complete &&
+            !__atomic_compare_exchange_n( &split->complete, &complete, end, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+        ;
+}
+
+/*
+ * Function    : extract_split
+ * Parameters  : Fat32 info structure, the fat32 image, the file to extract, the chunk size, and the
+ *               number of workers
+ * Returns     : 1 on success, 0 after printing an error
+ * Description : Extracts one large file with several workers. The chain is cut into chunks of whole
+ *               clusters, each worker reads its chunk with as few preads as the chain allows and
+ *               pwrites it at its own offset, so the image is read at several places at once. Like
+ *               extract_file(), all-zero clusters become holes. After a failure the file is cut at the
+ *               first byte that was not copied, so it never holds a hole in place of data. The target
+ *               must be a regular file.
+ */
+int extract_split( struct f32info *f32, FILE *fp, struct ExtractJob *job, uint64_t chunk, int workers )
+{
+    struct SplitCopy split;
+    uint64_t capacity = 0, offset = 0;
+    uint32_t bytes = cluster_size( f32 ), count = 0, cluster = job->cluster, i;
+
+    uint64_t clusters_per_chunk = ( chunk + bytes - 1 ) / bytes;
+    memset( &split, 0, sizeof( split ) );
+
+    // Find where each chunk starts by following the chain through the FAT in memory
+    while ( offset < job->size && cluster >= 2 )
+    {
+        if ( !grow_array( ( void ** )&split.pieces, &capacity, count + 1, sizeof( struct SplitPiece ) ) )
+        {
+            printf( "Error: Out of memory. \n" );
+            free( split.pieces );
+            return 0;
+        }
+        struct SplitPiece *piece = &split.pieces[ count++ ];
+        piece->offset = offset;
+        piece->cluster = cluster;
+        piece->size = job->size - offset < clusters_per_chunk * bytes ? job->size - offset : clusters_per_chunk * bytes;
+        offset += piece->size;
+        for ( uint64_t k = 0; k < clusters_per_chunk && cluster >= 2; k++ ) cluster = next_cluster( cluster );
+    }
+
+    split.fd = open( job->host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if ( split.fd < 0 )
+    {
+        printf( "Error: Could not create %s: %s\n", job->host_path, strerror( errno ) );
+        free( split.pieces );
+        return 0;
+    }
+    split.f32 = f32;
+    split.fp = fp;
+    split.complete = job->size;
+
+    parallel_for( count, workers, split_visit, &split );
+
+    int error = split.error;
+    if ( split.copied < job->size && split.complete == job->size ) split.complete = offset; // The chain ended before the last piece
+    if ( ftruncate( split.fd, split.complete ) != 0 && !error ) error = errno;
+    if ( close( split.fd ) != 0 && !error ) error = errno;
+    for ( i = 0; i < MAX_WORKERS; i++ ) free( split.buffers[ i ] );
+    free( split.pieces );
+
+    if ( split.copied < job->size )
+    {
+        printf( "Error: Copied %llu of %llu bytes of %s: %s\n", ( unsigned long long )split.complete,
+                ( unsigned long long )job->size, job->host_path, error ? strerror( error ) : "cluster chain too short" );
+        return 0;
+    }
+    if ( error )
+    {
+        printf( "Error: Could not write %s: %s\n", job->host_path, strerror( error ) );
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Function    : get
+ * Parameters  : User filename input, directory, fat32info, the current file pointer, and the copy options
+ * Description : Retrieves a file from the fat32 image and places it inside the current working directory.
+ *               A file of at least two chunks is copied by several workers, unless it is being hashed,
+ *               which needs the data in order, or goes to something other than a regular file, such
+ *               as a FIFO or a device, which can only be written in order.
+ */
+void get( char *filename, struct DirectoryEntry *dir, struct f32info *f32, FILE *fp, struct CopyOptions *options )
+{
+    struct ExtractJob job;
+    struct Manifest manifest;
+    int entry;
+
+    entry = find_file( filename, dir );
+
+    // File not found
+    if ( entry == -1 )
+    {
+        printf( "Error: File not found. \n" );
+        return;
+    }
+
+    uint8_t *buffer = ( uint8_t * )malloc( COPY_BUFFER_SIZE );
+    if ( !buffer || !load_fat( f32, fp ) )
+    {
+        printf( "Error: Out of memory. \n" );
+        free( buffer );
+        return;
+    }
+    if ( prepare_hashes( options, &manifest ) )
+    {
+        memset( &job, 0, sizeof( job ) );
+        job.cluster = first_cluster( &dir[ entry ] );
+        job.size = dir[ entry ].DIR_FileSize;
+        job.host_path = filename;
+        job.name = filename;
+
+        uint64_t chunk = options->chunk ? options->chunk : SPLIT_CHUNK_SIZE;
+        int workers = options->workers ? options->workers : worker_count();
+        struct stat host;
+        int regular = stat( filename, &host ) != 0 || S_ISREG( host.st_mode ); // A new file is a regular one
+        if ( options->kind == HASH_NONE && workers > 1 && job.size >= 2 * chunk && regular ) extract_split( f32, fp, &job, chunk, workers );
+        else extract_file( f32, fp, &job, buffer, COPY_BUFFER_SIZE, options->kind );
+        report_hashes( &job, 1, options, &manifest );
+    }
+    free( buffer );
+}
+
+/*
+ * Function    : mget
+ * Parameters  : Glob, optionally after a directory path, host directory (NULL for the current one),
+ *               fat32info, the current file pointer, and the checksum options
+ * Description : Extracts every file of a directory whose long or 8.3 name matches the glob. The
+ *               matches are collected first and read in the order they are stored on disk, by as
+ *               many workers as there are processors. The host directory is created if it is missing.
+ */
+void mget( char *pattern, char *destination, struct f32info *f32, FILE *fp, struct CopyOptions *options )
+{
+    struct DirectoryEntry target;
+    struct DirectoryWalk walk;
+    struct Extraction extraction;
+    struct Manifest manifest;
+    struct timespec start;
+    char name[ LFN_MAX_UNITS * 3 + 1 ];
+    char short_name[ 13 ];
+    char directory[ MAX_COMMAND_SIZE + 1 ];
+    uint64_t capacity = 0;
+    int count, i;
+
+    // Split "dir/sub/*.TXT" into the directory and the glob
+    snprintf( directory, sizeof( directory ), "%s", pattern );
+    char *slash = strrchr( directory, '/' );
+    char *glob = pattern + ( slash ? slash - directory + 1 : 0 );
+    if ( slash ) slash[ slash == directory ? 1 : 0 ] = '\0'; // Keep "/" for the root
+
+    if ( !resolve_path( slash ? directory : NULL, f32, fp, &target, NULL ) || !( target.DIR_Attr & 0x10 ) )
+    {
+        printf( "Error: Directory not found. \n" );
+        return;
+    }
+    if ( !destination ) destination = ".";
+
+    struct DirectoryEntry *entries = load_fat( f32, fp ) ? list_directory( first_cluster( &target ), f32, fp, &count ) : NULL;
+    if ( !entries )
+    {
+        printf( "Error: Could not read directory. \n" );
+        return;
+    }
+
+    memset( &extraction, 0, sizeof( extraction ) );
+    extraction.f32 = f32;
+    extraction.fp = fp;
+
+    walk_begin( &walk, entries, count, 0 );
+    while ( ( i = walk_next( &walk ) ) != -1 )
+    {
+        if ( entries[ i ].DIR_Attr & 0x10 ) continue;
+
+        format_short_name( entries[ i ].DIR_Name, short_name );
+        if ( walk.has_long_name ) utf16_to_utf8( walk.name.chars, walk.name.length, name, sizeof( name ) );
+        else strcpy( name, short_name );
+        if ( !glob_match( glob, name ) && !glob_match( glob, short_name ) ) continue;
+        host_name( name );
+
+        if ( !grow_array( ( void ** )&extraction.jobs, &capacity, extraction.count + 1, sizeof( struct ExtractJob ) ) ) break;
+        struct ExtractJob *job = &extraction.jobs[ extraction.count++ ];
+        job->cluster = first_cluster( &entries[ i ] );
+        job->size = entries[ i ].DIR_FileSize;
+        job->host_path = ( char * )malloc( strlen( destination ) + strlen( name ) + 2 );
+        if ( !job->host_path )
+        {
+            extraction.count--;
+            continue;
+        }
+        sprintf( job->host_path, "%s/%s", destination, name );
+        job->name = job->host_path + strlen( destination ) + 1;
+    }
+    free( entries );
+
+    // Like get -r, create the destination, before a manifest is opened
+    int created = extraction.count == 0 || mkdir( destination, 0755 ) == 0 || errno == EEXIST;
+    if ( !created ) printf( "Error: Could not create %s: %s\n", destination, strerror( errno ) );
+
+    if ( extraction.count == 0 || !created || !prepare_hashes( options, &manifest ) )
+    {
+        if ( extraction.count == 0 ) printf( "Error: No files match %s. \n", glob );
+        for ( i = 0; i < ( int )extraction.count; i++ ) free( extraction.jobs[ i ].host_path );
+        free( extraction.jobs );
+        return;
+    }
+    extraction.hash_kind = options->kind;
+
+    // Read in disk order, so the image is swept once from front to back
+    qsort( extraction.jobs, extraction.count, sizeof( struct ExtractJob ), compare_jobs );
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    parallel_for( extraction.count, options->workers ? options->workers : worker_count(), extract_visit, &extraction );
+    double seconds = elapsed_seconds( &start );
+
+    printf( "Extracted %u of %u files, %llu bytes in %.2f s (%.1f MB/s).\n", extraction.files, extraction.count,
+            ( unsigned long long )extraction.bytes, seconds, seconds > 0 ? extraction.bytes / seconds / 1e6 : 0.0 );
+    report_hashes( extraction.jobs, extraction.count, options, &manifest );
+
+    for ( i = 0; i < ( int )extraction.count; i++ ) free( extraction.jobs[ i ].host_path );
+    for ( i = 0; i < MAX_WORKERS; i++ ) free( extraction.buffers[ i ] );
+    free( extraction.jobs );
+}
+
+/*
+ * Function    : queue_push
+ * Parameters  : Copy queue and a job, whose host path the queue takes over
+ * Description : Adds a job, waiting while the queue is full so the walk never runs far ahead of the copying
+ */
+void queue_push( struct CopyQueue *queue, struct ExtractJob *job )
+{
+    pthread_mutex_lock( &queue->lock );
+    while ( queue->count == COPY_QUEUE_SIZE ) pthread_cond_wait( &queue->not_full, &queue->lock );
+    queue->jobs[ ( queue->head + queue->count++ ) % COPY_QUEUE_SIZE ] = *job;
+    pthread_cond_signal( &queue->not_empty );
+    pthread_mutex_unlock( &queue->lock );
+}
+
+/*
+ * Function    : queue_pop
+ * Parameters  : Copy queue and the job to fill in
+ * Returns     : 1 if a job was taken, 0 once the queue is closed and empty
+ */
+int queue_pop( struct CopyQueue *queue, struct ExtractJob *job )
+{
+    pthread_mutex_lock( &queue->lock );
+    while ( queue->count == 0 && !queue->closed ) pthread_cond_wait( &queue->not_empty, &queue->lock );
+
+    int taken = queue->count > 0;
+    if ( taken )
+    {
+        *job = queue->jobs[ queue->head ];
+        queue->head = ( queue->head + 1 ) % COPY_QUEUE_SIZE;
+        queue->count--;
+        pthread_cond_signal( &queue->not_full );
+    }
+    pthread_mutex_unlock( &queue->lock );
+    return taken;
+}
+
+/*
+ * Function    : queue_close
+ * Parameters  : Copy queue
+ * Description : Tells the workers no more jobs are coming
+ */
+void queue_close( struct CopyQueue *queue )
+{
+    pthread_mutex_lock( &queue->lock );
+    queue->closed = 1;
+    pthread_cond_broadcast( &queue->not_empty );
+    pthread_mutex_unlock( &queue->lock );
+}
+
+/*
+ * Function    : copy_worker
+ * Parameters  : Tree extraction
+ * Description : Extracts the files queued by the walk until the walk is over
+ */
+void *copy_worker( void *argument )
+{
+    struct TreeExtraction *tree = ( struct TreeExtraction * )argument;
+    struct ExtractJob job;
+    uint8_t *buffer = ( uint8_t * )malloc( COPY_BUFFER_SIZE );
+
+    while ( queue_pop( &tree->queue, &job ) )
+    {
+        if ( buffer && extract_file( tree->extraction.f32, tree->extraction.fp, &job, buffer, COPY_BUFFER_SIZE, HASH_NONE ) )
+        {
+            __atomic_add_fetch( &tree->extraction.files, 1, __ATOMIC_RELAXED );
+            __atomic_add_fetch( &tree->extraction.bytes, job.size, __ATOMIC_RELAXED );
+        }
+        else __atomic_add_fetch( &tree->errors, 1, __ATOMIC_RELAXED );
+        free( job.host_path );
+    }
+    free( buffer );
+
+    pthread_mutex_lock( &tree->queue.lock );
+    if ( --tree->running == 0 ) pthread_cond_broadcast( &tree->queue.finished );
+    pthread_mutex_unlock( &tree->queue.lock );
+    return NULL;
+}
+
+/*
+ * Function    : join_path
+ * Parameters  : Directory and name
+ * Returns     : "directory/name", allocated, or NULL if memory ran out
+ */
+char *join_path( const char *directory, const char *name )
+{
+    char *path = ( char * )malloc( strlen( directory ) + strlen( name ) + 2 );
+    if ( path ) sprintf( path, "%s/%s", directory, name );
+    return path;
+}
+
+/*
+ * Function    : tree_walker
+ * Parameters  : Tree extraction
+ * Description : Walks the image tree depth first, feeding files to the copy workers as it goes. The
+ *               sub-directories of a directory are created on the host together, relative to one
+ *               open descriptor of their parent, before any of its files are queued. A directory
+ *               whose cluster was walked already is a loop in a corrupted image and is skipped.
+ */
+void *tree_walker( void *argument )
+{
+    struct TreeExtraction *tree = ( struct TreeExtraction * )argument;
+    struct f32info *f32 = tree->extraction.f32;
+    struct DirectoryWalk walk;
+    char name[ LFN_MAX_UNITS * 3 + 1 ];
+    int count, i;
+
+    while ( tree->depth > 0 )
+    {
+        struct PendingDirectory directory = tree->pending[ --tree->depth ];
+        struct DirectoryEntry *entries = list_directory( directory.cluster, f32, tree->extraction.fp, &count );
+        int parent = open( directory.host_path, O_RDONLY | O_DIRECTORY );
+
+        if ( !entries || parent < 0 )
+        {
+            printf( "Error: Could not extract directory %s: %s\n", directory.host_path, entries ? strerror( errno ) : "unreadable" );
+            __atomic_add_fetch( &tree->errors, 1, __ATOMIC_RELAXED );
+        }
+
+        // Sub-directories first, in one batch
+        walk_begin( &walk, entries, entries && parent >= 0 ? count : 0, 0 );
+        while ( ( i = walk_next( &walk ) ) != -1 )
+        {
+            if ( !( entries[ i ].DIR_Attr & 0x10 ) || entries[ i ].DIR_Name[ 0 ] == '.' ) continue;
+
+            if ( walk.has_long_name ) utf16_to_utf8( walk.name.chars, walk.name.length, name, sizeof( name ) );
+            else format_short_name( entries[ i ].DIR_Name, name );
+            host_name( name );
+
+            uint32_t cluster = first_cluster( &entries[ i ] );
+            if ( cluster >= fat_entries || ( tree->visited[ cluster / 64 ] & ( 1ULL << ( cluster % 64 ) ) ) )
+            {
+                printf( "Error: Skipped %s/%s, it loops back to a directory above it. \n", directory.host_path, name );
+                __atomic_add_fetch( &tree->errors, 1, __ATOMIC_RELAXED );
+                continue;
+            }
+            tree->visited[ cluster / 64 ] |= 1ULL << ( cluster % 64 );
+
+            if ( mkdirat( parent, name, 0755 ) != 0 && errno != EEXIST )
+            {
+                printf( "Error: Could not create %s/%s: %s\n", directory.host_path, name, strerror( errno ) );
+                __atomic_add_fetch( &tree->errors, 1, __ATOMIC_RELAXED );
+                continue;
+            }
+            if ( !grow_array( ( void ** )&tree->pending, &tree->pending_capacity, tree->depth + 1, sizeof( struct PendingDirectory ) ) ) break;
+            tree->pending[ tree->depth ].cluster = cluster;
+            tree->pending[ tree->depth ].host_path = join_path( directory.host_path, name );
+            if ( tree->pending[ tree->depth ].host_path ) tree->depth++;
+            tree->directories++;
+        }
+
+        // Then the files
+        walk_begin( &walk, entries, entries && parent >= 0 ? count : 0, 0 );
+        while ( ( i = walk_next( &walk ) ) != -1 )
+        {
+            if ( entries[ i ].DIR_Attr & 0x10 ) continue;
+
+            if ( walk.has_long_name ) utf16_to_utf8( walk.name.chars, walk.name.length, name, sizeof( name ) );
+            else format_short_name( entries[ i ].DIR_Name, name );
+            host_name( name );
+
+            struct ExtractJob job;
+            job.cluster = first_cluster( &entries[ i ] );
+            job.size = entries[ i ].DIR_FileSize;
+            job.host_path = join_path( directory.host_path, name );
+            if ( job.host_path ) queue_push( &tree->queue, &job );
+        }
+
+        if ( parent >= 0 ) close( parent );
+        free( entries );
+        free( directory.host_path );
+    }
+
+    queue_close( &tree->queue );
+    return NULL;
+}
+
+/*
+ * Function    : get_recursive
+ * Parameters  : Directory path, host directory to create it as, fat32info, and the current file pointer
+ * Description : Extracts a directory with everything below it. One thread walks the directories while
+ *               the copy workers extract the files it finds, through a queue of fixed size, so memory
+ *               stays the same however many files there are. Progress is shown once a second.
+ */
+void get_recursive( char *path, char *destination, struct f32info *f32, FILE *fp )
+{
+    struct DirectoryEntry target;
+    struct TreeExtraction tree;
+    struct timespec start;
+    pthread_t walker, workers[ MAX_WORKERS ];
+    int i, started = 0;
+
+    if ( !resolve_path( path, f32, fp, &target, NULL ) )
+    {
+        printf( "Error: File not found. \n" );
+        return;
+    }
+    if ( !( target.DIR_Attr & 0x10 ) )
+    {
+        printf( "Error: Entry is not a directory. \n" );
+        return;
+    }
+    if ( mkdir( destination, 0755 ) != 0 && errno != EEXIST )
+    {
+        printf( "Error: Could not create %s: %s\n", destination, strerror( errno ) );
+        return;
+    }
+
+    memset( &tree, 0, sizeof( tree ) );
+    tree.extraction.f32 = f32;
+    tree.extraction.fp = fp;
+    pthread_mutex_init( &tree.queue.lock, NULL );
+    pthread_cond_init( &tree.queue.not_empty, NULL );
+    pthread_cond_init( &tree.queue.not_full, NULL );
+    pthread_cond_init( &tree.queue.finished, NULL );
+
+    if ( !load_fat( f32, fp ) || !grow_array( ( void ** )&tree.pending, &tree.pending_capacity, 1, sizeof( struct PendingDirectory ) ) ||
+         !( tree.visited = ( uint64_t * )calloc( ( fat_entries + 63 ) / 64, 8 ) ) || !( tree.pending[ 0 ].host_path = strdup( destination ) ) )
+    {
+        printf( "Error: Out of memory. \n" );
+        free( tree.pending );
+        free( tree.visited );
+        return;
+    }
+    tree.pending[ 0 ].cluster = first_cluster( &target );
+    if ( tree.pending[ 0 ].cluster < fat_entries ) tree.visited[ tree.pending[ 0 ].cluster / 64 ] |= 1ULL << ( tree.pending[ 0 ].cluster % 64 );
+    tree.depth = 1;
+    tree.directories = 1;
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    fflush( stdout );
+
+    int wanted = worker_count();
+    tree.running = wanted;
+    for ( i = 0; i < wanted; i++ )
+    {
+        if ( pthread_create( &workers[ started ], NULL, copy_worker, &tree ) == 0 ) started++;
+    }
+    pthread_mutex_lock( &tree.queue.lock );
+    tree.running -= i - started; // Those that did not start
+    pthread_mutex_unlock( &tree.queue.lock );
+
+    if ( started == 0 )
+    {
+        printf( "Error: Could not start worker threads. \n" );
+    }
+    else if ( pthread_create( &walker, NULL, tree_walker, &tree ) != 0 )
+    {
+        tree_walker( &tree ); // Walk here instead, the workers still copy as the queue fills
+    }
+    else
+    {
+        int progress = isatty( STDOUT_FILENO );
+        struct timespec deadline;
+        clock_gettime( CLOCK_REALTIME, &deadline );
+
+        pthread_mutex_lock( &tree.queue.lock );
+        while ( tree.running > 0 )
+        {
+            deadline.tv_sec++;
+            if ( pthread_cond_timedwait( &tree.queue.finished, &tree.queue.lock, &deadline ) != ETIMEDOUT || !progress ) continue;
+
+            double seconds = elapsed_seconds( &start );
+            uint64_t bytes = __atomic_load_n( &tree.extraction.bytes, __ATOMIC_RELAXED );
+            printf( "\r%u files, %llu bytes, %.1f MB/s ", __atomic_load_n( &tree.extraction.files, __ATOMIC_RELAXED ),
+                    ( unsigned long long )bytes, bytes / seconds / 1e6 );
+            fflush( stdout );
+        }
+        pthread_mutex_unlock( &tree.queue.lock );
+        pthread_join( walker, NULL );
+    }
+    for ( i = 0; i < started; i++ ) pthread_join( workers[ i ], NULL );
+
+    double seconds = elapsed_seconds( &start );
+    printf( "%sExtracted %u files in %u directories, %llu bytes in %.2f s (%.1f MB/s).", isatty( STDOUT_FILENO ) ? "\r" : "",
+            tree.extraction.files, tree.directories, ( unsigned long long )tree.extraction.bytes, seconds,
+            seconds > 0 ? tree.extraction.bytes / seconds / 1e6 : 0.0 );
+    if ( tree.errors ) printf( " %u failed.", tree.errors );
+    printf( "\n" );
+
+    while ( tree.depth > 0 ) free( tree.pending[ --tree.depth ].host_path );
+    free( tree.pending );
+    free( tree.visited );
+    pthread_mutex_destroy( &tree.queue.lock );
+    pthread_cond_destroy( &tree.queue.not_empty );
+    pthread_cond_destroy( &tree.queue.not_full );
+    pthread_cond_destroy( &tree.queue.finished );
+}
+
+/*
+ * Function    : splice_chain
+ * Parameters  : Fat32 info structure, the fat32 image, first cluster, number of bytes, and a pipe to write to
+ * Returns     : Number of bytes moved. It is 0 without errno set to EINVAL if the pipe or image does not
+ *               support splice, so the caller can copy instead.
+ * Description : Moves runs of consecutive clusters from the image into the pipe with splice, straight
+ *               from the page cache, so the data never passes through a user space buffer.
+ */
+uint64_t splice_chain( struct f32info *f32, FILE *fp, uint32_t cluster, uint64_t size, int pipe_fd )
+{
+    uint32_t bytes = cluster_size( f32 );
+    uint64_t done = 0;
+
+    fcntl( pipe_fd, F_SETPIPE_SZ, SPLICE_PIPE_SIZE ); // Fewer wake ups of the reader, best effort
+
+    while ( done < size && cluster >= 2 )
+    {
+        uint32_t first = cluster;
+        uint32_t run = chain_run( &cluster, ( size - done + bytes - 1 ) / bytes );
+        uint64_t want = ( uint64_t )run * bytes < size - done ? ( uint64_t )run * bytes : size - done;
+        loff_t offset = LBAToOffset( first, f32 );
+        uint64_t moved = 0;
+
+        while ( moved < want )
+        {
+            ssize_t n = splice( fileno( fp ), &offset, pipe_fd, NULL, want - moved, SPLICE_F_MORE | SPLICE_F_MOVE );
+            if ( n < 0 && errno == EINTR ) continue;
+            if ( n <= 0 ) return done + moved;
+            moved += n;
+        }
+        done += moved;
+    }
+    return done;
+}
+
+/*
+ * Function    : cat
+ * Parameters  : File path, fat32info, and the current file pointer
+ * Description : Writes the contents of a file to standard output. When that is a pipe, the file is
+ *               spliced into it, otherwise it is copied a run of clusters at a time.
+ */
+void cat( char *path, struct f32info *f32, FILE *fp )
+{
+    struct DirectoryEntry target;
+    struct stat output;
+
+    if ( !resolve_path( path, f32, fp, &target, NULL ) )
+    {
+        printf( "Error: File not found. \n" );
+        return;
+    }
+    if ( target.DIR_Attr & 0x10 )
+    {
+        printf( "Error: Entry is a directory. \n" );
+        return;
+    }
+    if ( !load_fat( f32, fp ) )
+    {
+        printf( "Error: Out of memory. \n" );
+        return;
+    }
+
+    fflush( stdout );
+    uint64_t size = target.DIR_FileSize, done = 0;
+    uint32_t cluster = first_cluster( &target );
+
+    int failed = 0;
+    if ( fstat( STDOUT_FILENO, &output ) == 0 && S_ISFIFO( output.st_mode ) )
+    {
+        errno = 0;
+        done = splice_chain( f32, fp, cluster, size, STDOUT_FILENO );
+        failed = done < size && errno != EINVAL; // A real failure, not a lack of support
+    }
+
+    // Copy whatever splice did not move, carrying on from where it stopped
+    if ( done < size && !failed )
+    {
+        uint32_t bytes = cluster_size( f32 );
+        uint8_t *buffer = ( uint8_t * )malloc( COPY_BUFFER_SIZE );
+        uint64_t skip;
+
+        errno = 0;
+        for ( skip = done / bytes; skip > 0 && cluster >= 2; skip-- ) cluster = next_cluster( cluster );
+        if ( buffer && done % bytes != 0 && cluster >= 2 ) // The rest of a cluster splice sent part of
+        {
+            uint64_t want = bytes - done % bytes < size - done ? bytes - done % bytes : size - done;
+            if ( read_at( fp, buffer, want, LBAToOffset( cluster, f32 ) + done % bytes ) == ( ssize_t )want && write_all( STDOUT_FILENO, buffer, want ) )
+            {
+                done += want;
+                cluster = next_cluster( cluster );
+            }
+        }
+        if ( buffer && done % bytes == 0 )
+        {
+            done += copy_chain( f32, fp, cluster, size - done, STDOUT_FILENO, buffer, COPY_BUFFER_SIZE, NULL, 0, 0 );
+        }
+        free( buffer );
+    }
+
+    if ( done != size ) fprintf( stderr, "Error: Wrote %llu of %llu bytes: %s\n", ( unsigned long long )done, ( unsigned long long )size,
+                                 errno ? strerror( errno ) : "cluster chain too short" );
+}
+
+/*
+ * Function    : fill_buffer
+ * Parameters  : Fat32 info structure, the fat32 image, cluster to continue from (updated), bytes left in
+ *               the file, and a buffer with its size, a multiple of the cluster size
+ * Returns     : Number of bytes read, 0 if the chain ended early or a read failed
+ * Description : Reads as much of a chain as fits in the buffer, one pread per run of consecutive clusters
+ */
+size_t fill_buffer( struct f32info *f32, FILE *fp, uint32_t *cluster, uint64_t left, uint8_t *buffer, size_t buffer_size )
+{
+    uint32_t bytes = cluster_size( f32 );
+    size_t filled = 0;
+
+    while ( filled < buffer_size && filled < left && *cluster >= 2 )
+    {
+        uint32_t first = *cluster;
+        uint64_t wanted = left - filled < buffer_size - filled ? left - filled : buffer_size - filled;
+        uint32_t run = chain_run( cluster, ( wanted + bytes - 1 ) / bytes );
+        size_t length = ( uint64_t )run * bytes < wanted ? ( uint64_t )run * bytes : wanted;
+
+        if ( read_at( fp, buffer + filled, length, LBAToOffset( first, f32 ) ) != ( ssize_t )length ) return 0;
+        filled += length;
+    }
+    return filled < left && filled < buffer_size ? 0 : filled;
+}
+
+/*
+ * Function    : prefetch_worker
+ * Parameters  : Prefetcher
+ * Description : Reads each requested file into the two buffers in turn, so the next piece of a file is
+ *               read while the one before it is written out. A piece of length 0 reports a short file.
+ */
+void *prefetch_worker( void *argument )
+{
+    struct Prefetcher *prefetcher = ( struct Prefetcher * )argument;
+    int slot = 0;
+
+    pthread_mutex_lock( &prefetcher->lock );
+    while ( 1 )
+    {
+        while ( !prefetcher->requested && !prefetcher->quit ) pthread_cond_wait( &prefetcher->changed, &prefetcher->lock );
+        if ( prefetcher->quit ) break;
+        prefetcher->requested = 0;
+
+        uint32_t cluster = prefetcher->cluster;
+        uint64_t left = prefetcher->size;
+        while ( left > 0 )
+        {
+            while ( prefetcher->length[ slot ] != PREFETCH_EMPTY && !prefetcher->quit ) pthread_cond_wait( &prefetcher->changed, &prefetcher->lock );
+            if ( prefetcher->quit ) break;
+            pthread_mutex_unlock( &prefetcher->lock );
+
+            size_t length = fill_buffer( prefetcher->f32, prefetcher->fp, &cluster, left, prefetcher->data[ slot ], COPY_BUFFER_SIZE );
+
+            pthread_mutex_lock( &prefetcher->lock );
+            prefetcher->length[ slot ] = length;
+            pthread_cond_broadcast( &prefetcher->changed );
+            slot ^= 1;
+            left = length ? left - length : 0;
+        }
+    }
+    pthread_mutex_unlock( &prefetcher->lock );
+    return NULL;
+}
+
+/*
+ * Function    : prefetch_start
+ * Parameters  : Prefetcher, fat32 info structure, and the fat32 image
+ * Returns     : 1 on success, 0 if the buffers or the thread could not be had
+ */
+int prefetch_start( struct Prefetcher *prefetcher, struct f32info *f32, FILE *fp )
+{
+    memset( prefetcher, 0, sizeof( struct Prefetcher ) );
+    prefetcher->f32 = f32;
+    prefetcher->fp = fp;
+    prefetcher->length[ 0 ] = prefetcher->length[ 1 ] = PREFETCH_EMPTY;
+    prefetcher->data[ 0 ] = ( uint8_t * )malloc( COPY_BUFFER_SIZE );
+    prefetcher->data[ 1 ] = ( uint8_t * )malloc( COPY_BUFFER_SIZE );
+    pthread_mutex_init( &prefetcher->lock, NULL );
+    pthread_cond_init( &prefetcher->changed, NULL );
+
+    if ( !prefetcher->data[ 0 ] || !prefetcher->data[ 1 ] || pthread_create( &prefetcher->thread, NULL, prefetch_worker, prefetcher ) != 0 )
+    {
+        free( prefetcher->data[ 0 ] );
+        free( prefetcher->data[ 1 ] );
+        pthread_mutex_destroy( &prefetcher->lock );
+        pthread_cond_destroy( &prefetcher->changed );
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Function    : prefetch_file
+ * Parameters  : Prefetcher, first cluster, and size of the file to read next
+ */
+void prefetch_file( struct Prefetcher *prefetcher, uint32_t cluster, uint64_t size )
+{
+    pthread_mutex_lock( &prefetcher->lock );
+    prefetcher->cluster = cluster;
+    prefetcher->size = size;
+    prefetcher->requested = 1;
+    pthread_cond_broadcast( &prefetcher->changed );
+    pthread_mutex_unlock( &prefetcher->lock );
+}
+
+/*
+ * Function    : prefetch_take
+ * Parameters  : Prefetcher and the length of the piece, set to 0 for a short file
+ * Returns     : The next piece of the requested file. It stays valid until prefetch_release().
+ */
+const uint8_t *prefetch_take( struct Prefetcher *prefetcher, size_t *length )
+{
+    pthread_mutex_lock( &prefetcher->lock );
+    while ( prefetcher->length[ prefetcher->slot ] == PREFETCH_EMPTY ) pthread_cond_wait( &prefetcher->changed, &prefetcher->lock );
+    *length = prefetcher->length[ prefetcher->slot ];
+    pthread_mutex_unlock( &prefetcher->lock );
+    return prefetcher->data[ prefetcher->slot ];
+}
+
+/*
+ * Function    : prefetch_release
+ * Parameters  : Prefetcher
+ * Description : Hands the piece last taken back to be filled again
+ */
+void prefetch_release( struct Prefetcher *prefetcher )
+{
+    pthread_mutex_lock( &prefetcher->lock );
+    prefetcher->length[ prefetcher->slot ] = PREFETCH_EMPTY;
+    prefetcher->slot ^= 1;
+    pthread_cond_broadcast( &prefetcher->changed );
+    pthread_mutex_unlock( &prefetcher->lock );
+}
+
+/*
+ * Function    : prefetch_stop
+ * Parameters  : Prefetcher
+ */
+void prefetch_stop( struct Prefetcher *prefetcher )
+{
+    pthread_mutex_lock( &prefetcher->lock );
+    prefetcher->quit = 1;
+    pthread_cond_broadcast( &prefetcher->changed );
+    pthread_mutex_unlock( &prefetcher->lock );
+
+    pthread_join( prefetcher->thread, NULL );
+    free( prefetcher->data[ 0 ] );
+    free( prefetcher->data[ 1 ] );
+    pthread_mutex_destroy( &prefetcher->lock );
+    pthread_cond_destroy( &prefetcher->changed );
+}
+
+/*
+ * Function    : fat_time
+ * Parameters  : Directory entry
+ * Returns     : Last write time of the entry in seconds since the epoch, taking FAT time as local time
+ */
+time_t fat_time( const struct DirectoryEntry *entry )
+{
+    uint16_t time = entry->Unused2[ 0 ] | ( entry->Unused2[ 1 ] << 8 );
+    uint16_t date = entry->Unused2[ 2 ] | ( entry->Unused2[ 3 ] << 8 );
+    struct tm local;
+
+    if ( date == 0 ) return 0;
+    memset( &local, 0, sizeof( local ) );
+    local.tm_year = ( date >> 9 ) + 80;
+    local.tm_mon = ( ( date >> 5 ) & 0x0f ) - 1;
+    local.tm_mday = date & 0x1f;
+    local.tm_hour = time >> 11;
+    local.tm_min = ( time >> 5 ) & 0x3f;
+    local.tm_sec = ( time & 0x1f ) * 2;
+    local.tm_isdst = -1;
+
+    time_t seconds = mktime( &local );
+    return seconds < 0 ? 0 : seconds;
+}
+
+/*
+ * Function    : tar_data
+ * Parameters  : Tar stream, data, and number of bytes
+ */
+void tar_data( struct TarStream *tar, const void *data, size_t size )
+{
+    out_write( &tar->out, data, size );
+    tar->written += size;
+}
+
+/*
+ * Function    : tar_pad
+ * Parameters  : Tar stream and the size of the member just written
+ * Description : Pads the member to a whole number of blocks
+ */
+void tar_pad( struct TarStream *tar, uint64_t size )
+{
+    static const uint8_t zeros[ TAR_BLOCK ];
+    if ( size % TAR_BLOCK ) tar_data( tar, zeros, TAR_BLOCK - size % TAR_BLOCK );
+}
+
+/*
+ * Function    : tar_header
+ * Parameters  : Tar stream, path in the archive, type flag, size, mode, and modification time
+ * Description : Writes a ustar header. A path that does not fit the 100 byte name field is split into
+ *               the 155 byte prefix field at a '/', and failing that is carried by a pax extended header
+ *               in front of the ustar one.
+ */
+void tar_header( struct TarStream *tar, const char *path, char type, uint64_t size, unsigned mode, time_t mtime )
+{
+    uint8_t block[ TAR_BLOCK ];
+    size_t length = strlen( path ), split = 0;
+    unsigned sum = 0;
+    int i;
+
+    if ( length > 100 )
+    {
+        // Last '/' that leaves at most 100 bytes for the name
+        for ( split = length - 1; split > 0 && ( path[ split ] != '/' || length - split - 1 > 100 ); split-- )
+            ;
+        if ( split == 0 || split > 155 || split == length - 1 )
+        {
+            int digits = snprintf( NULL, 0, "%zu", length + 7 );
+            size_t total = length + 7 + digits;
+            if ( snprintf( NULL, 0, "%zu", total ) != digits ) total++; // The length counts its own digits
+            char *record = ( char * )malloc( total + 1 );
+            if ( !record )
+            {
+                fprintf( stderr, "Error: Out of memory for the name of %.100s..., it is cut short.\n", path );
+                tar->errors++;
+            }
+            else
+            {
+                snprintf( record, total + 1, "%zu path=%s\n", total, path );
+
+                char pax_name[ 101 ];
+                snprintf( pax_name, sizeof( pax_name ), "PaxHeader/%.90s", path + length - ( length < 90 ? length : 90 ) );
+                tar_header( tar, pax_name, 'x', total, 0644, mtime );
+                tar_data( tar, record, total );
+                tar_pad( tar, total );
+                free( record );
+            }
+            split = 0;
+            length = length > 100 ? 100 : length; // Truncated name for readers without pax
+        }
+    }
+
+    memset( block, 0, sizeof( block ) );
+    if ( split )
+    {
+        memcpy( block + 345, path, split ); // prefix
+        memcpy( block, path + split + 1, length - split - 1 );
+    }
+    else memcpy( block, path + ( strlen( path ) - length ), length );
+
+    snprintf( ( char * )block + 100, 8, "%07o", mode & 07777 );
+    snprintf( ( char * )block + 108, 8, "%07o", 0 );
+    snprintf( ( char * )block + 116, 8, "%07o", 0 );
+    snprintf( ( char * )block + 124, 12, "%011llo", ( unsigned long long )size );
+    snprintf( ( char * )block + 136, 12, "%011llo", ( unsigned long long )mtime );
+    block[ 156 ] = type;
+    memcpy( block + 257, "ustar", 6 );
+    memcpy( block + 263, "00", 2 );
+
+    memset( block + 148, ' ', 8 );
+    for ( i = 0; i < TAR_BLOCK; i++ ) sum += block[ i ];
+    snprintf( ( char * )block + 148, 8, "%06o", sum );
+    block[ 155 ] = ' ';
+
+    tar_data( tar, block, TAR_BLOCK );
+}
+
+/*
+ * Function    : tar_file
+ * Parameters  : Tar stream, path in the archive, and the directory entry of the file
+ * Description : Writes a file member. Its data comes from the prefetcher while the next piece is read.
+ *               If the chain is shorter than the size, the rest is filled with zeros so the archive stays
+ *               well formed.
+ */
+void tar_file( struct TarStream *tar, const char *path, struct DirectoryEntry *entry )
+{
+    static const uint8_t zeros[ TAR_BLOCK ];
+    uint64_t size = entry->DIR_FileSize, done = 0;
+
+    tar_header( tar, path, '0', size, ( entry->DIR_Attr & 0x01 ) ? 0444 : 0644, fat_time( entry ) );
+    if ( size > 0 ) prefetch_file( &tar->prefetcher, first_cluster( entry ), size );
+
+    while ( done < size )
+    {
+        size_t length;
+        const uint8_t *data = prefetch_take( &tar->prefetcher, &length );
+        if ( length == 0 )
+        {
+            prefetch_release( &tar->prefetcher );
+            fprintf( stderr, "Error: %s is damaged, filled with zeros after %llu bytes.\n", path, ( unsigned long long )done );
+            tar->errors++;
+            for ( ; done < size; done += length )
+            {
+                length = size - done < TAR_BLOCK ? size - done : TAR_BLOCK;
+                tar_data( tar, zeros, length );
+            }
+            break;
+        }
+        tar_data( tar, data, length );
+        prefetch_release( &tar->prefetcher );
+        done += length;
+    }
+    tar_pad( tar, size );
+    tar->files++;
+}
+
+/*
+ * Function    : tar_command
+ * Parameters  : Path to archive, output file or "-" for standard output, fat32info, and the current file pointer
+ * Description : Writes a file or a directory with everything below it as a tar stream, straight from
+ *               the image. Members come in depth first order, each directory before its contents.
+ *               A directory whose cluster was archived already is a loop in a corrupted image and
+ *               is skipped.
+ */
+void tar_command( char *path, char *output, struct f32info *f32, FILE *fp )
+{
+    struct DirectoryEntry target;
+    struct LongName long_name;
+    struct TarStream tar;
+    struct DirectoryWalk walk;
+    char name[ LFN_MAX_UNITS * 3 + 1 ];
+    struct PendingDirectory *pending = NULL;
+    uint64_t *visited = NULL; // one bit per cluster, guards against directory loops
+    uint64_t depth = 0, capacity = 0;
+    int fd, count, i;
+
+    if ( !resolve_path( path, f32, fp, &target, &long_name ) )
+    {
+        printf( "Error: File not found. \n" );
+        return;
+    }
+    if ( !load_fat( f32, fp ) || !( visited = ( uint64_t * )calloc( ( fat_entries + 63 ) / 64, 8 ) ) )
+    {
+        printf( "Error: Out of memory. \n" );
+        return;
+    }
+
+    fd = strcmp( output, "-" ) ? open( output, O_WRONLY | O_CREAT | O_TRUNC, 0644 ) : STDOUT_FILENO;
+    if ( fd < 0 )
+    {
+        printf( "Error: Could not create %s: %s\n", output, strerror( errno ) );
+        free( visited );
+        return;
+    }
+
+    memset( &tar, 0, sizeof( tar ) );
+    if ( !prefetch_start( &tar.prefetcher, f32, fp ) )
+    {
+        printf( "Error: Could not start the reader thread. \n" );
+        if ( fd != STDOUT_FILENO ) close( fd );
+        free( visited );
+        return;
+    }
+    out_open( &tar.out, fd );
+
+    // Name of the top member, empty for the root so its contents are at the top of the archive
+    if ( long_name.valid ) utf16_to_utf8( long_name.chars, long_name.length, name, sizeof( name ) );
+    else if ( target.DIR_Name[ 0 ] != ' ' ) format_short_name( target.DIR_Name, name );
+    else name[ 0 ] = '\0';
+    if ( !strcmp( name, "." ) || !strcmp( name, ".." ) ) name[ 0 ] = '\0';
+
+    if ( !( target.DIR_Attr & 0x10 ) )
+    {
+        tar_file( &tar, name, &target );
+    }
+    else if ( grow_array( ( void ** )&pending, &capacity, 1, sizeof( struct PendingDirectory ) ) )
+    {
+        pending[ depth ].cluster = first_cluster( &target );
+        pending[ depth ].host_path = strdup( name );
+        if ( pending[ depth ].host_path ) depth++;
+        if ( pending[ 0 ].cluster < fat_entries ) visited[ pending[ 0 ].cluster / 64 ] |= 1ULL << ( pending[ 0 ].cluster % 64 );
+        if ( name[ 0 ] ) tar_header( &tar, strcat( name, "/" ), '5', 0, 0755, fat_time( &target ) );
+    }
+
+    while ( depth > 0 )
+    {
+        struct PendingDirectory directory = pending[ --depth ];
+        struct DirectoryEntry *entries = list_directory( directory.cluster, f32, fp, &count );
+        uint64_t first_child = depth;
+
+        walk_begin( &walk, entries, entries ? count : 0, 0 );
+        while ( ( i = walk_next( &walk ) ) != -1 )
+        {
+            if ( entries[ i ].DIR_Name[ 0 ] == '.' ) continue; // "." and ".."
+
+            if ( walk.has_long_name ) utf16_to_utf8( walk.name.chars, walk.name.length, name, sizeof( name ) );
+            else format_short_name( entries[ i ].DIR_Name, name );
+
+            // Any length, a path that does not fit the header goes in a pax record whole
+            char *member = ( char * )malloc( strlen( directory.host_path ) + strlen( name ) + 3 );
+            if ( !member )
+            {
+                fprintf( stderr, "Error: Out of memory, %s/%s left out.\n", directory.host_path, name );
+                tar.errors++;
+                continue;
+            }
+            sprintf( member, "%s%s%s", directory.host_path, directory.host_path[ 0 ] ? "/" : "", name );
+
+            if ( !( entries[ i ].DIR_Attr & 0x10 ) )
+            {
+                tar_file( &tar, member, &entries[ i ] );
+                free( member );
+                continue;
+            }
+
+            uint32_t cluster = first_cluster( &entries[ i ] );
+            if ( cluster >= fat_entries || ( visited[ cluster / 64 ] & ( 1ULL << ( cluster % 64 ) ) ) )
+            {
+                fprintf( stderr, "Error: Skipped %s, it loops back to a directory above it.\n", member );
+                tar.errors++;
+                free( member );
+                continue;
+            }
+            visited[ cluster / 64 ] |= 1ULL << ( cluster % 64 );
+
+            tar_header( &tar, strcat( member, "/" ), '5', 0, 0755, fat_time( &entries[ i ] ) );
+            member[ strlen( member ) - 1 ] = '\0';
+            if ( !grow_array( ( void ** )&pending, &capacity, depth + 1, sizeof( struct PendingDirectory ) ) )
+            {
+                free( member );
+                break;
+            }
+            pending[ depth ].cluster = cluster;
+            pending[ depth ].host_path = member;
+            depth++;
+        }
+
+        // Sub-directories were pushed in order, reverse them so the first is walked first
+        uint64_t low = first_child, high = depth;
+        while ( high > low + 1 )
+        {
+            struct PendingDirectory swap = pending[ low ];
+            pending[ low++ ] = pending[ --high ];
+            pending[ high ] = swap;
+        }
+
+        free( entries );
+        free( directory.host_path );
+    }
+    while ( depth > 0 ) free( pending[ --depth ].host_path );
+    free( pending );
+    free( visited );
+
+    // End of archive, then fill the last record like tar does
+    uint8_t zeros[ TAR_BLOCK ];
+    memset( zeros, 0, sizeof( zeros ) );
+    tar_data( &tar, zeros, TAR_BLOCK );
+    tar_data( &tar, zeros, TAR_BLOCK );
+    while ( tar.written % TAR_RECORD ) tar_data( &tar, zeros, TAR_BLOCK );
+
+    prefetch_stop( &tar.prefetcher );
+    int written = out_close( &tar.out );
+    if ( fd != STDOUT_FILENO && close( fd ) != 0 ) written = 0;
+
+    if ( !written ) printf( "Error: Could not write %s: %s\n", output, strerror( errno ) );
+    else if ( fd != STDOUT_FILENO )
+    {
+        printf( "Archived %u files, %llu bytes to %s.", tar.files, ( unsigned long long )tar.written, output );
+        if ( tar.errors ) printf( " %u damaged or left out.", tar.errors );
+        printf( "\n" );
+    }
+}
+
+/*
+ * Function    : hashsum_visit
+ * Parameters  : Work pool, worker, and the tree node of a directory
+ * Description : Collects the files of one directory as jobs, named by their path below the top
+ *               directory, and queues the sub-directories
+ */
+void hashsum_visit( struct WorkPool *pool, int worker, uint32_t id )
+{
+    struct HashSum *sum = ( struct HashSum * )pool->context;
+    struct DirectoryTree *tree = &sum->tree;
+    struct TreeNode *node = tree_node( tree, id );
+    struct DirectoryWalk walk;
+    char name[ LFN_MAX_UNITS * 3 + 1 ];
+    int count, i;
+
+    struct DirectoryEntry *entries = list_directory( node->cluster, tree->f32, tree->fp, &count );
+    if ( entries )
+    {
+        walk_begin( &walk, entries, count, 0 );
+        while ( ( i = walk_next( &walk ) ) != -1 )
+        {
+            if ( entries[ i ].DIR_Name[ 0 ] == '.' ) continue; // "." and ".."
+
+            if ( walk.has_long_name ) utf16_to_utf8( walk.name.chars, walk.name.length, name, sizeof( name ) );
+            else format_short_name( entries[ i ].DIR_Name, name );
+
+            if ( entries[ i ].DIR_Attr & 0x10 )
+            {
+                uint32_t child = tree_add_child( tree, node, first_cluster( &entries[ i ] ), name );
+                if ( child != INDEX_NONE ) pool_push( pool, worker, child );
+                continue;
+            }
+
+            char *path = node->path[ 0 ] ? join_path( node->path, name ) : strdup( name );
+            pthread_mutex_lock( &sum->lock );
+            if ( path && grow_array( ( void ** )&sum->extraction.jobs, &sum->capacity, sum->extraction.count + 1, sizeof( struct ExtractJob ) ) )
+            {
+                struct ExtractJob *job = &sum->extraction.jobs[ sum->extraction.count++ ];
+                memset( job, 0, sizeof( struct ExtractJob ) );
+                job->cluster = first_cluster( &entries[ i ] );
+                job->size = entries[ i ].DIR_FileSize;
+                job->host_path = path;
+                job->name = path[ 0 ] == '/' ? path + 1 : path; // Sub-directories of "" start with '/'
+                path = NULL;
+            }
+            else sum->errors++;
+            pthread_mutex_unlock( &sum->lock );
+            free( path );
+        }
+        free( entries );
+    }
+    else __atomic_add_fetch( &sum->errors, 1, __ATOMIC_RELAXED );
+    tree_done( tree, node );
+}
+
+/*
+ * Function    : hash_visit
+ * Parameters  : Hash run, worker, and job
+ * Description : Hashes one file straight from the image with the worker's own buffer and writes
+ *               its manifest line. Output is flushed every so often, so lines appear as files complete.
+ */
+void hash_visit( void *context, int worker, uint32_t item )
+{
+    struct HashSum *sum = ( struct HashSum * )context;
+    struct Extraction *extraction = &sum->extraction;
+    struct ExtractJob *job = &extraction->jobs[ item ];
+    struct Hasher hasher;
+    char line[ PATH_MAX + HASH_HEX_SIZE + 4 ];
+
+    if ( !extraction->buffers[ worker ] ) extraction->buffers[ worker ] = ( uint8_t * )malloc( COPY_BUFFER_SIZE );
+    if ( !extraction->buffers[ worker ] )
+    {
+        fprintf( stderr, "Error: Out of memory. \n" );
+        __atomic_add_fetch( &sum->errors, 1, __ATOMIC_RELAXED );
+        return;
+    }
+
+    hasher_init( &hasher, extraction->hash_kind );
+    uint64_t done = copy_chain( extraction->f32, extraction->fp, job->cluster, job->size, -1, extraction->buffers[ worker ], COPY_BUFFER_SIZE, &hasher, 0, 0 );
+    if ( done < job->size )
+    {
+        fprintf( stderr, "Error: Read %llu of %llu bytes of %s. \n", ( unsigned long long )done, ( unsigned long long )job->size, job->name );
+        __atomic_add_fetch( &sum->errors, 1, __ATOMIC_RELAXED );
+        return;
+    }
+    hasher_final( &hasher, job->digest );
+    int n = snprintf( line, sizeof( line ), "%s  %s\n", job->digest, job->name );
+
+    pthread_mutex_lock( &sum->lock );
+    out_write( &sum->out, line, n < ( int )sizeof( line ) ? n : ( int )sizeof( line ) - 1 );
+    extraction->files++;
+    extraction->bytes += job->size;
+    if ( elapsed_seconds( &sum->flushed ) > 0.1 )
+    {
+        out_flush( &sum->out );
+        clock_gettime( CLOCK_MONOTONIC, &sum->flushed );
+    }
+    pthread_mutex_unlock( &sum->lock );
+}
+
+/*
+ * Function    : hashsum
+ * Parameters  : Directory or file path (NULL for the working directory), fat32info, the current file
+ *               pointer, and the checksum options
+ * Description : Prints a checksum of every file below a directory, in the format of sha256sum, without
+ *               extracting anything. Paths are relative to the directory, so "sha256sum -c" can check
+ *               a copy of it. The tree is walked first, then the files are hashed in the order they
+ *               are stored on disk by as many workers as there are processors. Lines come out in the
+ *               order files complete; --manifest writes them to a file instead.
+ */
+void hashsum( char *path, struct f32info *f32, FILE *fp, struct CopyOptions *options )
+{
+    struct DirectoryEntry target;
+    struct LongName long_name;
+    struct HashSum sum;
+    struct timespec start;
+    char name[ LFN_MAX_UNITS * 3 + 1 ];
+    uint32_t i;
+
+    if ( options->verify )
+    {
+        printf( "Error: hashsum writes manifests, use mget --verify to check one.\n" );
+        return;
+    }
+    if ( options->kind == HASH_NONE ) options->kind = HASH_SHA256;
+
+    if ( !resolve_path( path, f32, fp, &target, &long_name ) )
+    {
+        printf( "Error: File not found. \n" );
+        return;
+    }
+
+    memset( &sum, 0, sizeof( sum ) );
+    if ( !load_fat( f32, fp ) || !tree_init( &sum.tree, f32, fp ) )
+    {
+        printf( "Error: Out of memory. \n" );
+        tree_free( &sum.tree );
+        return;
+    }
+    pthread_mutex_init( &sum.lock, NULL );
+    sum.extraction.f32 = f32;
+    sum.extraction.fp = fp;
+    sum.extraction.hash_kind = options->kind;
+
+    int fd = options->manifest ? open( options->manifest, O_WRONLY | O_CREAT | O_TRUNC, 0644 ) : STDOUT_FILENO;
+    if ( fd < 0 ) printf( "Error: Could not create %s: %s\n", options->manifest, strerror( errno ) );
+    else out_open( &sum.out, fd );
+
+    if ( fd < 0 )
+        ;
+    else if ( target.DIR_Attr & 0x10 )
+    {
+        // The walk only collects files, there is no text to merge into the output
+        if ( !walk_tree( &sum.tree, first_cluster( &target ), "", hashsum_visit, &sum, &sum.out ) )
+        {
+            printf( "Error: Could not start worker threads. \n" );
+        }
+    }
+    else if ( grow_array( ( void ** )&sum.extraction.jobs, &sum.capacity, 1, sizeof( struct ExtractJob ) ) )
+    {
+        if ( long_name.valid ) utf16_to_utf8( long_name.chars, long_name.length, name, sizeof( name ) );
+        else format_short_name( target.DIR_Name, name );
+
+        struct ExtractJob *job = &sum.extraction.jobs[ sum.extraction.count++ ];
+        memset( job, 0, sizeof( struct ExtractJob ) );
+        job->cluster = first_cluster( &target );
+        job->size = target.DIR_FileSize;
+        job->host_path = strdup( name );
+        job->name = job->host_path ? job->host_path : "";
+    }
+
+    if ( fd >= 0 )
+    {
+        // Read in disk order, so the image is swept once from front to back
+        qsort( sum.extraction.jobs, sum.extraction.count, sizeof( struct ExtractJob ), compare_jobs );
+
+        clock_gettime( CLOCK_MONOTONIC, &start );
+        sum.flushed = start;
+        parallel_for( sum.extraction.count, options->workers ? options->workers : worker_count(), hash_visit, &sum );
+        double seconds = elapsed_seconds( &start );
+        out_close( &sum.out );
+
+        if ( options->manifest )
+        {
+            int closed = close( fd ) == 0; // Closed whether or not the writes failed
+            if ( sum.out.failed || !closed ) printf( "Error: Could not write %s: %s\n", options->manifest, strerror( errno ) );
+            printf( "Hashed %u of %u files, %llu bytes in %.2f s (%.1f MB/s).\n", sum.extraction.files, sum.extraction.count,
+                    ( unsigned long long )sum.extraction.bytes, seconds, seconds > 0 ? sum.extraction.bytes / seconds / 1e6 : 0.0 );
+        }
+        if ( sum.errors > 0 ) fprintf( stderr, "Error: %u files or directories could not be read. \n", sum.errors );
+    }
+
+    for ( i = 0; i < sum.extraction.count; i++ ) free( sum.extraction.jobs[ i ].host_path );
+    for ( i = 0; i < MAX_WORKERS; i++ ) free( sum.extraction.buffers[ i ] );
+    free( sum.extraction.jobs );
+    pthread_mutex_destroy( &sum.lock );
+    tree_free( &sum.tree );
+}
+
+static uint16_t hex_pairs[ 256 ];     // two lowercase hex digits of each byte, in memory order
+static char hex_tokens[ 256 ][ 4 ];   // "%x " of each byte
+static uint16_t base64_pairs[ 4096 ]; // two base64 characters of each 12-bit value
+static pthread_once_t format_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Function    : format_init_tables
+ * Parameters  : None
+ * Description : Builds the lookup tables of the read output formats
+ */
+static void format_init_tables()
+{
+    static const char digits[] = "0123456789abcdef";
+    static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int i;
+
+    for ( i = 0; i < 256; i++ )
+    {
+        char pair[ 2 ] = { digits[ i >> 4 ], digits[ i & 15 ] };
+        memcpy( &hex_pairs[ i ], pair, 2 );
+        snprintf( hex_tokens[ i ], sizeof( hex_tokens[ i ] ), "%x ", i );
+    }
+    for ( i = 0; i < 4096; i++ )
+    {
+        char pair[ 2 ] = { base64[ i >> 6 ], base64[ i & 63 ] };
+        memcpy( &base64_pairs[ i ], pair, 2 );
+    }
+}
+
+/*
+ * Function    : format_hex
+ * Parameters  : Read output, data, and number of bytes
+ * Description : Writes every byte as "%x ", the original output of read, through a table of the
+ *               2 or 3 character token of each byte
+ */
+void format_hex( struct ReadOutput *output, const uint8_t *data, size_t size )
+{
+    char text[ 3 * 4096 + 4 ];
+
+    while ( size > 0 )
+    {
+        size_t n = size < 4096 ? size : 4096, used = 0, i;
+        for ( i = 0; i < n; i++ )
+        {
+            memcpy( text + used, hex_tokens[ data[ i ] ], 4 ); // Copies the terminator too, overwritten next
+            used += data[ i ] < 16 ? 2 : 3;
+        }
+        out_write( &output->out, text, used );
+        data += n;
+        size -= n;
+    }
+}
+
+/*
+ * Function    : hexdump_line
+ * Parameters  : Read output, up to 16 bytes, and their number
+ * Description : Writes one line of "hexdump -C": offset, the bytes in hex in two groups of eight,
+ *               and the printable ones between bars. A full line equal to the one before it is
+ *               written as a single "*" for the whole run.
+ */
+void hexdump_line( struct ReadOutput *output, const uint8_t *data, int size )
+{
+    char line[ 80 ];
+    int i;
+
+    if ( size == 16 && output->have_previous && !memcmp( data, output->previous, 16 ) )
+    {
+        if ( !output->squeezing ) out_write( &output->out, "*\n", 2 );
+        output->squeezing = 1;
+        output->offset += 16;
+        return;
+    }
+    output->squeezing = 0;
+    output->have_previous = size == 16;
+    memcpy( output->previous, data, size );
+
+    snprintf( line, 11, "%08llx  ", ( unsigned long long )output->offset );
+    memset( line + 10, ' ', 50 );
+    for ( i = 0; i < size; i++ ) memcpy( line + 10 + 3 * i + ( i >= 8 ), &hex_pairs[ data[ i ] ], 2 );
+    line[ 60 ] = '|';
+    for ( i = 0; i < size; i++ ) line[ 61 + i ] = data[ i ] >= 0x20 && data[ i ] < 0x7f ? data[ i ] : '.';
+    line[ 61 + size ] = '|';
+    line[ 62 + size ] = '\n';
+    out_write( &output->out, line, 63 + size );
+    output->offset += size;
+}
+
+/*
+ * Function    : format_hexdump
+ * Parameters  : Read output, data, and number of bytes
+ * Description : Writes the data as "hexdump -C" lines, keeping the bytes of an incomplete line for
+ *               the next call
+ */
+void format_hexdump( struct ReadOutput *output, const uint8_t *data, size_t size )
+{
+    if ( output->carried > 0 )
+    {
+        size_t room = ( size_t )( 16 - output->carried ); // carried is 0 to 15
+        size_t n = room < size ? room : size;
+        memcpy( output->carry + output->carried, data, n );
+        output->carried += n;
+        data += n;
+        size -= n;
+        if ( output->carried < 16 ) return;
+        hexdump_line( output, output->carry, 16 );
+        output->carried = 0;
+    }
+    for ( ; size >= 16; data += 16, size -= 16 ) hexdump_line( output, data, 16 );
+    memcpy( output->carry, data, size );
+    output->carried = size;
+}
+
+/*
+ * Function    : base64_line
+ * Parameters  : Read output, base64 text, and its length
+ * Description : Writes base64 text wrapped at 76 columns, as the base64 tool does
+ */
+void base64_line( struct ReadOutput *output, const char *text, size_t length )
+{
+    while ( length > 0 )
+    {
+        size_t n = 76 - output->column < length ? 76 - output->column : length;
+        out_write( &output->out, text, n );
+        output->column += n;
+        text += n;
+        length -= n;
+        if ( output->column == 76 )
+        {
+            out_write( &output->out, "\n", 1 );
+            output->column = 0;
+        }
+    }
+}
+
+/*
+ * Function    : format_base64
+ * Parameters  : Read output, data, and number of bytes
+ * Description : Encodes each 3 bytes as two 12-bit table lookups, keeping up to 2 bytes that do not
+ *               make a group for the next call
+ */
+void format_base64( struct ReadOutput *output, const uint8_t *data, size_t size )
+{
+    char text[ 4 * 1024 ];
+
+    while ( output->carried > 0 && output->carried < 3 && size > 0 )
+    {
+        output->carry[ output->carried++ ] = *data++;
+        size--;
+    }
+    if ( output->carried == 3 )
+    {
+        uint32_t group = ( output->carry[ 0 ] << 16 ) | ( output->carry[ 1 ] << 8 ) | output->carry[ 2 ];
+        memcpy( text, &base64_pairs[ group >> 12 ], 2 );
+        memcpy( text + 2, &base64_pairs[ group & 4095 ], 2 );
+        base64_line( output, text, 4 );
+        output->carried = 0;
+    }
+
+    while ( size >= 3 )
+    {
+        size_t groups = size / 3 < sizeof( text ) / 4 ? size / 3 : sizeof( text ) / 4, i;
+        for ( i = 0; i < groups; i++, data += 3 )
+        {
+            uint32_t group = ( data[ 0 ] << 16 ) | ( data[ 1 ] << 8 ) | data[ 2 ];
+            memcpy( text + 4 * i, &base64_pairs[ group >> 12 ], 2 );
+            memcpy( text + 4 * i + 2, &base64_pairs[ group & 4095 ], 2 );
+        }
+        base64_line( output, text, 4 * groups );
+        size -= 3 * groups;
+    }
+    memcpy( output->carry, data, size );
+    output->carried = size;
+}
+
+/*
+ * Function    : format_data
+ * Parameters  : Read output, data, and number of bytes
+ */
+void format_data( struct ReadOutput *output, const uint8_t *data, size_t size )
+{
+    switch ( output->mode )
+    {
+        case READ_HEX: format_hex( output, data, size ); break;
+        case READ_RAW: out_write( &output->out, data, size ); break;
+        case READ_HEXDUMP: format_hexdump( output, data, size ); break;
+        case READ_BASE64: format_base64( output, data, size ); break;
+    }
+}
+
+/*
+ * Function    : format_finish
+ * Parameters  : Read output and the file offsets the output starts and ends at
+ * Description : Writes what the format holds back: the last short line of a hexdump and its end
+ *               offset, or the last base64 group with its padding
+ */
+void format_finish( struct ReadOutput *output, uint64_t start, uint64_t end )
+{
+    char text[ 24 ];
+
+    if ( output->mode == READ_HEX ) out_write( &output->out, "\n", 1 );
+    if ( output->mode == READ_HEXDUMP && end > start ) // hexdump prints nothing at all for no data
+    {
+        if ( output->carried > 0 ) hexdump_line( output, output->carry, output->carried );
+        int n = snprintf( text, sizeof( text ), "%08llx\n", ( unsigned long long )end );
+        out_write( &output->out, text, n );
+    }
+    if ( output->mode == READ_BASE64 )
+    {
+        if ( output->carried > 0 )
+        {
+            uint32_t group = ( output->carry[ 0 ] << 16 ) | ( output->carried > 1 ? output->carry[ 1 ] << 8 : 0 );
+            memcpy( text, &base64_pairs[ group >> 12 ], 2 );
+            memcpy( text + 2, &base64_pairs[ group & 4095 ], 2 );
+            text[ 3 ] = '=';
+            if ( output->carried == 1 ) text[ 2 ] = '=';
+            base64_line( output, text, 4 );
+        }
+        if ( output->column > 0 ) out_write( &output->out, "\n", 1 );
+    }
+}
+
+/*
+ * Function    : read_file
+ * Parameters  : Filename, position(bytes), number of bytes to read, output mode (NULL, "-C", "--raw"
+ *               or "--base64"), directory, fat32info, and file pointer
+ * Description : Reads the the file at the specified position and outputs the number of bytes specified.
+ *               The range is read a run of consecutive clusters at a time, up to 4 MiB, and formatted
+ *               into a large output buffer: by default every byte as "%x ", with -C as "hexdump -C"
+ *               does, with --raw as is, and with --base64 in base64. Reading stops at the end of the file.
+ */
+void read_file( char *filename, char *position, char *num_bytes, char *mode, struct DirectoryEntry *dir, struct f32info *f32, FILE *fp )
+{
+    struct ReadOutput output;
+    int entry;
+    uint64_t working_size = strtoull( num_bytes, NULL, 10 );
+    uint64_t position_64 = strtoull( position, NULL, 10 ); // convert arguments to correct type
+    uint32_t cluster_bytes = cluster_size( f32 );
+
+    memset( &output, 0, sizeof( output ) );
+    if ( mode == NULL ) output.mode = READ_HEX;
+    else if ( !strcmp( mode, "-C" ) ) output.mode = READ_HEXDUMP;
+    else if ( !strcmp( mode, "--raw" ) ) output.mode = READ_RAW;
+    else if ( !strcmp( mode, "--base64" ) ) output.mode = READ_BASE64;
+    else
+    {
+        printf( "Error: Unknown output mode %s, use -C, --raw or --base64.\n", mode );
+        return;
+    }
+
+    entry = find_file( filename, dir );
 
     // File not found
     if ( entry == -1 )
     {
-        printf( "Error: File not found. \n" );
+        printf( "Error: File not found. \n" );
+        return;
+    }
+
+    uint8_t *buffer = ( uint8_t * )malloc( COPY_BUFFER_SIZE );
+    if ( !buffer || !load_fat( f32, fp ) )
+    {
+        printf( "Error: Out of memory. \n" );
+        free( buffer );
+        return;
+    }
+    pthread_once( &format_once, format_init_tables );
+
+    uint64_t file_size = dir[ entry ].DIR_FileSize;
+    if ( position_64 > file_size ) position_64 = file_size;
+    if ( working_size > file_size - position_64 ) working_size = file_size - position_64;
+
+    // Skip the clusters before the position
+    uint32_t cluster = first_cluster( &dir[ entry ] );
+    uint64_t skip;
+    for ( skip = position_64 / cluster_bytes; skip > 0 && cluster >= 2; skip-- ) cluster = next_cluster( cluster );
+    uint32_t offset = position_64 % cluster_bytes;
+
+    output.offset = position_64;
+    out_open( &output.out, STDOUT_FILENO );
+
+    uint64_t done = 0;
+    while ( done < working_size && cluster >= 2 )
+    {
+        uint32_t first = cluster;
+        uint64_t needed = ( offset + working_size - done + cluster_bytes - 1 ) / cluster_bytes;
+        uint32_t run = chain_run( &cluster, needed < COPY_BUFFER_SIZE / cluster_bytes ? needed : COPY_BUFFER_SIZE / cluster_bytes );
+        uint64_t want = ( uint64_t )run * cluster_bytes - offset;
+        if ( want > working_size - done ) want = working_size - done;
+
+        if ( read_at( fp, buffer, want, LBAToOffset( first, f32 ) + offset ) != ( ssize_t )want ) break;
+        format_data( &output, buffer, want );
+        done += want;
+        offset = 0;
+    }
+    format_finish( &output, position_64, position_64 + done );
+    out_close( &output.out );
+    free( buffer );
+
+    if ( done < working_size ) printf( "Error: Read %llu of %llu bytes. \n", ( unsigned long long )done, ( unsigned long long )working_size );
+}
+
+/*
+ * Function    : dump
+ * Parameters  : Command tokens after "dump", number of them, fat32info, and the current file pointer
+ * Description : Copies a raw range of the image, addressed by cluster or with -s by sector, to a
+ *               host file or standard output, or prints it as "hexdump -C" lines with image offsets
+ *               when -C is given. The range is read 4 MiB at a time, and runs of zeros become holes
+ *               in a host file.
+ */
+void dump( char **argument, int count, struct f32info *f32, FILE *fp )
+{
+    struct ReadOutput output;
+    struct timespec start;
+    struct stat image;
+    char *positional[ 3 ] = { NULL, NULL, NULL };
+    int i, used = 0, sectors = 0;
+
+    memset( &output, 0, sizeof( output ) );
+    output.mode = READ_RAW;
+    for ( i = 0; i < count; i++ )
+    {
+        if ( argument[ i ] == NULL ) continue; // Empty tokens left by repeated spaces
+        if ( !strcmp( argument[ i ], "-s" ) ) sectors = 1;
+        else if ( !strcmp( argument[ i ], "-C" ) ) output.mode = READ_HEXDUMP;
+        else if ( used < 3 ) positional[ used++ ] = argument[ i ];
+        else used++;
+    }
+
+    uint64_t first, units;
+    if ( used < 2 || used > 3 || !parse_count( positional[ 0 ], &first ) || !parse_count( positional[ 1 ], &units ) )
+    {
+        printf( "Error: Usage: dump [-s] [-C] <cluster|sector> <count> [out|-]\n" );
+        return;
+    }
+
+    // Clusters start after the FATs, sectors at the start of the image
+    uint64_t unit = sectors ? ( uint16_t )f32->BPB_BytsPerSec : cluster_size( f32 );
+    if ( !sectors && first < 2 )
+    {
+        printf( "Error: Clusters are numbered from 2. \n" );
+        return;
+    }
+    uint64_t base = sectors ? 0 : ( uint64_t )LBAToOffset( 2, f32 );
+    uint64_t index = sectors ? first : first - 2;
+    uint64_t offset = index > ( UINT64_MAX - base ) / unit ? UINT64_MAX : base + index * unit;
+    uint64_t size = units > UINT64_MAX / unit ? UINT64_MAX : units * unit; // Cut to the image below
+
+    if ( fstat( fileno( fp ), &image ) != 0 || offset >= ( uint64_t )image.st_size )
+    {
+        printf( "Error: Range starts past the end of the image. \n" );
+        return;
+    }
+    if ( size > ( uint64_t )image.st_size - offset ) size = image.st_size - offset;
+
+    int to_file = positional[ 2 ] && strcmp( positional[ 2 ], "-" );
+    int fd = to_file ? open( positional[ 2 ], O_WRONLY | O_CREAT | O_TRUNC, 0644 ) : STDOUT_FILENO;
+    if ( fd < 0 )
+    {
+        printf( "Error: Could not create %s: %s\n", positional[ 2 ], strerror( errno ) );
+        return;
+    }
+    struct stat host;
+    int sparse = output.mode == READ_RAW && fstat( fd, &host ) == 0 && S_ISREG( host.st_mode );
+
+    uint8_t *buffer = ( uint8_t * )malloc( COPY_BUFFER_SIZE );
+    if ( !buffer )
+    {
+        printf( "Error: Out of memory. \n" );
+        if ( to_file ) close( fd );
+        return;
+    }
+    pthread_once( &format_once, format_init_tables );
+    posix_fadvise( fileno( fp ), offset, size, POSIX_FADV_SEQUENTIAL );
+
+    output.offset = offset;
+    if ( !sparse ) out_open( &output.out, fd );
+    clock_gettime( CLOCK_MONOTONIC, &start );
+
+    uint64_t done = 0;
+    int failed = 0;
+    while ( done < size && !failed )
+    {
+        size_t want = size - done < COPY_BUFFER_SIZE ? size - done : COPY_BUFFER_SIZE;
+        if ( read_at( fp, buffer, want, offset + done ) != ( ssize_t )want ) break;
+        if ( sparse ) failed = !write_sparse( fd, buffer, want, done, ( uint32_t )unit );
+        else format_data( &output, buffer, want );
+        done += want;
+    }
+    if ( sparse && ftruncate( fd, done ) != 0 ) failed = 1;
+    if ( !sparse )
+    {
+        format_finish( &output, offset, offset + done );
+        failed |= !out_close( &output.out );
+    }
+    double seconds = elapsed_seconds( &start );
+    if ( to_file && close( fd ) != 0 ) failed = 1;
+    free( buffer );
+
+    if ( failed ) printf( "Error: Could not write %s: %s\n", to_file ? positional[ 2 ] : "standard output", strerror( errno ) );
+    else if ( done < size ) printf( "Error: Read %llu of %llu bytes of the image. \n", ( unsigned long long )done, ( unsigned long long )size );
+    else if ( to_file )
+    {
+        printf( "Dumped %llu bytes from image offset %llu in %.2f s (%.1f MB/s).\n", ( unsigned long long )done,
+                ( unsigned long long )offset, seconds, seconds > 0 ? done / seconds / 1e6 : 0.0 );
+    }
+}
+
+/*
+ * Function    : printable_byte
+ * Parameters  : A byte
+ * Returns     : 1 if the byte is printable ASCII or a tab, the characters strings looks for
+ */
+static inline int printable_byte( uint8_t c )
+{
+    return ( uint8_t )( c - 0x20 ) < 0x5f || c == '\t';
+}
+
+/*
+ * Function    : printable_mask
+ * Parameters  : 64 bytes of data
+ * Returns     : One bit per byte, set if printable_byte() holds for it
+ * Description : Classifies 16 bytes per SSE2 compare. Adding 0x60 moves 0x20 to 0x7e onto the
+ *               signed range -128 to -34, so one signed compare replaces the two of a range check.
+ */
+static inline uint64_t printable_mask( const uint8_t *data )
+{
+    uint64_t mask = 0;
+#if defined( __SSE2__ )
+    const __m128i shift = _mm_set1_epi8( 0x60 );
+    const __m128i limit = _mm_set1_epi8( -33 );
+    const __m128i tab = _mm_set1_epi8( '\t' );
+    int i;
+    for ( i = 0; i < 64; i += 16 )
+    {
+        __m128i bytes = _mm_loadu_si128( ( const __m128i * )( data + i ) );
+        __m128i printable = _mm_or_si128( _mm_cmplt_epi8( _mm_add_epi8( bytes, shift ), limit ), _mm_cmpeq_epi8( bytes, tab ) );
+        mask |= ( uint64_t )( uint16_t )_mm_movemask_epi8( printable ) << i;
+    }
+#else
+    int i;
+    for ( i = 0; i < 64; i++ ) mask |= ( uint64_t )printable_byte( data[ i ] ) << i;
+#endif
+    return mask;
+}
+
+/*
+ * Function    : strings_line
+ * Parameters  : Text to append to, image offset, the string, and its length
+ * Description : Formats a string found by strings like "strings -t x" does
+ */
+void strings_line( struct Text *text, uint64_t offset, const uint8_t *data, uint64_t length )
+{
+    char prefix[ 24 ];
+    int used = snprintf( prefix, sizeof( prefix ), "%7llx ", ( unsigned long long )offset );
+    text_append( text, prefix, used );
+    text_append( text, ( const char * )data, length );
+    text_append( text, "\n", 1 );
+}
+
+/*
+ * Function    : strings_flush
+ * Parameters  : Output, the printable bytes collected across pieces, the image offset they start at,
+ *               and the shortest string to print
+ * Description : Prints the collected bytes if they are long enough and empties them
+ */
+void strings_flush( struct OutputBuffer *out, struct Text *carry, uint64_t offset, uint64_t minimum )
+{
+    if ( carry->length >= minimum )
+    {
+        char prefix[ 24 ];
+        int used = snprintf( prefix, sizeof( prefix ), "%7llx ", ( unsigned long long )offset );
+        out_write( out, prefix, used );
+        out_write( out, carry->data, carry->length );
+        out_write( out, "\n", 1 );
+    }
+    carry->length = 0;
+}
+
+/*
+ * Function    : strings_run
+ * Parameters  : Strings scan, piece, its data, and the start and end of a run of printable bytes in it
+ * Description : Keeps a run that touches either end of the piece for the merge in strings(), since
+ *               it may continue in the neighbouring piece, and formats a long enough run otherwise
+ */
+void strings_run( struct StringsScan *scan, struct StringsPiece *piece, const uint8_t *data, uint32_t start, uint32_t end )
+{
+    if ( start == 0 )
+    {
+        text_append( &piece->head, ( const char * )data, end );
+        piece->all_printable = end == piece->size;
+    }
+    else if ( end == piece->size ) text_append( &piece->tail, ( const char * )data + start, end - start );
+    else if ( end - start >= scan->minimum ) strings_line( &piece->lines, piece->offset + start, data + start, end - start );
+}
+
+/*
+ * Function    : strings_visit
+ * Parameters  : Strings scan, worker, and piece of the current batch
+ * Description : Reads one piece and finds its runs of printable bytes 64 bytes at a time. Each run
+ *               costs two count-trailing-zeros on the printable mask, one for its start and one for its end.
+ */
+void strings_visit( void *context, int worker, uint32_t item )
+{
+    struct StringsScan *scan = ( struct StringsScan * )context;
+    struct StringsPiece *piece = &scan->pieces[ scan->first + item ];
+
+    if ( !scan->buffers[ worker ] ) scan->buffers[ worker ] = ( uint8_t * )malloc( COPY_BUFFER_SIZE );
+    uint8_t *data = scan->buffers[ worker ];
+    if ( !data || read_at( scan->fp, data, piece->size, piece->offset ) != ( ssize_t )piece->size )
+    {
+        int expected = 0;
+        __atomic_compare_exchange_n( &scan->error, &expected, data ? ( errno ? errno : EIO ) : ENOMEM, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED );
+        piece->size = 0;
+        return;
+    }
+
+    uint32_t i, start = 0;
+    int in_run = 0;
+    for ( i = 0; i < piece->size; i += 64 )
+    {
+        uint64_t mask;
+        if ( piece->size - i >= 64 ) mask = printable_mask( data + i );
+        else
+        {
+            // Bytes past the end count as printable, so a run reaching the end stays open
+            uint32_t k, left = piece->size - i;
+            mask = ~0ULL << left;
+            for ( k = 0; k < left; k++ ) mask |= ( uint64_t )printable_byte( data[ i + k ] ) << k;
+        }
+
+        int bit = 0;
+        while ( bit < 64 )
+        {
+            uint64_t bits = in_run ? ~mask >> bit : mask >> bit;
+            if ( !bits ) break;
+            bit += __builtin_ctzll( bits );
+            if ( in_run ) strings_run( scan, piece, data, start, i + bit );
+            else if ( i + bit >= piece->size ) break;
+            else start = i + bit;
+            in_run = !in_run;
+        }
+    }
+    if ( in_run ) strings_run( scan, piece, data, start, piece->size );
+}
+
+/*
+ * Function    : strings_add
+ * Parameters  : Piece array with its count and capacity, the image offset and size of a block of data,
+ *               and whether it carries on from the block before it
+ * Returns     : 1 on success, 0 if out of memory
+ */
+int strings_add( struct StringsPiece **pieces, uint32_t *count, uint64_t *capacity, uint64_t offset, uint32_t size, int continued )
+{
+    if ( !grow_array( ( void ** )pieces, capacity, *count + 1, sizeof( struct StringsPiece ) ) ) return 0;
+    struct StringsPiece *piece = &( *pieces )[ ( *count )++ ];
+    memset( piece, 0, sizeof( *piece ) );
+    piece->offset = offset;
+    piece->size = size;
+    piece->continued = continued;
+    return 1;
+}
+
+/*
+ * Function    : strings
+ * Parameters  : Command tokens after "strings", number of them, fat32info, and the current file pointer
+ * Description : Prints the runs of at least -n (default 4) printable bytes of a file, or with --free of
+ *               the free clusters, with the image offset each starts at. The data is cut into blocks of
+ *               up to 4 MiB of consecutive clusters, taken from the chain of the file or from the free
+ *               cluster bitmap of the index, and the blocks are scanned by several workers a batch at a
+ *               time. The printable bytes at the ends of the blocks are joined again in order, so strings
+ *               crossing a block boundary of a file, or between adjacent free clusters, come out whole.
+ */
+void strings( char **argument, int count, struct f32info *f32, FILE *fp )
+{
+    struct StringsScan scan;
+    struct DirectoryEntry target;
+    char *source = NULL;
+    uint64_t capacity = 0;
+    uint32_t piece_count = 0, bytes = cluster_size( f32 ), per_piece = COPY_BUFFER_SIZE / cluster_size( f32 ), i;
+    int bad = 0, workers = worker_count();
+
+    memset( &scan, 0, sizeof( scan ) );
+    scan.minimum = STRINGS_MIN;
+    for ( i = 0; i < ( uint32_t )count; i++ )
+    {
+        if ( argument[ i ] == NULL ) continue; // Empty tokens left by repeated spaces
+        if ( !strcmp( argument[ i ], "-n" ) )
+        {
+            if ( i + 1 >= ( uint32_t )count || !argument[ i + 1 ] || !parse_count( argument[ ++i ], &scan.minimum ) || !scan.minimum ) bad = 1;
+        }
+        else if ( !source ) source = argument[ i ];
+        else bad = 1;
+    }
+    if ( bad || !source )
+    {
+        printf( "Error: Usage: strings [-n min] <file|--free>\n" );
+        return;
+    }
+    if ( !load_fat( f32, fp ) )
+    {
+        printf( "Error: Out of memory. \n" );
+        return;
+    }
+
+    int ok = 1;
+    if ( !strcmp( source, "--free" ) )
+    {
+        struct VolumeIndex *index = get_index( f32, fp );
+        if ( !index )
+        {
+            printf( "Error: Could not index the file system image.\n" );
+            return;
+        }
+
+        // Runs of set bits of the free bitmap, a 64-bit word at a time
+        uint64_t cluster = 2, end = index->header->cluster_count, previous_end = 0;
+        while ( cluster < end && ok )
+        {
+            uint64_t word = index->free_map[ cluster / 64 ] >> ( cluster % 64 );
+            if ( !word )
+            {
+                cluster = ( cluster / 64 + 1 ) * 64;
+                continue;
+            }
+            cluster += __builtin_ctzll( word );
+            if ( cluster >= end ) break;
+
+            uint64_t run = 0;
+            while ( cluster + run < end && run < per_piece && ( index->free_map[ ( cluster + run ) / 64 ] >> ( ( cluster + run ) % 64 ) & 1 ) ) run++;
+            uint64_t offset = LBAToOffset( cluster, f32 );
+            ok = strings_add( &scan.pieces, &piece_count, &capacity, offset, run * bytes, offset == previous_end );
+            previous_end = offset + run * bytes;
+            cluster += run;
+        }
     }
-    // File found
     else
     {
-        strncpy( name_buffer, dir[ entry ].DIR_Name, 11 ); // Copy 11 characters from DIR_Name (total size is 11 bytes) to name buffer
-        name_buffer[ 11 ] = '\0';                          // Manually add null character in index 12
+        if ( !resolve_path( source, f32, fp, &target, NULL ) )
+        {
+            printf( "Error: File not found. \n" );
+            return;
+        }
+        if ( target.DIR_Attr & 0x10 )
+        {
+            printf( "Error: Entry is a directory. \n" );
+            return;
+        }
+
+        uint32_t cluster = first_cluster( &target );
+        uint64_t done = 0, size = target.DIR_FileSize;
+        while ( done < size && cluster >= 2 && ok )
+        {
+            uint32_t first = cluster;
+            uint64_t needed = ( size - done + bytes - 1 ) / bytes;
+            uint32_t run = chain_run( &cluster, needed < per_piece ? needed : per_piece );
+            uint64_t want = ( uint64_t )run * bytes < size - done ? ( uint64_t )run * bytes : size - done;
+            ok = strings_add( &scan.pieces, &piece_count, &capacity, LBAToOffset( first, f32 ), want, done > 0 );
+            done += want;
+        }
+        if ( done < size && ok ) printf( "Error: Cluster chain of %s too short, scanning %llu of %llu bytes. \n", source,
+                                         ( unsigned long long )done, ( unsigned long long )size );
+    }
+    if ( !ok )
+    {
+        printf( "Error: Out of memory. \n" );
+        free( scan.pieces );
+        return;
+    }
+
+    scan.f32 = f32;
+    scan.fp = fp;
+
+    struct OutputBuffer out;
+    struct Text carry;
+    uint64_t carry_offset = 0;
+    int failed = 0;
+    memset( &carry, 0, sizeof( carry ) );
+    out_open( &out, STDOUT_FILENO );
+
+    // Scan a few pieces per worker at a time, so the output of a batch is printed before the next
+    // one is read and memory stays bounded for any amount of data
+    uint32_t batch = workers * 4;
+    for ( scan.first = 0; scan.first < piece_count && !failed; scan.first += batch )
+    {
+        uint32_t pieces = piece_count - scan.first < batch ? piece_count - scan.first : batch;
+        parallel_for( pieces, workers, strings_visit, &scan );
+
+        for ( i = scan.first; i < scan.first + pieces; i++ )
+        {
+            struct StringsPiece *piece = &scan.pieces[ i ];
+            if ( piece->size == 0 ) failed = 1; // Its read failed, print what came before it
+            if ( !failed )
+            {
+                // Printable bytes at the end of one piece and the start of the next make one string
+                if ( !piece->continued ) strings_flush( &out, &carry, carry_offset, scan.minimum );
+                if ( !carry.length ) carry_offset = piece->offset;
+                text_append( &carry, piece->head.data, piece->head.length );
+                if ( !piece->all_printable )
+                {
+                    strings_flush( &out, &carry, carry_offset, scan.minimum );
+                    out_write( &out, piece->lines.data, piece->lines.length );
+                    text_append( &carry, piece->tail.data, piece->tail.length );
+                    carry_offset = piece->offset + piece->size - piece->tail.length;
+                }
+            }
+            free( piece->lines.data );
+            free( piece->head.data );
+            free( piece->tail.data );
+        }
+    }
+    if ( !failed ) strings_flush( &out, &carry, carry_offset, scan.minimum );
+    out_close( &out );
+    free( carry.data );
+    for ( i = 0; i < MAX_WORKERS; i++ ) free( scan.buffers[ i ] );
+    free( scan.pieces );
+
+    if ( failed ) printf( "Error: Could not read the image: %s\n", strerror( scan.error ) );
+}
+
+/*
+ * Function    : find_pattern
+ * Parameters  : Data with its size, the first and one past the last position a match may start at,
+ *               and the pattern with its length
+ * Returns     : Position of the first match in that range, or SIZE_MAX if there is none
+ * Description : Compares the first and the last byte of the pattern against 16 positions per SSE2
+ *               compare, and only checks the rest of the pattern where both agree. The caller keeps
+ *               end <= size - length + 1, so every load stays inside the data.
+ */
+size_t find_pattern( const uint8_t *data, size_t start, size_t end, const uint8_t *pattern, uint32_t length )
+{
+    size_t p = start;
+#if defined( __SSE2__ )
+    const __m128i first = _mm_set1_epi8( ( char )pattern[ 0 ] );
+    const __m128i last = _mm_set1_epi8( ( char )pattern[ length - 1 ] );
+    for ( ; p + 16 <= end; p += 16 )
+    {
+        __m128i head = _mm_cmpeq_epi8( _mm_loadu_si128( ( const __m128i * )( data + p ) ), first );
+        __m128i tail = _mm_cmpeq_epi8( _mm_loadu_si128( ( const __m128i * )( data + p + length - 1 ) ), last );
+        uint32_t mask = _mm_movemask_epi8( _mm_and_si128( head, tail ) );
+        while ( mask )
+        {
+            size_t candidate = p + __builtin_ctz( mask );
+            if ( !memcmp( data + candidate, pattern, length ) ) return candidate;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    while ( p < end )
+    {
+        const uint8_t *found = ( const uint8_t * )memchr( data + p, pattern[ 0 ], end - p );
+        if ( !found ) break;
+        p = found - data;
+        if ( !memcmp( data + p, pattern, length ) ) return p;
+        p++;
+    }
+    return SIZE_MAX;
+}
+
+/*
+ * Function    : grep_match
+ * Parameters  : Grep search, text to append to, file name, block of the file with its length, the file
+ *               offset of the block, and the position of a match in it
+ * Description : Formats one match as "name:offset", followed with -C by the bytes around it, with bytes
+ *               that are not printable shown as '.'
+ */
+void grep_match( struct GrepSearch *search, struct Text *text, const char *name, const uint8_t *data, size_t held, uint64_t base, size_t position )
+{
+    char line[ PATH_MAX + 32 + GREP_PATTERN_MAX + 2 * GREP_CONTEXT_MAX ];
+    int n = snprintf( line, sizeof( line ), "%s:%llu", name, ( unsigned long long )( base + position ) );
+    if ( n > PATH_MAX ) n = PATH_MAX; // Leaves room for the context and the newline
+    if ( search->context )
+    {
+        size_t from = position > search->context ? position - search->context : 0;
+        size_t to = position + search->length + search->context < held ? position + search->length + search->context : held;
+        line[ n++ ] = ':';
+        line[ n++ ] = ' ';
+        for ( ; from < to && n < ( int )sizeof( line ) - 1; from++ ) line[ n++ ] = printable_byte( data[ from ] ) && data[ from ] != '\t' ? data[ from ] : '.';
+    }
+    line[ n++ ] = '\n';
+    text_append( text, line, n );
+}
+
+/*
+ * Function    : grep_visit
+ * Parameters  : Grep search, worker, and job
+ * Description : Searches one file straight from the image, a run of clusters at a time in the worker's
+ *               own buffer. The end of each block is kept in front of the next one, so a match and its
+ *               context are found whole when they cross a cluster or block boundary. Matches near the
+ *               end of a block are left for the next one, which still holds their context before them.
+ */
+void grep_visit( void *context, int worker, uint32_t item )
+{
+    struct GrepSearch *search = ( struct GrepSearch * )context;
+    struct HashSum *sum = &search->sum;
+    struct Extraction *extraction = &sum->extraction;
+    struct ExtractJob *job = &extraction->jobs[ item ];
+    struct Text text;
+    uint32_t bytes = cluster_size( extraction->f32 ), per_buffer = COPY_BUFFER_SIZE / bytes, cluster = job->cluster;
+    size_t keep = search->length - 1 + 2 * search->context;
+    size_t held = 0, searched = 0;
+    uint64_t base = 0, done = 0, found = 0;
+
+    if ( !extraction->buffers[ worker ] ) extraction->buffers[ worker ] = ( uint8_t * )malloc( COPY_BUFFER_SIZE + GREP_PATTERN_MAX + 2 * GREP_CONTEXT_MAX );
+    uint8_t *buffer = extraction->buffers[ worker ];
+    if ( !buffer )
+    {
+        fprintf( stderr, "Error: Out of memory. \n" );
+        __atomic_add_fetch( &sum->errors, 1, __ATOMIC_RELAXED );
+        return;
+    }
+
+    memset( &text, 0, sizeof( text ) );
+    while ( done < job->size && cluster >= 2 && !( found && search->names_only ) )
+    {
+        if ( held > keep )
+        {
+            size_t drop = held - keep;
+            memmove( buffer, buffer + drop, keep );
+            base += drop;
+            held = keep;
+            searched -= drop;
+        }
+
+        uint32_t first = cluster;
+        uint64_t needed = ( job->size - done + bytes - 1 ) / bytes;
+        uint32_t run = chain_run( &cluster, needed < per_buffer ? needed : per_buffer );
+        uint64_t want = ( uint64_t )run * bytes < job->size - done ? ( uint64_t )run * bytes : job->size - done;
+        if ( read_at( extraction->fp, buffer + held, want, LBAToOffset( first, extraction->f32 ) ) != ( ssize_t )want ) break;
+        held += want;
+        done += want;
+
+        // Starts close enough to the end that the match or its context runs past it wait for the next block
+        size_t tail = done < job->size ? search->length + search->context : search->length;
+        size_t end = held >= tail ? held - tail + 1 : 0;
+        if ( end <= searched ) continue;
+
+        size_t position = find_pattern( buffer, searched, end, search->pattern, search->length );
+        while ( position != SIZE_MAX )
+        {
+            found++;
+            if ( search->names_only ) break;
+            grep_match( search, &text, job->name, buffer, held, base, position );
+            position = position + search->length < end ? find_pattern( buffer, position + search->length, end, search->pattern, search->length ) : SIZE_MAX;
+        }
+        searched = position != SIZE_MAX ? position + search->length : end;
+    }
+
+    if ( done < job->size && !( found && search->names_only ) )
+    {
+        fprintf( stderr, "Error: Read %llu of %llu bytes of %s. \n", ( unsigned long long )done, ( unsigned long long )job->size, job->name );
+        __atomic_add_fetch( &sum->errors, 1, __ATOMIC_RELAXED );
+    }
+    if ( found && search->names_only )
+    {
+        text_append( &text, job->name, strlen( job->name ) );
+        text_append( &text, "\n", 1 );
+    }
+
+    pthread_mutex_lock( &sum->lock );
+    out_write( &sum->out, text.data, text.length );
+    search->matches += found;
+    if ( found ) search->files++;
+    if ( elapsed_seconds( &sum->flushed ) > 0.1 )
+    {
+        out_flush( &sum->out );
+        clock_gettime( CLOCK_MONOTONIC, &sum->flushed );
+    }
+    pthread_mutex_unlock( &sum->lock );
+    free( text.data );
+}
+
+/*
+ * Function    : parse_hex
+ * Parameters  : Hex digits, two per byte, the buffer for the bytes and its size
+ * Returns     : Number of bytes, or 0 if the text is not whole bytes of hex or does not fit
+ */
+uint32_t parse_hex( const char *text, uint8_t *bytes, uint32_t size )
+{
+    uint32_t length = 0;
+    while ( text[ 0 ] && text[ 1 ] && isxdigit( ( unsigned char )text[ 0 ] ) && isxdigit( ( unsigned char )text[ 1 ] ) && length < size )
+    {
+        char pair[ 3 ] = { text[ 0 ], text[ 1 ], '\0' };
+        bytes[ length++ ] = ( uint8_t )strtoul( pair, NULL, 16 );
+        text += 2;
+    }
+    return *text ? 0 : length;
+}
+
+/*
+ * Function    : grep
+ * Parameters  : Command tokens after "grep", number of them, fat32info, and the current file pointer
+ * Description : Prints every place a string, or with -x a byte sequence in hex, occurs in the files below
+ *               a directory or in one file, as "path:offset", with -C the given number of bytes around
+ *               it, and with -l only the names of the files that contain it. The files are collected
+ *               like hashsum does and searched in the order they are stored on disk by as many workers
+ *               as there are processors. Each file's matches come out together, in the order files complete.
+ */
+void grep( char **argument, int count, struct f32info *f32, FILE *fp )
+{
+    struct GrepSearch search;
+    struct DirectoryEntry target;
+    struct LongName long_name;
+    char name[ LFN_MAX_UNITS * 3 + 1 ];
+    char *pattern = NULL, *path = NULL;
+    uint64_t context = 0;
+    int bad = 0, hex = 0;
+    uint32_t i;
+
+    memset( &search, 0, sizeof( search ) );
+    for ( i = 0; i < ( uint32_t )count; i++ )
+    {
+        if ( argument[ i ] == NULL ) continue; // Empty tokens left by repeated spaces
+        if ( !pattern && !strcmp( argument[ i ], "-l" ) ) search.names_only = 1;
+        else if ( !pattern && !strcmp( argument[ i ], "-x" ) ) hex = 1;
+        else if ( !pattern && !strcmp( argument[ i ], "-C" ) )
+        {
+            if ( i + 1 >= ( uint32_t )count || !argument[ i + 1 ] || !parse_count( argument[ ++i ], &context ) || context > GREP_CONTEXT_MAX ) bad = 1;
+        }
+        else if ( !pattern ) pattern = argument[ i ];
+        else if ( !path ) path = argument[ i ];
+        else bad = 1;
+    }
+    if ( bad || !pattern )
+    {
+        printf( "Error: Usage: grep [-l] [-x] [-C bytes] <pattern> [path]\n" );
+        return;
+    }
+    search.context = context;
+    search.length = hex ? parse_hex( pattern, search.pattern, GREP_PATTERN_MAX ) : strlen( pattern );
+    if ( search.length == 0 || search.length > GREP_PATTERN_MAX )
+    {
+        printf( "Error: The pattern must be 1 to %d bytes%s.\n", GREP_PATTERN_MAX, hex ? " of hex digits" : "" );
+        return;
+    }
+    if ( !hex ) memcpy( search.pattern, pattern, search.length );
+
+    if ( !resolve_path( path, f32, fp, &target, &long_name ) )
+    {
+        printf( "Error: File not found. \n" );
+        return;
+    }
+
+    struct HashSum *sum = &search.sum;
+    if ( !load_fat( f32, fp ) || !tree_init( &sum->tree, f32, fp ) )
+    {
+        printf( "Error: Out of memory. \n" );
+        tree_free( &sum->tree );
+        return;
+    }
+    pthread_mutex_init( &sum->lock, NULL );
+    sum->extraction.f32 = f32;
+    sum->extraction.fp = fp;
+    out_open( &sum->out, STDOUT_FILENO );
+
+    if ( target.DIR_Attr & 0x10 )
+    {
+        if ( !walk_tree( &sum->tree, first_cluster( &target ), "", hashsum_visit, sum, &sum->out ) )
+        {
+            printf( "Error: Could not start worker threads. \n" );
+        }
+    }
+    else if ( grow_array( ( void ** )&sum->extraction.jobs, &sum->capacity, 1, sizeof( struct ExtractJob ) ) )
+    {
+        if ( long_name.valid ) utf16_to_utf8( long_name.chars, long_name.length, name, sizeof( name ) );
+        else format_short_name( target.DIR_Name, name );
+
+        struct ExtractJob *job = &sum->extraction.jobs[ sum->extraction.count++ ];
+        memset( job, 0, sizeof( struct ExtractJob ) );
+        job->cluster = first_cluster( &target );
+        job->size = target.DIR_FileSize;
+        job->host_path = strdup( name );
+        job->name = job->host_path ? job->host_path : "";
+    }
+
+    // Read in disk order, so the image is swept once from front to back
+    qsort( sum->extraction.jobs, sum->extraction.count, sizeof( struct ExtractJob ), compare_jobs );
+    clock_gettime( CLOCK_MONOTONIC, &sum->flushed );
+    parallel_for( sum->extraction.count, worker_count(), grep_visit, &search );
+    out_close( &sum->out );
+    if ( sum->errors > 0 ) fprintf( stderr, "Error: %u files or directories could not be read. \n", sum->errors );
+
+    for ( i = 0; i < sum->extraction.count; i++ ) free( sum->extraction.jobs[ i ].host_path );
+    for ( i = 0; i < MAX_WORKERS; i++ ) free( sum->extraction.buffers[ i ] );
+    free( sum->extraction.jobs );
+    pthread_mutex_destroy( &sum->lock );
+    tree_free( &sum->tree );
+}
+
+/*
+ * Function    : compare_runs
+ * Parameters  : Two cluster runs
+ * Returns     : Order of their first clusters, for qsort
+ */
+int compare_runs( const void *a, const void *b )
+{
+    uint32_t x = ( ( const struct ClusterRun * )a )->first, y = ( ( const struct ClusterRun * )b )->first;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Function    : merge_runs
+ * Parameters  : Runs of a file with their count
+ * Returns     : Number of runs left
+ * Description : Sorts the runs so the data is written front to back in one sweep over the volume, and
+ *               joins runs that follow each other. Extents end at group boundaries, so a file that
+ *               spans groups is taken in pieces that are often one run on the volume.
+ */
+uint32_t merge_runs( struct ClusterRun *runs, uint32_t count )
+{
+    uint32_t merged = 0, i;
+
+    if ( count == 0 ) return 0;
+    qsort( runs, count, sizeof( struct ClusterRun ), compare_runs );
+    for ( i = 1; i < count; i++ )
+    {
+        if ( runs[ merged ].first + runs[ merged ].count == runs[ i ].first ) runs[ merged ].count += runs[ i ].count;
+        else runs[ ++merged ] = runs[ i ];
+    }
+    return merged + 1;
+}
+
+/*
+ * Function    : pick_extent
+ * Parameters  : Number of clusters wanted, the first group and number of groups to look in, and the
+ *               group to fill in
+ * Returns     : The shortest free extent of those groups that holds them all, or else the longest free
+ *               extent, the first one on ties, or NULL if no cluster is free
+ */
+struct FreeExtent *pick_extent( uint32_t needed, uint32_t from, uint32_t span, struct AllocationGroup **group )
+{
+    struct FreeExtent *best = NULL, *longest = NULL, *extent;
+    struct AllocationGroup *longest_group = NULL;
+    uint32_t i;
+
+    for ( i = from; i < from + span; i++ )
+    {
+        struct FreeExtents *tree = &allocator.groups[ i ].extents;
+        if ( ( extent = extent_best_fit( tree, needed ) ) && ( !best || extent->count < best->count ) )
+        {
+            best = extent;
+            *group = &allocator.groups[ i ];
+        }
+        if ( !best && ( extent = extent_longest( tree ) ) && ( !longest || extent->count > longest->count ) )
+        {
+            longest = extent;
+            longest_group = &allocator.groups[ i ];
+        }
+    }
+    if ( best ) return best;
+    *group = longest_group;
+    return longest;
+}
+
+/*
+ * Function    : best_fit_runs
+ * Parameters  : Number of clusters wanted, the first group and number of groups to take them from, the
+ *               cluster the new ones should follow if possible (0 for none), and the run array to fill
+ *               in with its count and capacity
+ * Returns     : Number of clusters taken
+ * Description : Clusters right after the given one are taken if there are enough of them, which
+ *               extends a chain without a gap. Otherwise the shortest free extent that holds them all
+ *               is used, leaving the long extents for long files. Only if none is long enough is the
+ *               file split, over the longest extents first so it is in as few pieces as possible, and
+ *               going on into the extent that starts where a piece ends, such as in the next group. Each
+ *               step is O(log n) in the number of free extents of a group. The caller owns the groups.
+ */
+uint32_t best_fit_runs( uint32_t needed, uint32_t from, uint32_t span, uint32_t near, struct ClusterRun **runs, uint32_t *count, uint64_t *capacity )
+{
+    struct AllocationGroup *group = NULL;
+    struct FreeExtent *extent = NULL;
+    uint32_t left = needed;
+
+    if ( near >= 2 && near + 1 < fat_entries )
+    {
+        group = group_of( near + 1 );
+        extent = extent_floor( &group->extents, near + 1 );
+        if ( group < allocator.groups + from || group >= allocator.groups + from + span ) extent = NULL;
+        if ( extent && ( extent->first != near + 1 || extent->count < needed ) ) extent = NULL;
+    }
+    if ( !extent ) extent = pick_extent( needed, from, span, &group );
+
+    while ( left > 0 && extent )
+    {
+        if ( !grow_array( ( void ** )runs, capacity, *count + 1, sizeof( struct ClusterRun ) ) ) break;
+
+        uint32_t take = extent->count < left ? extent->count : left;
+        ( *runs )[ *count ].first = extent->first;
+        ( *runs )[ ( *count )++ ].count = take;
+        uint32_t end = extent->first + take;
+        extent_take( &group->extents, extent, extent->first, take );
+        left -= take;
+        if ( left == 0 ) break;
+
+        // The free extent right after the run joins it whatever its length, see merge_runs()
+        extent = NULL;
+        if ( end < fat_entries && ( group = group_of( end ) ) < allocator.groups + from + span )
+        {
+            extent = extent_floor( &group->extents, end );
+            if ( extent && extent->first != end ) extent = NULL;
+        }
+        if ( !extent ) extent = pick_extent( left, from, span, &group );
+    }
+    return needed - left;
+}
+
+/*
+ * Function    : give_back
+ * Parameters  : Runs reserved by an allocation with their count
+ * Description : Returns reserved clusters that were not linked into the FAT to the free extents
+ */
+void give_back( struct ClusterRun *runs, uint32_t count )
+{
+    uint32_t i;
+    for ( i = 0; i < count; i++ ) add_free_clusters( runs[ i ].first, runs[ i ].count );
+}
+
+/*
+ * Function    : allocate_clusters
+ * Parameters  : Fat32 info structure, the fat32 image, number of clusters wanted, the cluster the new
+ *               ones should follow if possible (0 for none), and the run array to fill in with its capacity
+ * Returns     : Number of runs the clusters were found in, or 0 if the volume has too few free clusters
+ * Description : Reserves all the clusters of a file at once from the free extent index, so a file
+ *               whose size is known is placed as a whole, with a best fit over every group, see
+ *               best_fit_runs(). The runs are taken out of the index but not marked in the FAT, see
+ *               link_runs(). For the main thread only; workers allocate with group_allocate().
+ */
+uint32_t allocate_clusters( struct f32info *f32, FILE *fp, uint32_t needed, uint32_t near, struct ClusterRun **runs, uint64_t *capacity )
+{
+    uint32_t count = 0;
+
+    if ( !build_free_extents( f32, fp ) ) return 0;
+
+    if ( best_fit_runs( needed, 0, allocator.group_count, near, runs, &count, capacity ) < needed )
+    {
+        give_back( *runs, count ); // Too few free clusters, or out of memory
+        return 0;
+    }
+    return merge_runs( *runs, count );
+}
+
+/*
+ * Function    : claim_group
+ * Parameters  : Group number and worker
+ * Returns     : 1 if the worker now owns the group, 0 if another worker does
+ */
+int claim_group( uint32_t group, int worker )
+{
+    int expected = 0;
+    return __atomic_compare_exchange_n( &allocator.groups[ group ].owner, &expected, worker + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED );
+}
+
+/*
+ * Function    : release_group
+ * Parameters  : Group number owned by the calling worker
+ * Description : Hands the group on, with every change made to its extents visible to the next owner
+ */
+void release_group( uint32_t group )
+{
+    __atomic_store_n( &allocator.groups[ group ].owner, 0, __ATOMIC_RELEASE );
+}
+
+/*
+ * Function    : claim_groups
+ * Parameters  : First group, number of consecutive groups, and worker
+ * Returns     : Free clusters in the groups
+ * Description : Waits for each group in turn. Groups are always claimed in ascending order and a
+ *               worker holding a single group never waits, so two workers never wait on each other.
+ */
+uint64_t claim_groups( uint32_t from, uint32_t span, int worker )
+{
+    uint64_t free = 0;
+    uint32_t i;
+
+    for ( i = from; i < from + span; i++ )
+    {
+        while ( !claim_group( i, worker ) ) sched_yield(); // Owners hold a group for one file's tree operations
+        free += allocator.groups[ i ].extents.clusters;
+    }
+    return free;
+}
+
+/*
+ * Function    : release_groups
+ * Parameters  : First group and number of consecutive groups owned by the calling worker
+ */
+void release_groups( uint32_t from, uint32_t span )
+{
+    uint32_t i;
+    for ( i = from; i < from + span; i++ ) release_group( i );
+}
+
+/*
+ * Function    : group_allocate
+ * Parameters  : Worker, its home group, number of clusters wanted, 1 if no other worker allocates at
+ *               the same time, and the run array to fill in with its count and capacity
+ * Returns     : 1 if all the clusters were reserved, 0 if not. The runs reserved so far are left in
+ *               the array then, for the main thread to give back.
+ * Description : Allocation for workers that write files at the same time. A worker only touches the
+ *               extents of groups it owns, and owns them just for the tree operations of one file, so
+ *               no lock is taken and groups pass from worker to worker with one atomic exchange.
+ *               A file that fits a group goes to the first group from the worker's home group on
+ *               that holds it whole, skipping those owned by others and coming back to them later,
+ *               so the files of one worker end up next to each other. A larger file, or one no group
+ *               holds whole, gets a best fit like allocate_clusters() over consecutive groups from
+ *               home with room for it, or else over all groups. A single writer always gets the best
+ *               fit over all groups.
+ */
+int group_allocate( int worker, uint32_t home, uint32_t needed, int alone, struct ClusterRun **runs, uint32_t *count, uint64_t *capacity )
+{
+    uint32_t groups = allocator.group_count, left = needed, i;
+    uint64_t all = groups == 64 ? ~0ULL : ( 1ULL << groups ) - 1, visited = 0;
+
+    *count = 0;
+    while ( !alone && needed <= allocator.group_size && visited != all && left > 0 )
+    {
+        for ( i = 0; i < groups && left > 0; i++ )
+        {
+            uint32_t group = ( home + i ) % groups;
+            if ( ( visited >> group & 1 ) || !claim_group( group, worker ) ) continue;
+            visited |= 1ULL << group;
+
+            if ( extent_best_fit( &allocator.groups[ group ].extents, needed ) ) left -= best_fit_runs( left, group, 1, 0, runs, count, capacity );
+            release_group( group );
+        }
+        if ( visited != all && left > 0 ) sched_yield(); // The rest are busy for a moment
+    }
+
+    if ( left > 0 )
+    {
+        // Two spare groups leave room for the extents a span of partly used groups is made of
+        uint32_t span = alone ? groups : needed / allocator.group_size + 2;
+        if ( span > groups ) span = groups;
+        uint32_t from = home + span > groups ? groups - span : home;
+
+        if ( claim_groups( from, span, worker ) < needed && span < groups )
+        {
+            release_groups( from, span );
+            from = 0;
+            span = groups;
+            claim_groups( from, span, worker );
+        }
+        left -= best_fit_runs( left, from, span, 0, runs, count, capacity );
+        release_groups( from, span );
+    }
+    if ( left > 0 ) return 0;
+
+    *count = merge_runs( *runs, *count );
+    return 1;
+}
+
+/*
+ * Function    : link_runs
+ * Parameters  : Fat32 info structure, and the runs of a new chain with their count
+ * Description : Chains the reserved runs together in the FAT in memory and ends the chain. The changed
+ *               sectors are written by the next flush_fat().
+ */
+void link_runs( struct f32info *f32, struct ClusterRun *runs, uint32_t count )
+{
+    uint32_t i, k;
+
+    for ( i = 0; i < count; i++ )
+    {
+        for ( k = 0; k + 1 < runs[ i ].count; k++ ) fat_store( f32, runs[ i ].first + k, runs[ i ].first + k + 1 );
+        fat_store( f32, runs[ i ].first + runs[ i ].count - 1, i + 1 < count ? runs[ i + 1 ].first : 0x0fffffff );
+    }
+}
+
+/*
+ * Function    : release_runs
+ * Parameters  : Fat32 info structure, and runs with their count
+ * Description : Marks the clusters of the runs free again in the FAT in memory
+ */
+void release_runs( struct f32info *f32, struct ClusterRun *runs, uint32_t count )
+{
+    uint32_t i, k;
+
+    for ( i = 0; i < count; i++ )
+    {
+        for ( k = 0; k < runs[ i ].count; k++ ) fat_set( f32, runs[ i ].first + k, 0 );
+    }
+}
 
-        printf( "Name:               %s \n", name_buffer );
-        printf( "Attribute:          %#x\n", dir[ entry ].DIR_Attr );
-        printf( "FirstClusterHigh:   %u \n", dir[ entry ].DIR_FirstClusterHigh );
-        printf( "FirstClusterLow:    %u \n", dir[ entry ].DIR_FirstClusterLow );
-        printf( "FileSize:           %u \n", dir[ entry ].DIR_FileSize );
+/*
+ * Function    : make_short_name
+ * Parameters  : Name typed by the user and the 11 byte DIR_Name to fill in
+ * Returns     : 1 if the name is a valid 8.3 name, 0 otherwise
+ */
+int make_short_name( const char *input, char *name )
+{
+    const char *dot = strrchr( input, '.' );
+    size_t base = dot ? ( size_t )( dot - input ) : strlen( input );
+    size_t extension = dot ? strlen( dot + 1 ) : 0;
+    size_t i;
+
+    if ( base == 0 || base > 8 || extension > 3 || ( dot && extension == 0 ) ) return 0;
+
+    memset( name, ' ', 11 );
+    for ( i = 0; input[ i ]; i++ )
+    {
+        unsigned char c = input[ i ];
+        if ( input + i == dot ) continue;
+        if ( c <= ' ' || c >= 0x7f || strchr( "\"*+,./:;<=>?[\\]|", c ) ) return 0;
+        if ( dot && input + i > dot ) name[ 8 + ( input + i - dot - 1 ) ] = toupper( c );
+        else name[ i ] = toupper( c );
     }
+    if ( ( uint8_t )name[ 0 ] == 0xe5 ) name[ 0 ] = 0x05; // 0xe5 would mark the entry deleted
+    return 1;
 }
 
 /*
- * Function    : cd
- * Parameters  : User filename input, directory, fat32info, and the current file pointer
- * Description : Changes the currect working directory to the given directory
+ * Function    : fat_stamp
+ * Parameters  : Time and the FAT date and time to fill in
+ * Description : Converts a time to the local date and 2 second time of a directory entry
  */
-void cd( char *filename, struct DirectoryEntry *dir, struct f32info *f32, FILE *fp )
+void fat_stamp( time_t seconds, uint16_t *date, uint16_t *time )
 {
-    int entry;
-    char entry_attr;
+    struct tm local;
 
-    if( strncmp( filename, ".", strlen(filename)) == 0 ) return;
+    localtime_r( &seconds, &local );
+    if ( local.tm_year < 80 )
+    {
+        *date = ( 1 << 5 ) | 1; // 1980-01-01, the earliest date FAT has
+        *time = 0;
+        return;
+    }
+    *date = ( ( local.tm_year - 80 ) << 9 ) | ( ( local.tm_mon + 1 ) << 5 ) | local.tm_mday;
+    *time = ( local.tm_hour << 11 ) | ( local.tm_min << 5 ) | ( local.tm_sec / 2 );
+}
 
-    entry = find_file( filename, dir );
+/*
+ * Function    : write_runs
+ * Parameters  : Fat32 info structure, the fat32 image, host file descriptor, number of bytes, and the
+ *               runs the data goes to with their count
+ * Returns     : 1 on success, 0 after printing an error
+ * Description : Copies the host file into the clusters of its runs, up to a buffer of consecutive
+ *               clusters per write. The end of the last cluster is filled with zeros, so no old data
+ *               of the volume is left behind in the file's slack.
+ */
+int write_runs( struct f32info *f32, FILE *fp, int fd, uint64_t size, struct ClusterRun *runs, uint32_t count )
+{
+    uint32_t bytes = cluster_size( f32 ), per_buffer = COPY_BUFFER_SIZE / bytes, i, k;
+    uint64_t done = 0;
 
-    // File not found
-    if ( entry == -1 )
+    uint8_t *buffer = ( uint8_t * )malloc( ( size_t )per_buffer * bytes );
+    if ( !buffer )
     {
-        printf( "Error: File not found. \n" );
+        printf( "Error: Out of memory. \n" );
+        return 0;
     }
-    // File found
-    else
+
+    for ( i = 0; i < count; i++ )
     {
-        // Fails if selected entry is not a directory
-        entry_attr = dir[ entry ].DIR_Attr;
-        if ( entry_attr != 0x10 )
+        for ( k = 0; k < runs[ i ].count; )
         {
-            printf( "Error: Entry is not a directory. \n" );
-            return;
-        }
+            uint32_t clusters = runs[ i ].count - k < per_buffer ? runs[ i ].count - k : per_buffer;
+            size_t chunk = ( size_t )clusters * bytes;
+            size_t want = chunk < size - done ? chunk : size - done;
+            size_t got = 0;
 
-        int cluster = dir[ entry ].DIR_FirstClusterLow;
+            while ( got < want )
+            {
+                ssize_t n = read( fd, buffer + got, want - got );
+                if ( n < 0 && errno == EINTR ) continue;
+                if ( n <= 0 ) break;
+                got += n;
+            }
+            if ( got < want )
+            {
+                printf( "Error: Could not read the host file: %s\n", got ? strerror( errno ) : "file shrank while copying" );
+                free( buffer );
+                return 0;
+            }
 
-        if ( cluster == 0 ) // Going to root
-        {
-            cluster = f32->BPB_RootClus;
+            memset( buffer + want, 0, chunk - want );
+            if ( write_at( fp, buffer, chunk, LBAToOffset( runs[ i ].first + k, f32 ) ) != ( ssize_t )chunk )
+            {
+                printf( "Error: Could not write the image: %s\n", strerror( errno ) );
+                free( buffer );
+                return 0;
+            }
+            done += want;
+            k += clusters;
         }
-        int offset = LBAToOffset( cluster, f32 );
-
-        fseek( fp, offset, SEEK_SET );
-        fread( &dir[ 0 ], 32, 16, fp );
     }
+    free( buffer );
+    return 1;
 }
 
-void cd_input( char *filepath, struct DirectoryEntry *dir, struct f32info *f32, FILE *fp )
+/*
+ * Function    : open_put_target
+ * Parameters  : Directory path (NULL for the working directory), fat32info, the current file pointer,
+ *               and the target to fill in
+ * Returns     : 1 on success, 0 after printing an error
+ * Description : Reads the directory new files are put in, with its cluster chain
+ */
+int open_put_target( char *path, struct f32info *f32, FILE *fp, struct PutTarget *target )
 {
-    if ( filepath == NULL ) return;
+    struct DirectoryEntry found;
+    uint32_t next;
 
-    if ( filepath[ 0 ] == '/' ) // if starts with /, is absolute filepath. fseek and fread to root directory
+    memset( target, 0, sizeof( struct PutTarget ) );
+    if ( !resolve_path( path, f32, fp, &found, NULL ) || !( found.DIR_Attr & 0x10 ) )
     {
-        int rootOffset = LBAToOffset( f32->BPB_RootClus, f32 );
-        fseek( fp, rootOffset, SEEK_SET );
-        fread( &dir[ 0 ], 32, 16, fp );
+        printf( "Error: Directory not found. \n" );
+        return 0;
     }
 
-    char *working_token = strtok( filepath, "/" );
-    char *file_token[ 50 ];
-    int token_cnt = 0;
-
-    while ( working_token != NULL )
+    target->cluster = first_cluster( &found );
+    target->entries = read_directory( target->cluster, f32, fp, &target->count );
+    for ( next = target->cluster; target->entries && next >= 2 && target->chain_length < fat_entries; next = next_cluster( next ) )
     {
-        file_token[ token_cnt ] = ( char * )malloc( sizeof( strlen( working_token ) ) );
-        strncpy( file_token[ token_cnt ], working_token, strlen( working_token ) );
-        working_token = strtok( NULL, "/" );
-        token_cnt++;
+        if ( !grow_array( ( void ** )&target->chain, &target->chain_capacity, target->chain_length + 1, sizeof( uint32_t ) ) ) break;
+        target->chain[ target->chain_length++ ] = next;
     }
-
-    int token_index = 0;
-    for ( token_index = 0; token_index < token_cnt; token_index++ )
+    if ( !target->entries || !target->chain_length || !build_free_extents( f32, fp ) )
     {
-        cd( file_token[ token_index ], dir, f32, fp );
+        printf( "Error: Could not read directory. \n" );
+        return 0;
     }
+    return 1;
 }
 
 /*
- * Function    : ls
- * Parameters  : User filename input, directory, fat32info, and the current file pointer
- * Description : Lists all files and sub-directories contained in specified directory
+ * Function    : add_put_job
+ * Parameters  : Target directory, job array with its count and capacity, host file path, and the name
+ *               of the new entry
+ * Returns     : 1 if the file was added, 0 after printing why not
+ * Description : Adds a file to put if its name is a valid 8.3 name that is neither in the directory
+ *               nor taken by a file added before it
  */
-void ls( char *filename, struct DirectoryEntry *dir, struct f32info *f32, FILE *fp )
+int add_put_job( struct PutTarget *target, struct PutJob **jobs, uint32_t *count, uint64_t *capacity, char *host_path, const char *name )
 {
-    int i;
-    uint8_t first_byte;
-    char input_name[ 12 ];
-    memset( input_name, '\0', 12 );
-    struct DirectoryEntry *original_dir = ( struct DirectoryEntry * )malloc( sizeof( struct DirectoryEntry ) * 16 ); // since fat32 can only have 16 represented
+    char short_name[ 11 ];
+    uint32_t i;
 
-    for ( i = 0; i < 16; i++ )
+    if ( !make_short_name( name, short_name ) )
     {
-        original_dir[ i ] = dir[ i ];
+        printf( "Error: %s is not a valid 8.3 name. \n", name );
+        return 0;
     }
-    
-    cd_input( filename, dir, f32, fp );
-    
-    // As DIR_Name does not terminate with a '\0' null character,
-    // it needs to be added manually
-    char name_buffer[ 12 ];
-    char entry_attr;
-
-    for ( i = 0; i < 16; i++ )
+    for ( i = 0; i < ( uint32_t )target->count && target->entries[ i ].DIR_Name[ 0 ] != 0x00; i++ )
     {
-        // Skip if directory entry is not a read-only file, a sub-directory, or an archive
-        entry_attr = dir[ i ].DIR_Attr;
-        if ( entry_attr != 0x01 && entry_attr != 0x10 && entry_attr != 0x20 ) continue;
-
-        strncpy( name_buffer, dir[ i ].DIR_Name, 11 ); // Copy 11 characters from DIR_Name (total size is 11 bytes) to name buffer
-        name_buffer[ 11 ] = '\0';                      // Manually add null character in index 12
-
-        // Skip if directory entry is deleted
-        first_byte = name_buffer[ 0 ];
-        if ( first_byte == 0xe5 ) continue;
-
-        printf( "%s \n", name_buffer ); // Print name buffer
+        struct DirectoryEntry *entry = &target->entries[ i ];
+        if ( ( uint8_t )entry->DIR_Name[ 0 ] != 0xe5 && entry->DIR_Attr != LFN_ATTR && !memcmp( entry->DIR_Name, short_name, 11 ) )
+        {
+            printf( "Error: %s already exists. \n", name );
+            return 0;
+        }
+    }
+    for ( i = 0; i < *count; i++ )
+    {
+        if ( !memcmp( ( *jobs )[ i ].short_name, short_name, 11 ) )
+        {
+            printf( "Error: %s and %s have the same name. \n", ( *jobs )[ i ].host_path, host_path );
+            return 0;
+        }
     }
-    for ( i = 0; i < 16; i++ )
+    if ( !grow_array( ( void ** )jobs, capacity, *count + 1, sizeof( struct PutJob ) ) )
     {
-        dir[ i ] = original_dir[ i ];
+        printf( "Error: Out of memory. \n" );
+        return 0;
     }
-    free( original_dir );
+
+    struct PutJob *job = &( *jobs )[ ( *count )++ ];
+    memset( job, 0, sizeof( struct PutJob ) );
+    job->host_path = host_path;
+    job->name = name;
+    memcpy( job->short_name, short_name, 11 );
+    return 1;
 }
 
 /*
- * Function    : del
- * Parameters  : User filename input, directory, fat32info, and the current file pointer
- * Description : Deletes a file from the directory
+ * Function    : put_visit
+ * Parameters  : Put batch, worker, and job
+ * Description : Reserves the clusters of one host file from the worker's allocation groups, copies
+ *               the file into them and chains them in the FAT in memory. Several workers run this
+ *               at once, each in its own clusters, so nothing here takes a lock.
  */
-void del( char *filename, struct DirectoryEntry *dir, struct f32info *f32, FILE *fp )
+void put_visit( void *context, int worker, uint32_t item )
 {
-    int entry;
-    char entry_attr;
-
-    entry = find_file( filename, dir );
+    struct PutBatch *batch = ( struct PutBatch * )context;
+    struct PutJob *job = &batch->jobs[ item ];
 
-    // File not found
-    if ( entry == -1 )
+    int fd = open( job->host_path, O_RDONLY );
+    if ( fd < 0 || fstat( fd, &job->host ) != 0 || !S_ISREG( job->host.st_mode ) )
     {
-        printf( "Error: File not found. \n" );
+        printf( "Error: Could not open %s: %s\n", job->host_path, fd < 0 ? strerror( errno ) : "not a regular file" );
+        if ( fd >= 0 ) close( fd );
+        return;
     }
-    // File found
-    else
+    if ( ( uint64_t )job->host.st_size > 0xffffffffULL )
     {
-        struct deletedFile *new = create_deletedFile();
-        strncpy( new->name, dir[ entry ].DIR_Name, 11 );
-
-        struct deletedFile *runner = head;
-        while ( runner->next != NULL )
-        {
-            runner = runner->next;
-        }
-        runner->next = new;
+        printf( "Error: %s is larger than the 4 GiB a FAT32 file can hold. \n", job->host_path );
+        close( fd );
+        return;
+    }
+    posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
 
-        dir[ entry ].DIR_Name[ 0 ] = 0xe5;
+    // Workers start in groups spread over the volume, so each has room to keep its files together
+    uint32_t bytes = cluster_size( batch->f32 );
+    uint32_t needed = ( uint32_t )( ( ( uint64_t )job->host.st_size + bytes - 1 ) / bytes );
+    uint32_t home = ( batch->home + ( uint64_t )worker * allocator.group_count / batch->workers ) % allocator.group_count;
 
-        // int offset = LBAToOffset( dir[i].DIR_FirstClusterLow, f32 ); //dir[i].DIR_FirstClusterLow
-        // fseek( fp, offset, SEEK_SET );
-        // fwrite( &( dir[i].DIR_Name[0] ), 1, 1, fp );
-        int offset = LBAToOffset( dir[ 0 ].DIR_FirstClusterLow, f32 );
-        fseek( fp, offset, SEEK_SET );
-        fwrite( &dir[ 0 ], 32, 16, fp ); // update image file
+    if ( needed > 0 && !group_allocate( worker, home, needed, batch->workers == 1, &job->runs, &job->run_count, &job->capacity ) )
+    {
+        printf( "Error: Not enough free space for %s. \n", job->host_path );
+    }
+    else if ( write_runs( batch->f32, batch->fp, fd, job->host.st_size, job->runs, job->run_count ) )
+    {
+        link_runs( batch->f32, job->runs, job->run_count );
+        job->ok = 1;
     }
+    close( fd );
 }
 
 /*
- * Function    : undel
- * Parameters  : User filename input, directory, fat32info, and the current file pointer
- * Description : Undeletes a file from the directory
+ * Function    : put_files
+ * Parameters  : Target directory, the files to put with their count, the number of workers (0 for
+ *               one per processor), directory, fat32info, and the current file pointer
+ * Description : Copies the files into the image on several workers, then adds their entries to the
+ *               directory in one go. The workers only reserve clusters, write data and fill in the FAT
+ *               in memory. The main thread then takes the directory slots, growing the directory if
+ *               it is full, writes every FAT sector any worker or group changed once to each FAT copy,
+ *               and only then writes the entries, so an interrupted put never leaves an entry that
+ *               points at missing data. If the FAT cannot be written the new chains are unlinked again,
+ *               and a file whose entry cannot be written has its clusters freed.
  */
-void undel( char *filename, struct DirectoryEntry *dir, struct f32info *f32, FILE *fp )
+void put_files( struct PutTarget *target, struct PutJob *jobs, uint32_t count, int workers, struct DirectoryEntry *dir, struct f32info *f32, FILE *fp )
 {
-    int i;
-    int file_deleted = 0;
-    int file_not_found = 1;
-    char entry_attr;
+    struct PutBatch batch;
+    struct ClusterRun *grown = NULL;
+    struct timespec start;
+    uint64_t grown_capacity = 0, bytes = 0, clusters = 0;
+    uint32_t per_cluster = cluster_size( f32 ) / sizeof( struct DirectoryEntry );
+    uint32_t written = 0, wanted = 0, found = 0, grown_count = 0, last_slot = 0, next_free = 0, orphaned = 0, i, k;
+
+    batch.f32 = f32;
+    batch.fp = fp;
+    batch.jobs = jobs;
+    batch.home = ( group_of( target->cluster ) - allocator.groups );
+    batch.workers = workers > 0 ? workers : worker_count();
+    if ( batch.workers > MAX_WORKERS ) batch.workers = MAX_WORKERS;
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    parallel_for( count, batch.workers, put_visit, &batch );
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( jobs[ i ].ok ) wanted++;
+        else give_back( jobs[ i ].runs, jobs[ i ].run_count ); // Reserved but never linked
+    }
 
-    // Search directory for entry
-    struct deletedFile *runner = head;
-    while ( runner->next != NULL )
+    // Deleted slots, then the free ones from the end of directory marker on
+    uint32_t *slots = ( uint32_t * )calloc( wanted + 1, sizeof( uint32_t ) );
+    uint32_t end = target->count, slot_count = target->chain_length * per_cluster;
+    for ( i = 0; i < ( uint32_t )target->count; i++ )
     {
-        if ( compare_filename( filename, runner->next->name ) ) // Found name match
+        if ( target->entries[ i ].DIR_Name[ 0 ] == 0x00 )
         {
-            file_deleted = 1;
+            end = i;
             break;
         }
-        else runner = runner->next;
     }
-    if ( file_deleted )
+    for ( i = 0; slots && i < slot_count && found < wanted; i++ )
     {
-        for ( i = 0; i < 16; i++ )
-        {
-            entry_attr = dir[ i ].DIR_Attr;
-            if ( entry_attr != 0x01 && entry_attr != 0x10 && entry_attr != 0x20 ) continue;
+        if ( i >= end || ( uint8_t )target->entries[ i ].DIR_Name[ 0 ] == 0xe5 ) slots[ found++ ] = i;
+    }
+
+    // A full directory grows by zeroed clusters at the end of its chain
+    if ( slots && found < wanted )
+    {
+        uint32_t more = ( wanted - found + per_cluster - 1 ) / per_cluster;
+        uint32_t last = target->chain[ target->chain_length - 1 ];
+        uint8_t *zeros = ( uint8_t * )calloc( per_cluster, sizeof( struct DirectoryEntry ) );
 
-            if ( compare_deleted_filename( filename, dir[ i ].DIR_Name ) ) // Found name match
+        grown_count = zeros ? allocate_clusters( f32, fp, more, last, &grown, &grown_capacity ) : 0;
+        for ( i = 0; i < grown_count; i++ )
+        {
+            for ( k = 0; k < grown[ i ].count; k++ )
             {
-                file_not_found = 0;
-                break;
+                if ( write_at( fp, zeros, cluster_size( f32 ), LBAToOffset( grown[ i ].first + k, f32 ) ) != cluster_size( f32 ) ) break;
+            }
+            if ( k < grown[ i ].count ) break;
+        }
+        if ( grown_count && i == grown_count && grow_array( ( void ** )&target->chain, &target->chain_capacity, target->chain_length + more, sizeof( uint32_t ) ) )
+        {
+            link_runs( f32, grown, grown_count );
+            fat_set( f32, last, grown[ 0 ].first );
+            for ( i = 0; i < grown_count; i++ )
+            {
+                for ( k = 0; k < grown[ i ].count; k++ ) target->chain[ target->chain_length++ ] = grown[ i ].first + k;
             }
+            target->grown = more;
+            for ( i = slot_count; found < wanted; i++ ) slots[ found++ ] = i;
+        }
+        else
+        {
+            give_back( grown, grown_count );
+            printf( "Error: No room for %u more entries in the directory. \n", wanted - found );
         }
+        free( zeros );
     }
 
-    // File was not found
-    if ( file_not_found )
+    // Files without a slot are freed again, in the FAT in memory before it is written
+    for ( i = 0, k = 0; i < count; i++ )
     {
-        printf( "Error: File not found. \n" );
+        if ( !jobs[ i ].ok ) continue;
+        if ( k++ < found ) continue;
+        release_runs( f32, jobs[ i ].runs, jobs[ i ].run_count );
+        jobs[ i ].ok = 0;
     }
-    else
-    {
-        dir[ i ].DIR_Name[ 0 ] = runner->next->name[ 0 ];
 
-        // int offset = LBAToOffset( dir[i].DIR_FirstClusterLow, f32 ); //dir[i].DIR_FirstClusterLow
-        // fseek( fp, offset, SEEK_SET );
-        // fwrite( &( dir[i].DIR_Name[0] ), 1, 1, fp );
-        int offset = LBAToOffset( dir[ 0 ].DIR_FirstClusterLow, f32 );
-        fseek( fp, offset, SEEK_SET );
-        fwrite( &dir[ 0 ], 32, 16, fp ); // update image file
+    if ( found > 0 && !flush_fat( f32, fp ) )
+    {
+        printf( "Error: Could not update the FAT: %s\n", strerror( errno ) );
+        found = 0;
 
-        // Delete file entry node
-        struct deletedFile *old = runner->next;
-        runner->next = runner->next->next;
-        free( old );
+        // Nothing is added then, so unlink every new chain and write back what the FAT held before
+        for ( i = 0; i < count; i++ )
+        {
+            if ( jobs[ i ].ok ) release_runs( f32, jobs[ i ].runs, jobs[ i ].run_count );
+            jobs[ i ].ok = 0;
+        }
+        if ( target->grown > 0 )
+        {
+            release_runs( f32, grown, grown_count );
+            target->chain_length -= target->grown;
+            fat_set( f32, target->chain[ target->chain_length - 1 ], 0x0fffffff );
+            target->grown = 0;
+        }
+        flush_fat( f32, fp );
     }
-}
 
-/*
- * Function    : get
- * Parameters  : User filename input, directory, fat32info, and the current file pointer
- * Description : Retrieves a file from the fat32 image and places it inside the current working directory
- */
-void get( char *filename, struct DirectoryEntry *dir, struct f32info *f32, FILE *fp )
-{
-    int entry;
-    int working_size;
-    int sector_size = f32->BPB_BytsPerSec;
+    for ( i = 0, k = 0; i < count && k < found; i++ )
+    {
+        struct PutJob *job = &jobs[ i ];
+        struct DirectoryEntry entry;
+        uint16_t date, stamp;
+        if ( !job->ok ) continue;
+
+        memset( &entry, 0, sizeof( entry ) );
+        memcpy( entry.DIR_Name, job->short_name, 11 );
+        entry.DIR_Attr = 0x20; // Archive
+        entry.DIR_FirstClusterHigh = job->run_count ? job->runs[ 0 ].first >> 16 : 0;
+        entry.DIR_FirstClusterLow = job->run_count ? job->runs[ 0 ].first & 0xffff : 0;
+        entry.DIR_FileSize = job->host.st_size;
+
+        // Created and accessed now, last written when the host file was
+        fat_stamp( time( NULL ), &date, &stamp );
+        memcpy( &entry.Unused1[ 2 ], &stamp, 2 );
+        memcpy( &entry.Unused1[ 4 ], &date, 2 );
+        memcpy( &entry.Unused1[ 6 ], &date, 2 );
+        fat_stamp( job->host.st_mtime, &date, &stamp );
+        memcpy( &entry.Unused2[ 0 ], &stamp, 2 );
+        memcpy( &entry.Unused2[ 2 ], &date, 2 );
+
+        uint32_t slot = slots[ k++ ];
+        if ( slot < ( uint32_t )target->count && ( uint8_t )target->entries[ slot ].DIR_Name[ 0 ] == 0xe5 && target->entries[ slot ].DIR_Attr != LFN_ATTR )
+        {
+            forget_deleted( target->cluster, slot );
+        }
+        off_t offset = LBAToOffset( target->chain[ slot / per_cluster ], f32 ) + ( off_t )( slot % per_cluster ) * sizeof( struct DirectoryEntry );
+        if ( write_at( fp, &entry, sizeof( entry ), offset ) != sizeof( entry ) )
+        {
+            printf( "Error: Could not write the directory entry of %s: %s\n", job->host_path, strerror( errno ) );
+            release_runs( f32, job->runs, job->run_count ); // No entry points at the chain
+            job->ok = 0;
+            orphaned++;
+            continue;
+        }
+        if ( slot > last_slot || written == 0 ) last_slot = slot;
+        written++;
+        bytes += entry.DIR_FileSize;
+        for ( uint32_t r = 0; r < job->run_count; r++ ) clusters += job->runs[ r ].count;
+        if ( job->run_count ) next_free = job->runs[ job->run_count - 1 ].first + job->runs[ job->run_count - 1 ].count;
+    }
 
-    entry = find_file( filename, dir );
+    if ( orphaned > 0 && !flush_fat( f32, fp ) )
+    {
+        printf( "Error: Could not free the clusters of files without an entry: %s\n", strerror( errno ) );
+    }
 
-    // File not found
-    if ( entry == -1 )
+    // Entries written past the end of directory marker need a new one after them
+    uint32_t after = last_slot + 1;
+    if ( written > 0 && last_slot >= end && after < slot_count && ( after >= ( uint32_t )target->count || target->entries[ after ].DIR_Name[ 0 ] != 0x00 ) )
     {
-        printf( "Error: File not found. \n" );
+        struct DirectoryEntry marker;
+        memset( &marker, 0, sizeof( marker ) );
+        write_at( fp, &marker, sizeof( marker ), LBAToOffset( target->chain[ after / per_cluster ], f32 ) + ( off_t )( after % per_cluster ) * sizeof( marker ) );
     }
-    // File found
-    else
+
+    if ( written > 0 || target->grown > 0 )
     {
-        working_size = dir[ entry ].DIR_FileSize;
-        FILE *localfp = fopen( filename, "w" );
+        double seconds = elapsed_seconds( &start );
+        if ( target->grown && !next_free ) next_free = target->chain[ target->chain_length - 1 ] + 1;
+        update_fsinfo( f32, fp, -( int64_t )( clusters + target->grown ), next_free ? next_free : 0xffffffff );
+
+        // Reload the working directory if the entries went into it
+        if ( target->cluster == cwd_cluster ) read_at( fp, dir, 32 * 16, LBAToOffset( cwd_cluster, f32 ) );
 
-        int nextSector = dir[ entry ].DIR_FirstClusterLow;
-        uint8_t data[ sector_size ];
+        struct VolumeIndex *index = volume_index ? volume_index : stale_index;
+        uint32_t dentry = index ? index_directory( index, target->cluster ) : INDEX_NONE;
+        if ( dentry != INDEX_NONE ) adjust_totals( index, dentry, bytes, clusters + target->grown );
+        invalidate_index();
 
-        while ( working_size > sector_size )
+        if ( count == 1 && written == 1 )
         {
-            // printf("working_size = %d\n", working_size);
-            fseek( fp, LBAToOffset( nextSector, f32 ), SEEK_SET );
-            fread( &data, sector_size, 1, fp );
-            fwrite( &data, sector_size, 1, localfp );
-            working_size -= sector_size;
-            nextSector = NextLB( nextSector, f32, fp );
+            printf( "Wrote %llu bytes to %s in %u extents in %.2f s (%.1f MB/s).\n", ( unsigned long long )bytes, jobs[ 0 ].name,
+                    jobs[ 0 ].run_count, seconds, seconds > 0 ? bytes / seconds / 1e6 : 0.0 );
+        }
+        else if ( count > 1 && written == count )
+        {
+            printf( "Wrote %u files, %llu bytes in %.2f s (%.1f MB/s).\n", written, ( unsigned long long )bytes, seconds,
+                    seconds > 0 ? bytes / seconds / 1e6 : 0.0 );
+        }
+        else if ( count > 1 )
+        {
+            printf( "Wrote %u of %u files, %llu bytes in %.2f s (%.1f MB/s).\n", written, count, ( unsigned long long )bytes, seconds,
+                    seconds > 0 ? bytes / seconds / 1e6 : 0.0 );
         }
-
-        fseek( fp, LBAToOffset( nextSector, f32 ), SEEK_SET );
-        fread( &data, working_size, 1, fp );
-        fwrite( &data, working_size, 1, localfp );
-
-        fclose( localfp );
     }
+
+    free( slots );
+    free( grown );
 }
 
 /*
- * Function    : read_file
- * Parameters  : Filename, position(bytes), number of bytes to read, directory, fat32info, and file pointer
- * Description : Reads the the file at the specified position and outputs the number of bytes specified
+ * Function    : free_put_target
+ * Parameters  : Target directory
  */
-void read_file( char *filename, char *position, char *num_bytes, struct DirectoryEntry *dir, struct f32info *f32, FILE *fp )
+void free_put_target( struct PutTarget *target )
 {
-    int entry;
-    int working_size = atoi( num_bytes );
-    int sector_size = f32->BPB_BytsPerSec;
-    int position_int = atoi( position ); // convert arguments to correct type
-
-    entry = find_file( filename, dir );
+    free( target->entries );
+    free( target->chain );
+}
 
-    // File not found
-    if ( entry == -1 )
+/*
+ * Function    : put
+ * Parameters  : Host file path, name in the image (NULL for the host file's own name), directory,
+ *               fat32info, and the current file pointer
+ * Description : Copies a host file into the image. The name is an 8.3 name, optionally behind the path
+ *               of an existing directory. See put_files().
+ */
+void put( char *host_path, char *name, struct DirectoryEntry *dir, struct f32info *f32, FILE *fp )
+{
+    struct PutTarget target;
+    struct PutJob *jobs = NULL;
+    char path[ MAX_COMMAND_SIZE + 1 ];
+    uint64_t capacity = 0;
+    uint32_t count = 0;
+
+    // Split the image name into the directory and the name of the new entry
+    snprintf( path, sizeof( path ), "%s", name ? name : host_path );
+    char *slash = strrchr( path, '/' );
+    char *base = slash ? slash + 1 : path;
+    char *directory = NULL;
+    if ( slash && name )
     {
-        printf( "Error: File not found. \n" );
+        *slash = '\0';
+        directory = path[ 0 ] ? path : ( char * )"/";
     }
-    // File found
-    else
-    {
-        int nextSector = dir[ entry ].DIR_FirstClusterLow;
-        uint8_t data;
 
-        while ( position_int >= sector_size ) // if position is larger than or equal to sector size, need to go to next sector
-        {
-            position_int -= sector_size;
-            nextSector = NextLB( nextSector, f32, fp );
-        }
+    if ( open_put_target( directory, f32, fp, &target ) && add_put_job( &target, &jobs, &count, &capacity, host_path, base ) )
+    {
+        put_files( &target, jobs, count, 1, dir, f32, fp );
+        free( jobs[ 0 ].runs );
+    }
+    free( jobs );
+    free_put_target( &target );
+}
 
-        fseek( fp, LBAToOffset( nextSector, f32 ) + position_int, SEEK_SET );
+/*
+ * Function    : mput
+ * Parameters  : Glob of host files, directory in the image (NULL for the working directory), directory,
+ *               fat32info, the current file pointer, and the copy options for --workers
+ * Description : Copies every regular host file the glob matches into the directory under its own name,
+ *               which must be an 8.3 name. The files are written by as many workers as there are
+ *               processors, each allocating from its own allocation groups. See put_files().
+ */
+void mput( char *pattern, char *path, struct DirectoryEntry *dir, struct f32info *f32, FILE *fp, struct CopyOptions *options )
+{
+    struct PutTarget target;
+    struct PutJob *jobs = NULL;
+    struct stat host;
+    glob_t matches;
+    uint64_t capacity = 0;
+    uint32_t count = 0;
+    size_t i;
+
+    if ( glob( pattern, 0, NULL, &matches ) != 0 )
+    {
+        printf( "Error: No host file matches %s. \n", pattern );
+        return;
+    }
 
-        int i, sector_index = 0;
-        for ( i = 0; i < working_size; i++ ) // print out every byte in hexadecimal
+    if ( open_put_target( path, f32, fp, &target ) )
+    {
+        for ( i = 0; i < matches.gl_pathc; i++ )
         {
-            if ( position_int + sector_index == sector_size ) // if reach end of sector, go to next sector
-            {
-                position_int = 0;
-                sector_index = 0;
-                nextSector = NextLB( nextSector, f32, fp );
-                fseek( fp, LBAToOffset( nextSector, f32 ), SEEK_SET );
-            }
-            fread( &data, 1, 1, fp );
-            printf( "%x ", data );
-            // printf( "%c", data );
-            sector_index++;
+            char *host_path = matches.gl_pathv[ i ];
+            if ( stat( host_path, &host ) != 0 || !S_ISREG( host.st_mode ) ) continue; // Directories and the like
+            const char *slash = strrchr( host_path, '/' );
+            add_put_job( &target, &jobs, &count, &capacity, host_path, slash ? slash + 1 : host_path );
         }
-        printf( "\n" );
+        if ( count > 0 ) put_files( &target, jobs, count, options->workers, dir, f32, fp );
+        else printf( "Error: No file to put. \n" );
     }
+
+    for ( i = 0; i < count; i++ ) free( jobs[ i ].runs );
+    free( jobs );
+    free_put_target( &target );
+    globfree( &matches );
 }
 
 int main()
@@ -713,6 +9089,7 @@ int main()
 
         /* Parse input */
         char *token[ MAX_NUM_ARGUMENTS ];
+        struct CopyOptions copy_options;
 
         int token_count = 0;
 
@@ -739,11 +9116,20 @@ int main()
             token_count++;
         }
 
+        // The loop stops at MAX_NUM_ARGUMENTS tokens. Anything but whitespace after them would
+        // otherwise be dropped without a word.
+        int too_many = arg_ptr != NULL && ( arg_ptr[ 0 ] != '\0' || ( working_str && working_str[ strspn( working_str, WHITESPACE ) ] != '\0' ) );
+
         // If the user types a blank line,
         // the program quietly prints another prompt and accepts a new line of input.
         if ( token[ 0 ] == NULL )
             ;
 
+        else if ( too_many )
+        {
+            printf( "Error: Too many arguments, a command takes at most %d.\n", MAX_NUM_ARGUMENTS - 1 );
+        }
+
         // opens a fat32 image.
         // filenames of fat32 images cannot not contain spaces and are limited to 100 characters.
         // if the file is not found or if a file system is already open, the program will
@@ -754,6 +9140,14 @@ int main()
             {
                 if ( token[ 1 ] == NULL ) printf( "Error: Filename not given.\n" );
                 else fp = openFat32File( token[ 1 ], fat32, dir );
+
+                // use the sidecar index of the image if one was written for it
+                if ( fp != NULL )
+                {
+                    index_path = ( char * )malloc( strlen( token[ 1 ] ) + strlen( INDEX_SUFFIX ) + 1 );
+                    sprintf( index_path, "%s%s", token[ 1 ], INDEX_SUFFIX );
+                    volume_index = load_index( index_path, fat32, fp );
+                }
             }
 
             else printf( "Error: File system image is already open.\n" );
@@ -769,6 +9163,7 @@ int main()
             {
                 fclose( fp );
                 fp = NULL;
+                close_volume();
             }
             else
             {
@@ -782,6 +9177,7 @@ int main()
             // cleanup
             free( working_root );
             if ( fp != NULL ) fclose( fp );
+            close_volume();
             free( fat32 );
             free( dir );
             struct deletedFile *runner = head;
@@ -807,15 +9203,59 @@ int main()
         else if ( !strcmp( token[ 0 ], "stat" ) )
         {
             if ( token[ 1 ] == NULL ) printf( "Error: Filename not given.\n" );
-            else stat( token[ 1 ], dir );
+            else stat_entry( token[ 1 ], dir );
         }
 
         // retrieves the file from the FAT32 image and places it in your current working directory.
         // if the file/directory does not exist then the program will output an error.
+        // --hash, --manifest and --verify checksum what get <file> and mget copy, --workers and --chunk
+        // tune the copy, see take_copy_options().
         else if ( !strcmp( token[ 0 ], "get" ) )
+        {
+            if ( !take_copy_options( token, &token_count, &copy_options ) )
+                ;
+            else if ( token[ 1 ] == NULL ) printf( "Error: Filename not given.\n" );
+            else if ( ( !strcmp( token[ 1 ], "-r" ) || ( token[ 2 ] != NULL && !strcmp( token[ 2 ], "-" ) ) ) &&
+                      ( copy_options.kind != HASH_NONE || copy_options.manifest || copy_options.verify ) )
+            {
+                printf( "Error: --hash, --manifest and --verify only work with get <file> and mget.\n" );
+            }
+            else if ( !strcmp( token[ 1 ], "-r" ) )
+            {
+                if ( token[ 2 ] == NULL || token[ 3 ] == NULL ) printf( "Error: Usage: get -r <dir> <dest>\n" );
+                else get_recursive( token[ 2 ], token[ 3 ], fat32, fp );
+            }
+            else if ( token[ 2 ] != NULL && !strcmp( token[ 2 ], "-" ) ) cat( token[ 1 ], fat32, fp );
+            else get( token[ 1 ], dir, fat32, fp, &copy_options );
+        }
+
+        // writes a file to standard output
+        else if ( !strcmp( token[ 0 ], "cat" ) )
         {
             if ( token[ 1 ] == NULL ) printf( "Error: Filename not given.\n" );
-            else get( token[ 1 ], dir, fat32, fp );
+            else cat( token[ 1 ], fat32, fp );
+        }
+
+        // prints a checksum of every file below a directory, as sha256sum does
+        else if ( !strcmp( token[ 0 ], "hashsum" ) )
+        {
+            if ( take_copy_options( token, &token_count, &copy_options ) ) hashsum( token[ 1 ], fat32, fp, &copy_options );
+        }
+
+        // writes a file or directory tree as a tar archive
+        else if ( !strcmp( token[ 0 ], "tar" ) )
+        {
+            if ( token[ 1 ] == NULL || token[ 2 ] == NULL ) printf( "Error: Usage: tar <path> <out.tar|->\n" );
+            else tar_command( token[ 1 ], token[ 2 ], fat32, fp );
+        }
+
+        // retrieves every file matching a glob into a host directory
+        else if ( !strcmp( token[ 0 ], "mget" ) )
+        {
+            if ( !take_copy_options( token, &token_count, &copy_options ) )
+                ;
+            else if ( token[ 1 ] == NULL ) printf( "Error: Filename not given.\n" );
+            else mget( token[ 1 ], token[ 2 ], fat32, fp, &copy_options );
         }
 
         // changes the current working directory to the given directory.
@@ -823,14 +9263,16 @@ int main()
         else if ( !strcmp( token[ 0 ], "cd" ) )
         {
             if ( token[ 1 ] == NULL ) printf( "Error: Filename not given.\n" );
-            else cd_input( token[ 1 ], dir, fat32, fp );
+            else cd( token[ 1 ], dir, fat32, fp );
         }
 
         // Lists the directory contents. Your program shall support listing “.” and “..” . Your program shall
         // not list deleted files or system volume names.
+        // "ls -R [path]" also lists every sub-directory
         else if ( !strcmp( token[ 0 ], "ls" ) )
         {
-            ls( token[ 1 ], dir, fat32, fp );
+            if ( token[ 1 ] != NULL && !strcmp( token[ 1 ], "-R" ) ) ls_recursive( token[ 2 ], fat32, fp );
+            else ls( token[ 1 ], fat32, fp );
         }
 
         // Reads from the given file at the position, in bytes, specified by the parameter,
@@ -838,7 +9280,37 @@ int main()
         else if ( !strcmp( token[ 0 ], "read" ) )
         {
             if ( token_count - 1 < 4 ) printf( "Error: Not enough arguments. (%d arguments given)\n", token_count );
-            else read_file( token[ 1 ], token[ 2 ], token[ 3 ], dir, fat32, fp );
+            else read_file( token[ 1 ], token[ 2 ], token[ 3 ], token[ 4 ], dir, fat32, fp );
+        }
+
+        // copies raw clusters or sectors of the image to a file or standard output
+        else if ( !strcmp( token[ 0 ], "dump" ) )
+        {
+            dump( &token[ 1 ], token_count - 1, fat32, fp );
+        }
+
+        // prints the printable strings of a file, or of the free clusters, with their image offsets
+        else if ( !strcmp( token[ 0 ], "strings" ) )
+        {
+            strings( &token[ 1 ], token_count - 1, fat32, fp );
+        }
+
+        // prints where a string or byte sequence occurs in the files below a directory
+        else if ( !strcmp( token[ 0 ], "grep" ) )
+        {
+            grep( &token[ 1 ], token_count - 1, fat32, fp );
+        }
+
+        // finds entries below a directory by name, type, size, attributes, cluster or date
+        else if ( !strcmp( token[ 0 ], "find" ) )
+        {
+            find( &token[ 1 ], token_count - 1, fat32, fp );
+        }
+
+        // prints the bytes stored and allocated below a directory
+        else if ( !strcmp( token[ 0 ], "du" ) )
+        {
+            du( token[ 1 ], fat32, fp );
         }
 
         // deletes the file from the file system
@@ -855,6 +9327,34 @@ int main()
             else undel( token[ 1 ], dir, fat32, fp );
         }
 
+        // builds an index of every file, its clusters, and the free clusters of the image and
+        // writes it next to the image, so the next open of the image can map it instead
+        else if ( !strcmp( token[ 0 ], "index" ) ) index_command( fat32, fp );
+
+        // copies every host file matching a glob into the working directory, or the given one
+        else if ( !strcmp( token[ 0 ], "mput" ) )
+        {
+            if ( !take_copy_options( token, &token_count, &copy_options ) )
+                ;
+            else if ( token[ 1 ] == NULL ) printf( "Error: Filename not given.\n" );
+            else mput( token[ 1 ], token[ 2 ], dir, fat32, fp, &copy_options );
+        }
+
+        // copies a host file into the image, into the working directory unless the name has a path
+        else if ( !strcmp( token[ 0 ], "put" ) )
+        {
+            if ( token[ 1 ] == NULL ) printf( "Error: Filename not given.\n" );
+            else put( token[ 1 ], token[ 2 ], dir, fat32, fp );
+        }
+
+        // rewrites a directory without its deleted entries and frees the clusters it no longer needs.
+        // deleted files of that directory can no longer be undeleted afterwards.
+        else if ( !strcmp( token[ 0 ], "compact" ) )
+        {
+            if ( token[ 1 ] == NULL ) printf( "Error: Filename not given.\n" );
+            else compact( token[ 1 ], dir, fat32, fp );
+        }
+
         else printf( "Error: Unknown command.\n" );
 
         free( working_root );